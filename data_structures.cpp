@@ -1,11 +1,14 @@
 #include "data_structures.h"
 
+#include <algorithm>
+#include <cassert>
+#include <sstream>
+
 #include "config.h"
 
 #ifdef HAVE_MALLOC_H
 #include <fstream>
 //#include <malloc.h>
-#include <sstream>
 #endif
 
 #ifdef HAVE_MALLOC_MALLOC_H
@@ -16,13 +19,678 @@ All_data_t data;
 struct tm last_data_loaded;
 std::vector<pid_t> child_pids;
 
+// Once intersections leave this few candidates, it is cheaper to verify
+// them directly than to keep intersecting with long posting lists.
+static const size_t FEW_CANDIDATES = 16;
+
+// Order posting lists by size, shortest first.  Ties are broken by
+// address so that repeated n-grams end up next to each other.
+static bool shorter_list(const Id_set_t *lhs, const Id_set_t *rhs) {
+	if (lhs->size() != rhs->size()) {
+		return lhs->size() < rhs->size();
+	}
+	return lhs < rhs;
+}
+
+// Order name entries by userid alone.
+static bool by_userid(const Name_index_t::Name_entry_t& lhs,
+	const Name_index_t::Name_entry_t& rhs) {
+
+	return lhs.first < rhs.first;
+}
+
+Name_index_t::Name_index_t(bool new_keep_exact) :
+	arena(new_keep_exact), keep_exact(new_keep_exact)
+{ }
+
+void
+Name_index_t::insert(Id_t userid, const Name_t& name, bool with_trigrams) {
+	Code_points_t code_points = Utility::code_points(name);
+	for (size_t i = 0; i < code_points.size(); ++i) {
+		this->unigrams[gram_key(code_points, i, 1)].insert(userid);
+		if ((i + 1) == code_points.size()) {
+			continue;
+		}
+		this->bigrams[gram_key(code_points, i, 2)].insert(userid);
+		if (with_trigrams && ((i + 2) < code_points.size())) {
+			this->trigrams[gram_key(code_points, i, 3)].insert(userid);
+		}
+	}
+	// Users almost always arrive in userid order, so this is nearly
+	// always an append.
+	Name_ref_t ref = this->arena.add(name);
+	Name_entries_t::iterator it = std::lower_bound(this->names.begin(),
+		this->names.end(), std::make_pair(userid, Name_ref_t()), by_userid);
+	if ((it != this->names.end()) && (it->first == userid)) {
+		it->second = ref;
+	} else {
+		this->names.insert(it, std::make_pair(userid, ref));
+	}
+	if (this->keep_exact) {
+		this->exact[name].insert(userid);
+	}
+}
+
+void
+Name_index_t::search(const Name_t& query, Result_set_t& found,
+	Result_set_t *exact) const {
+
+	Code_points_t code_points = Utility::code_points(query);
+	std::vector<const Id_set_t *> lists;
+	size_t gram_length;
+	if (code_points.empty() ||
+		!candidate_lists(code_points, lists, gram_length)) {
+
+		return;
+	}
+
+	// Exact matches are a single probe, and are matches in their own
+	// right, so there is no need to check for them while verifying.
+	if ((exact != NULL) && this->keep_exact) {
+		const Id_set_t *exact_found = this->exact.find(query);
+		if (exact_found != NULL) {
+			exact->insert(exact_found->begin(), exact_found->end());
+			found.insert(exact_found->begin(), exact_found->end());
+		}
+	}
+
+	if (code_points.size() == gram_length) {
+		// The query is itself an n-gram, so its posting list is exactly
+		// the set of matches and there is nothing to verify.
+		const Id_set_t& matches(*lists.front());
+		found.insert(matches.begin(), matches.end());
+		return;
+	}
+
+	// Intersect, starting with the rarest n-gram so that the working set
+	// is as small as possible from the outset.  If the rarest is already
+	// short, verify straight from it rather than copying it.
+	const Id_set_t& rarest(*lists.front());
+	if ((lists.size() == 1) || (rarest.size() <= FEW_CANDIDATES)) {
+		verify(rarest.begin(), rarest.end(), query, found);
+		return;
+	}
+	Result_set_t candidates;
+	std::set_intersection(
+		rarest.begin(), rarest.end(),
+		lists[1]->begin(), lists[1]->end(),
+		std::inserter(candidates, candidates.end()));
+	for (size_t i = 2;
+		(i < lists.size()) && (candidates.size() > FEW_CANDIDATES);
+		++i) {
+
+		Result_set_t intersection;
+		std::set_intersection(
+			candidates.begin(), candidates.end(),
+			lists[i]->begin(), lists[i]->end(),
+			std::inserter(intersection, intersection.end()));
+		candidates.swap(intersection);
+	}
+	verify(candidates.begin(), candidates.end(), query, found);
+}
+
+template <typename Iterator>
+void
+Name_index_t::verify(Iterator begin, Iterator end, const Name_t& query,
+	Result_set_t& found) const {
+
+	// Now, we have a list of matches from searching the n-grams.
+	// However, they may not be real matches.  Searching "greg",
+	// for example, would match "regr".  That's fine, we have
+	// seriously narrowed down our set of matches.  So, let's
+	// quickly prune these by doing full substring searches on
+	// this narrowed set.  We'll throw out anything that does
+	// not match.
+	Name_entries_t::const_iterator name_found = this->names.begin();
+	for (Iterator it = begin; it != end; ++it) {
+		name_found = seek(name_found, *it);
+		if ((name_found != this->names.end()) &&
+			(name_found->first == *it) &&
+			this->arena.contains(name_found->second, query)) {
+
+			found.insert(*it);
+		}
+	}
+}
+
+bool
+Name_index_t::fuzzy_search(const Fuzzy_pattern_t& pattern,
+	unsigned int max_distance, const Result_set_t& known,
+	const Result_set_t *within, Id_to_distance_t& distances) const {
+
+	// Each edit can destroy at most n of the query's n-grams, so any
+	// match with max_distance edits shares at least threshold of them.
+	// Trigram lists are much shorter, so use them if we have them and
+	// the query is long enough for them to rule anything out.
+	const Code_points_t& query(pattern.code_points());
+	if (query.size() <= 2 * max_distance + 1) {
+		return true;
+	}
+	size_t n = 2;
+	if (!this->trigrams.empty() && (query.size() > 3 * max_distance + 2)) {
+		n = 3;
+	}
+	size_t threshold = (query.size() - n + 1) - n * max_distance;
+	const Gram_to_id_set_t& index(grams(n));
+	static const Id_set_t no_users;
+	std::vector<const Id_set_t *> lists;
+	for (size_t i = 0; (i + n) <= query.size(); ++i) {
+		Gram_to_id_set_t::const_iterator found;
+		found = index.find(gram_key(query, i, n));
+		if (found == index.end()) {
+			lists.push_back(&no_users);
+		} else {
+			lists.push_back(&found->second);
+		}
+	}
+	std::sort(lists.begin(), lists.end(), shorter_list);
+
+	// Anything in none of the shortest (lists - threshold + 1) lists
+	// cannot reach the threshold, so merge just those to find our
+	// candidates, and only probe the longer lists for those candidates.
+	// For a common name that is a great many, nearly all of them users
+	// with the name itself, so rather than take far longer than the
+	// substring search did, leave this index to that.
+	size_t merged_lists = lists.size() - threshold + 1;
+	size_t candidates = 0;
+	for (size_t i = 0; i < merged_lists; ++i) {
+		candidates += lists[i]->size();
+	}
+	if (candidates > MAX_FUZZY_CANDIDATES) {
+		return false;
+	}
+	std::vector<Id_t> merged;
+	merged.reserve(candidates);
+	for (size_t i = 0; i < merged_lists; ++i) {
+		merged.insert(merged.end(), lists[i]->begin(), lists[i]->end());
+	}
+	std::sort(merged.begin(), merged.end());
+
+	Name_entries_t::const_iterator name_found = this->names.begin();
+	for (std::vector<Id_t>::const_iterator it = merged.begin();
+		it != merged.end();
+		/* Increment below */ ) {
+
+		Id_t userid = *it;
+		size_t count = 0;
+		while ((it != merged.end()) && (*it == userid)) {
+			++count;
+			++it;
+		}
+		// Most candidates for a common name are users with the name
+		// itself, which substring search has already found, and the
+		// other filters may have ruled out many more.
+		if ((known.find(userid) != known.end()) ||
+			((within != NULL) && (within->find(userid) == within->end()))) {
+
+			continue;
+		}
+		for (size_t i = merged_lists;
+			(i < lists.size()) && (count < threshold) &&
+			(count + (lists.size() - i) >= threshold);
+			++i) {
+
+			if (lists[i]->find(userid) != lists[i]->end()) {
+				++count;
+			}
+		}
+		if (count < threshold) {
+			continue;
+		}
+
+		name_found = seek(name_found, userid);
+		if ((name_found == this->names.end()) ||
+			(name_found->first != userid)) {
+
+			continue;
+		}
+		unsigned int distance = pattern.distance_in(
+			this->arena.begin(name_found->second),
+			this->arena.end(name_found->second));
+		if (distance > max_distance) {
+			continue;
+		}
+		Id_to_distance_t::iterator found = distances.find(userid);
+		if (found == distances.end()) {
+			distances[userid] = distance;
+		} else if (distance < found->second) {
+			found->second = distance;
+		}
+	}
+	return true;
+}
+
+const Name_ref_t *
+Name_index_t::find_name(Id_t userid) const {
+	Name_entries_t::const_iterator found = seek(this->names.begin(), userid);
+	if ((found == this->names.end()) || (found->first != userid)) {
+		return NULL;
+	}
+	return &found->second;
+}
+
+Name_index_t::Name_entries_t::const_iterator
+Name_index_t::seek(Name_entries_t::const_iterator from, Id_t userid) const {
+	// Candidates are usually close together, so gallop forwards before
+	// binary searching.
+	Name_entries_t::const_iterator end = this->names.end();
+	size_t step = 1;
+	Name_entries_t::const_iterator bound = from;
+	while ((static_cast<size_t>(end - bound) > step) &&
+		((bound + step)->first < userid)) {
+
+		bound += step;
+		step *= 2;
+	}
+	Name_entries_t::const_iterator limit = end;
+	if (static_cast<size_t>(end - bound) > step) {
+		limit = bound + step + 1;
+	}
+	return std::lower_bound(bound, limit,
+		std::make_pair(userid, Name_ref_t()), by_userid);
+}
+
+Gram_key_t
+Name_index_t::gram_key(const Code_points_t& name, size_t pos, size_t n) {
+	assert(n <= 3);
+	assert(pos + n <= name.size());
+	Gram_key_t key = 0;
+	for (size_t i = pos; i < pos + n; ++i) {
+		key = (key << 21) | (name[i] & 0x1FFFFF);
+	}
+	return key;
+}
+
+const Gram_to_id_set_t&
+Name_index_t::grams(size_t n) const {
+	if (n == 1) {
+		return this->unigrams;
+	} else if (n == 2) {
+		return this->bigrams;
+	}
+	return this->trigrams;
+}
+
+bool
+Name_index_t::candidate_lists(const Code_points_t& query,
+	std::vector<const Id_set_t *>& lists, size_t& gram_length) const {
+
+	// For each 'element' in the name
+	// For 'greg', this would be "gr", "re", and "eg", or "gre" and "reg"
+	// if we have trigrams.  Single letters have their own lists.
+	if (query.size() == 1) {
+		gram_length = 1;
+	} else if (!this->trigrams.empty() && (query.size() >= 3)) {
+		gram_length = 3;
+	} else {
+		gram_length = 2;
+	}
+	const Gram_to_id_set_t& index(grams(gram_length));
+	for (size_t i = 0; (i + gram_length) <= query.size(); ++i) {
+		Gram_to_id_set_t::const_iterator found;
+		found = index.find(gram_key(query, i, gram_length));
+		if ((found == index.end()) || found->second.empty()) {
+			return false;
+		}
+		lists.push_back(&found->second);
+	}
+
+	std::sort(lists.begin(), lists.end(), shorter_list);
+	lists.erase(std::unique(lists.begin(), lists.end()), lists.end());
+	return true;
+}
+
+Prefix_index_t::Prefix_index_t()
+{ }
+
+void
+Prefix_index_t::build(std::vector<Entry_t>& entries) {
+	std::sort(entries.begin(), entries.end());
+
+	std::string new_data;
+	std::vector<size_t> new_blocks;
+	std::vector<Id_t> new_userids;
+	new_userids.reserve(entries.size());
+	std::string previous;
+	for (size_t i = 0; i < entries.size(); ++i) {
+		std::string name(entries[i].first, 0, MAX_NAME_LENGTH);
+		size_t shared = 0;
+		if ((i % BLOCK_SIZE) == 0) {
+			new_blocks.push_back(new_data.size());
+		} else {
+			while ((shared < name.length()) &&
+				(shared < previous.length()) &&
+				(name[shared] == previous[shared])) {
+
+				++shared;
+			}
+		}
+		new_data += static_cast<char>(shared);
+		new_data += static_cast<char>(name.length() - shared);
+		new_data.append(name, shared, std::string::npos);
+		new_userids.push_back(entries[i].second);
+		previous.swap(name);
+	}
+
+	this->data.swap(new_data);
+	this->blocks.swap(new_blocks);
+	this->userids.swap(new_userids);
+}
+
+void
+Prefix_index_t::complete(const Name_t& prefix, size_t limit,
+	std::vector<Entry_t>& out) const {
+
+	if (this->blocks.empty() || (limit == 0)) {
+		return;
+	}
+
+	// Find the last block whose first name sorts before prefix; the first
+	// match can be no earlier than that.
+	size_t low = 0, high = this->blocks.size();
+	while (high - low > 1) {
+		size_t middle = (low + high) / 2;
+		const char *head = this->data.data() + this->blocks[middle];
+		std::string head_name(head + 2, static_cast<unsigned char>(head[1]));
+		if (head_name < prefix) {
+			low = middle;
+		} else {
+			high = middle;
+		}
+	}
+
+	// Decode from there, skipping names before prefix, until we run out
+	// of names starting with prefix.
+	std::string name;
+	size_t offset = this->blocks[low];
+	Id_set_t added;
+	for (size_t i = low * BLOCK_SIZE;
+		(i < this->userids.size()) && (added.size() < limit);
+		++i) {
+
+		size_t shared = static_cast<unsigned char>(this->data[offset]);
+		size_t suffix = static_cast<unsigned char>(this->data[offset + 1]);
+		name.resize(shared);
+		name.append(this->data, offset + 2, suffix);
+		offset += 2 + suffix;
+
+		if (name.compare(0, prefix.length(), prefix) < 0) {
+			continue;
+		}
+		if (name.compare(0, prefix.length(), prefix) > 0) {
+			break;
+		}
+		out.push_back(std::make_pair(name, this->userids[i]));
+		added.insert(this->userids[i]);
+	}
+}
+
+size_t
+Prefix_index_t::size() const {
+	return this->userids.size();
+}
+
+size_t
+Prefix_index_t::heap_bytes() const {
+	return Utility::heap_bytes(this->data) +
+		Utility::vector_heap_bytes(this->blocks) +
+		Utility::vector_heap_bytes(this->userids);
+}
+
+void
+Prefix_index_t::swap(Prefix_index_t& other) {
+	this->data.swap(other.data);
+	this->blocks.swap(other.blocks);
+	this->userids.swap(other.userids);
+}
+
+Fuzzy_pattern_t::Fuzzy_pattern_t(const Name_t& new_pattern) :
+	pattern(Utility::code_points(new_pattern))
+{
+	if (this->pattern.size() > MAX_LENGTH) {
+		this->pattern.resize(MAX_LENGTH);
+	}
+	std::fill(this->peq, this->peq + 256, 0ULL);
+	for (size_t i = 0; i < this->pattern.size(); ++i) {
+		unsigned int cp = this->pattern[i];
+		if (cp < 256) {
+			this->peq[cp] |= 1ULL << i;
+		} else {
+			this->other_peq[cp] |= 1ULL << i;
+		}
+	}
+}
+
+unsigned int
+Fuzzy_pattern_t::distance_in(const Name_t& text) const {
+	return distance_in(text.data(), text.data() + text.length());
+}
+
+unsigned int
+Fuzzy_pattern_t::distance_in(const char *begin, const char *end) const {
+	size_t m = this->pattern.size();
+	if (m == 0) {
+		return 0;
+	}
+	// Column of the dynamic programming matrix, held as vertical deltas:
+	// pv has bit i set if D[i+1] - D[i] == 1, mv if it is -1.  We only
+	// track the score in the last row.
+	const unsigned long long last = 1ULL << (m - 1);
+	unsigned long long pv = ~0ULL;
+	unsigned long long mv = 0;
+	unsigned int score = m;
+	unsigned int best = m;
+	size_t length = end - begin;
+	size_t pos = 0;
+	while (pos < length) {
+		unsigned long long eq = mask_of(
+			Utility::next_code_point(begin, length, pos));
+		unsigned long long xv = eq | mv;
+		unsigned long long xh = (((eq & pv) + pv) ^ pv) | eq;
+		unsigned long long ph = mv | ~(xh | pv);
+		unsigned long long mh = pv & xh;
+		if (ph & last) {
+			++score;
+		} else if (mh & last) {
+			--score;
+		}
+		// A match may start anywhere in text, so the top row stays 0 and
+		// nothing is shifted in.
+		ph <<= 1;
+		mh <<= 1;
+		pv = mh | ~(xv | ph);
+		mv = ph & xv;
+		if (score < best) {
+			best = score;
+		}
+	}
+	return best;
+}
+
+const Code_points_t&
+Fuzzy_pattern_t::code_points() const {
+	return this->pattern;
+}
+
+unsigned long long
+Fuzzy_pattern_t::mask_of(unsigned int cp) const {
+	if (cp < 256) {
+		return this->peq[cp];
+	}
+	std::map<unsigned int, unsigned long long>::const_iterator found;
+	found = this->other_peq.find(cp);
+	return (found == this->other_peq.end()) ? 0 : found->second;
+}
+
+Location_range_t::Location_range_t(Id_t new_first, Id_t new_last) :
+	first(new_first), last(new_last)
+{ }
+
+Id_filter_t::Id_filter_t(size_t expected) {
+	// About ten bits per id gives a 1% false positive rate with seven
+	// hashes.
+	size_t size = BITS_PER_WORD;
+	while (size < expected * 10) {
+		size *= 2;
+	}
+	this->bits.resize(size / BITS_PER_WORD, 0);
+	this->mask = size - 1;
+}
+
+void
+Id_filter_t::insert(Id_t id) {
+	for (unsigned int i = 0; i < HASHES; ++i) {
+		size_t n = bit(id, i);
+		this->bits[n / BITS_PER_WORD] |= 1UL << (n % BITS_PER_WORD);
+	}
+}
+
+bool
+Id_filter_t::may_contain(Id_t id) const {
+	for (unsigned int i = 0; i < HASHES; ++i) {
+		size_t n = bit(id, i);
+		if (!(this->bits[n / BITS_PER_WORD] & (1UL << (n % BITS_PER_WORD)))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+size_t
+Id_filter_t::capacity() const {
+	return (this->mask + 1) / 10;
+}
+
+size_t
+Id_filter_t::heap_bytes() const {
+	return Utility::vector_heap_bytes(this->bits);
+}
+
+void
+Id_filter_t::swap(Id_filter_t& other) {
+	this->bits.swap(other.bits);
+	std::swap(this->mask, other.mask);
+}
+
+size_t
+Id_filter_t::bit(Id_t id, unsigned int i) const {
+	// Double hashing: two independent hashes of id give all the others.
+	unsigned long long h = id;
+	h = (h ^ (h >> 16)) * 0x45d9f3bULL;
+	h = (h ^ (h >> 16)) * 0x45d9f3bULL;
+	h ^= h >> 16;
+	unsigned long long h1 = h;
+	unsigned long long h2 = ((h * 0x9e3779b97f4a7c15ULL) >> 32) | 1;
+	return static_cast<size_t>((h1 + i * h2) & this->mask);
+}
+
+namespace {
+
+// Search parameters which a composite index can combine.
+struct Composite_field_t {
+	const char *name;
+	unsigned int flag;
+	Composite_spec_t::Key_t key;
+};
+
+const Composite_field_t COMPOSITE_FIELDS[] = {
+	{ "with_picture", Composite_spec_t::WITH_PICTURE, Composite_spec_t::NO_KEY },
+	{ "single", Composite_spec_t::SINGLE, Composite_spec_t::NO_KEY },
+	{ "birthday", Composite_spec_t::BIRTHDAY, Composite_spec_t::NO_KEY },
+	{ "online", Composite_spec_t::ONLINE, Composite_spec_t::NO_KEY },
+	{ "new_users", Composite_spec_t::NEW_USERS, Composite_spec_t::NO_KEY },
+	{ "active_recently", Composite_spec_t::ACTIVE_RECENTLY,
+		Composite_spec_t::NO_KEY },
+	{ "school", 0, Composite_spec_t::SCHOOL },
+	{ "location", 0, Composite_spec_t::LOCATION }
+};
+const size_t COMPOSITE_FIELD_COUNT =
+	sizeof(COMPOSITE_FIELDS) / sizeof(COMPOSITE_FIELDS[0]);
+
+}
+
+Composite_spec_t::Composite_spec_t() :
+	flags(0), key(NO_KEY)
+{ }
+
+Composite_spec_t
+Composite_spec_t::parse(const std::string& spec) {
+	Composite_spec_t parsed;
+	std::stringstream stream(spec);
+	std::string name;
+	while (std::getline(stream, name, ',')) {
+		name = Utility::strip_whitespace(name);
+		size_t i = 0;
+		while ((i < COMPOSITE_FIELD_COUNT) &&
+			(name != COMPOSITE_FIELDS[i].name)) {
+
+			++i;
+		}
+		if (i == COMPOSITE_FIELD_COUNT) {
+			throw "Unknown filter in composite index";
+		}
+		if (COMPOSITE_FIELDS[i].key != NO_KEY) {
+			if (parsed.key != NO_KEY) {
+				throw "Composite index may have only one of school and location";
+			}
+			parsed.key = COMPOSITE_FIELDS[i].key;
+		}
+		parsed.flags |= COMPOSITE_FIELDS[i].flag;
+	}
+	if (parsed.size() < 2) {
+		throw "Composite index needs at least two filters";
+	}
+	return parsed;
+}
+
+unsigned int
+Composite_spec_t::flags_of(Params_t& params) {
+	unsigned int flags = 0;
+	for (size_t i = 0; i < COMPOSITE_FIELD_COUNT; ++i) {
+		if ((COMPOSITE_FIELDS[i].flag != 0) &&
+			(params[COMPOSITE_FIELDS[i].name] == "true")) {
+
+			flags |= COMPOSITE_FIELDS[i].flag;
+		}
+	}
+	return flags;
+}
+
+size_t
+Composite_spec_t::size() const {
+	size_t count = (this->key == NO_KEY) ? 0 : 1;
+	for (unsigned int bits = this->flags; bits != 0; bits &= bits - 1) {
+		++count;
+	}
+	return count;
+}
+
+std::string
+Composite_spec_t::str() const {
+	std::string spec;
+	for (size_t i = 0; i < COMPOSITE_FIELD_COUNT; ++i) {
+		if ((this->flags & COMPOSITE_FIELDS[i].flag) ||
+			((COMPOSITE_FIELDS[i].key != NO_KEY) &&
+			 (COMPOSITE_FIELDS[i].key == this->key))) {
+
+			if (!spec.empty()) {
+				spec += ",";
+			}
+			spec += COMPOSITE_FIELDS[i].name;
+		}
+	}
+	return spec;
+}
+
 Data_chunk_t::Data_chunk_t() :
+	firstnames(true),
+	lastnames(true),
 	online_lock(new RWLock),
 	new_users_lock(new RWLock)
 { }
 
 All_data_t::All_data_t() :
-	lock(new RWLock), last_loaded_userid(0)
+	lock(new RWLock), last_loaded_userid(0), first_reloaded_userid(0)
 {
 	for (unsigned int gender = 0; gender <= 1; ++gender) {
 		Age_to_data_t by_gender;
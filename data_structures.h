@@ -9,32 +9,357 @@
 #include <vector>
 
 #include "lock.h"
+#include "name_arena.h"
+#include "name_hash.h"
+#include "query_arena.h"
+#include "utility.h"
 
 typedef std::string Name_t;
 typedef unsigned int Id_t;
 
 typedef std::set<Id_t> Id_set_t;
+// Temporary results built while answering a request, allocated from the
+// thread's Query_arena_t.
+typedef std::set<Id_t, std::less<Id_t>, Arena_allocator_t<Id_t> >
+	Result_set_t;
+typedef std::vector<Id_t, Arena_allocator_t<Id_t> > Result_list_t;
 typedef std::map<Id_t, Id_set_t> Id_to_id_set_t;
-typedef std::map<Id_t, Name_t> Id_to_name_t;
-typedef std::map<Name_t, Id_t> Name_to_id_t;
+typedef Name_hash_t<Id_t> Name_to_id_t;
+typedef Name_hash_t<Id_set_t> Name_to_id_set_t;
 typedef std::map<std::string, std::string> Params_t;
+// Search parameters which may be given more than once, such as interest.
+typedef std::map<std::string, std::vector<Id_t> > Param_lists_t;
+
+// Locations are renumbered in depth-first pre-order, so that a location and
+// all of its descendents occupy a contiguous range of numbers.
+// For example, Canada => [3, 9], Alberta => [4, 6], Edmonton => [5, 5].
+class Location_range_t {
+public:
+	Id_t first;
+	Id_t last;
+
+	Location_range_t(Id_t new_first = 0, Id_t new_last = 0);
+};
+typedef std::map<Id_t, Location_range_t> Location_hierarchy_t;
+// Pre-order location number and userid.
+typedef std::pair<Id_t, Id_t> Location_entry_t;
+typedef std::vector<Location_entry_t> Location_column_t;
+
+// n-gram of code points, packed by Name_index_t::gram_key().
+typedef unsigned long long Gram_key_t;
+// n-gram key to list of userids.
+typedef std::map<Gram_key_t, Id_set_t> Gram_to_id_set_t;
+
+// A pattern prepared for approximate substring matching, using Myers'
+// bit-parallel edit distance algorithm.  See
+// http://www.gersteinlab.org/courses/452/09-spring/pdf/Myers.pdf
+class Fuzzy_pattern_t {
+public:
+	// Patterns longer than MAX_LENGTH code points are truncated.
+	static const size_t MAX_LENGTH = 64;
+
+	Fuzzy_pattern_t(const Name_t& new_pattern);
+
+	// The smallest edit distance, in code points, between the pattern
+	// and any substring of text.  0 means the pattern is a substring of
+	// text.
+	unsigned int distance_in(const Name_t& text) const;
+	unsigned int distance_in(const char *begin, const char *end) const;
+
+	const Code_points_t& code_points() const;
+
+private:
+	// Bit i of the mask for code point c is set if the pattern has c at
+	// position i.
+	unsigned long long mask_of(unsigned int cp) const;
+
+private:
+	Code_points_t pattern;
+	// Masks for Latin-1, which is most of what we see, and for anything
+	// else.
+	unsigned long long peq[256];
+	std::map<unsigned int, unsigned long long> other_peq;
+};
+
+// Userid to edit distance
+typedef std::map<Id_t, unsigned int> Id_to_distance_t;
+
+// A substring index over one kind of name (usernames, first names or last
+// names) for the users in one data chunk.  Names must already have been
+// processed with Utility::normalize_name, and are indexed by n-grams of
+// code points rather than bytes, so accented and non-Latin names are as
+// searchable as plain ones.
+class Name_index_t {
+public:
+	// The most userids fuzzy_search goes through in one index.
+	static const size_t MAX_FUZZY_CANDIDATES = 64;
+
+	// (userid, name) pair
+	typedef std::pair<Id_t, Name_ref_t> Name_entry_t;
+	typedef std::vector<Name_entry_t> Name_entries_t;
+
+	// Every name, in userid order.  Candidates are also in userid order,
+	// so verifying them is a single forward pass.
+	Name_entries_t names;
+
+	// Where the names are kept.  Real names repeat a great deal and are
+	// interned, usernames hardly at all and are not.
+	Name_arena_t arena;
+
+	// Name to the users with exactly that name.  Only kept if the index
+	// was created with keep_exact, as usernames are matched exactly
+	// elsewhere (see All_data_t::usernames_unprocessed).
+	Name_to_id_set_t exact;
+
+	// Users whose name contains each code point, so that single letter
+	// searches need not scan every name.
+	Gram_to_id_set_t unigrams;
+
+	// We do a variant of a suffix tree.  See
+	// http://en.wikipedia.org/wiki/Suffix_tree
+	// Consider the case, "greg" with userid 1 and
+	// "eggy" with userid 2.  We would store
+	// the following:
+	// bigrams["gr"] => [1]
+	// bigrams["re"] => [1, 2]
+	// bigrams["eg"] => [1]
+	// bigrams["gg"] => [2]
+	// bigrams["gy"] => [2]
+	Gram_to_id_set_t bigrams;
+
+	// The same, but for each three letter sequence.  Only kept when
+	// --name_trigrams is set.  Trigrams are far more selective than
+	// bigrams ("er" matches a huge number of names, "ert" does not), so
+	// there are fewer candidates to verify.
+	Gram_to_id_set_t trigrams;
+
+public:
+	Name_index_t(bool new_keep_exact = false);
+
+	// Add a name to the index.
+	void insert(Id_t userid, const Name_t& name, bool with_trigrams);
+
+	// The user's name, or NULL if they are not in the index.
+	const Name_ref_t *find_name(Id_t userid) const;
+
+	// Find all userids whose name contains query, adding them to found.
+	// If exact is not NULL, those whose name is exactly query are also
+	// added to exact.
+	void search(const Name_t& query, Result_set_t& found,
+		Result_set_t *exact) const;
+
+	// Find all userids whose name contains something within max_distance
+	// edits of pattern, recording the smallest distance found for each in
+	// distances.  Bigram (or, for long enough patterns, trigram) counts
+	// are used to narrow down the candidates, so the pattern must have
+	// more than 2 * max_distance + 1 code points.
+	// Users in known are already matches, and are not checked again, and
+	// if within is not NULL, only users in it are checked.  If counting
+	// would mean going through more than MAX_FUZZY_CANDIDATES userids,
+	// nothing is searched and we return false.
+	bool fuzzy_search(const Fuzzy_pattern_t& pattern,
+		unsigned int max_distance, const Result_set_t& known,
+		const Result_set_t *within, Id_to_distance_t& distances) const;
+
+	// Key for the n code points of name starting at pos.  Each code point
+	// fits in 21 bits, so up to three pack into a key without collisions.
+	static Gram_key_t gram_key(const Code_points_t& name, size_t pos,
+		size_t n);
+
+private:
+	bool keep_exact;
+
+private:
+	// Add those of [begin, end), a sorted range of userids, whose name
+	// contains query to found.
+	template <typename Iterator>
+	void verify(Iterator begin, Iterator end, const Name_t& query,
+		Result_set_t& found) const;
+
+	// The first entry in [from, names.end()) for userid or a later one.
+	Name_entries_t::const_iterator seek(Name_entries_t::const_iterator from,
+		Id_t userid) const;
+
+	// The index for n-grams of length n.
+	const Gram_to_id_set_t& grams(size_t n) const;
+
+	// Posting lists which every match for query must appear in, ordered
+	// from the shortest (rarest n-gram) to the longest, and the length of
+	// n-gram used.  If any n-gram has no posting list at all, nothing can
+	// match and we return false.
+	bool candidate_lists(const Code_points_t& query,
+		std::vector<const Id_set_t *>& lists, size_t& gram_length) const;
+};
+
+// A sorted list of names, for prefix (autocomplete) lookups.  Names are
+// front coded: they are stored in blocks, and within a block each name
+// only stores what differs from the name before it.  Sorted names share
+// long prefixes, so this is much smaller than storing every name in full,
+// and a lookup is a binary search over block heads followed by a short
+// sequential scan, which is in effect a flattened trie.
+class Prefix_index_t {
+public:
+	// (name, userid) pair
+	typedef std::pair<Name_t, Id_t> Entry_t;
+
+	Prefix_index_t();
+
+	// Replace the contents of the index.  entries are sorted in place.
+	void build(std::vector<Entry_t>& entries);
+
+	// Add entries whose name starts with prefix to out, in name order,
+	// stopping once limit different users have been added.
+	void complete(const Name_t& prefix, size_t limit,
+		std::vector<Entry_t>& out) const;
+
+	// Number of names stored.
+	size_t size() const;
+
+	// Bytes allocated on the heap.
+	size_t heap_bytes() const;
+
+	void swap(Prefix_index_t& other);
+
+private:
+	static const size_t BLOCK_SIZE = 16;
+	// Names may be truncated to fit the one byte lengths.
+	static const size_t MAX_NAME_LENGTH = 255;
+
+	// Each name is a byte of prefix length shared with the previous name
+	// (always 0 at the start of a block), a byte of suffix length, and the
+	// suffix itself.
+	std::string data;
+	// Offset into data of the start of each block.
+	std::vector<size_t> blocks;
+	// Userid of each name, in order.
+	std::vector<Id_t> userids;
+};
+
+// A Bloom filter over ids, to rule out cheaply that a data chunk has any
+// users with a given school or interest, before looking in its maps.
+// False positives are possible, false negatives are not.  See
+// http://en.wikipedia.org/wiki/Bloom_filter
+class Id_filter_t {
+public:
+	// Sized for about expected ids, at roughly a 1% false positive rate.
+	Id_filter_t(size_t expected = 64);
+
+	void insert(Id_t id);
+
+	// False if id was certainly never inserted.
+	bool may_contain(Id_t id) const;
+
+	// The number of ids the filter can hold before its false positive
+	// rate climbs above roughly 1%.
+	size_t capacity() const;
+
+	// Bytes allocated on the heap.
+	size_t heap_bytes() const;
+
+	void swap(Id_filter_t& other);
+
+private:
+	static const unsigned int HASHES = 7;
+	static const size_t BITS_PER_WORD = 8 * sizeof(unsigned long);
+
+	// Bit number of the i'th hash of id.
+	size_t bit(Id_t id, unsigned int i) const;
+
+private:
+	// A power of two bits, so that mask picks out a bit number.
+	std::vector<unsigned long> bits;
+	size_t mask;
+};
+
+// A combination of filters to keep a single posting list for, as set by
+// composite_index in vor.cfg, e.g. "online,with_picture" or
+// "location,single".  Any number of yes/no filters may be combined with at
+// most one keyed filter (school or location).
+class Composite_spec_t {
+public:
+	// The yes/no filters, as bits of flags.
+	enum Flag_t {
+		WITH_PICTURE = 1,
+		SINGLE = 2,
+		BIRTHDAY = 4,
+		ONLINE = 8,
+		NEW_USERS = 16,
+		ACTIVE_RECENTLY = 32
+	};
+	enum Key_t {
+		NO_KEY,
+		SCHOOL,
+		LOCATION
+	};
+
+	unsigned int flags;
+	Key_t key;
+
+	Composite_spec_t();
+
+	// Parse a comma separated list of search parameter names.  Throws if a
+	// name is not one we can combine, or fewer than two are given.
+	static Composite_spec_t parse(const std::string& spec);
+
+	// The yes/no filters which params asks for.
+	static unsigned int flags_of(Params_t& params);
+
+	// Number of filters combined.
+	size_t size() const;
+
+	// The spec in the form parse() takes.
+	std::string str() const;
+};
+
+// The users in a data chunk matching a Composite_spec_t.
+class Composite_index_t {
+public:
+	// Users matching all of the yes/no filters, for a spec without a key.
+	Id_set_t users;
+	// School id to users at the school matching the yes/no filters.
+	Id_to_id_set_t schools;
+	// Like Data_chunk_t::location_column, but only users matching the
+	// yes/no filters.
+	Location_column_t location_column;
+};
 
 // Each chunk of data represents all we know about
 // users with a given gender and age.
 class Data_chunk_t {
 public:
-	Id_to_name_t usernames;
-	Id_to_name_t firstnames;
-	Id_to_name_t lastnames;
+	Name_index_t usernames;
+	Name_index_t firstnames;
+	Name_index_t lastnames;
+	// Usernames, first names, last names, and "first last" names, for
+	// prefix lookups.  Rebuilt after a full load (see
+	// Load::build_prefix_indexes).
+	Prefix_index_t name_prefixes;
+	// The same for the few users added by reloads since then (see
+	// All_data_t::first_reloaded_userid), so that a reload need not
+	// rebuild name_prefixes.
+	Prefix_index_t recent_name_prefixes;
 	// A short list (1000) of random userids, used to speed up browsing.
 	Id_set_t shortlist;
 	Id_set_t userids;
 	// Location id to list of userids
 	Id_to_id_set_t locations;
+	// Every user's location as a pre-order location number, sorted.  All
+	// users in a location or any of its descendents are found in a single
+	// contiguous run.  Built from locations after a full load, with new
+	// users merged in after each reload (see Load::build_location_indexes).
+	Location_column_t location_column;
+	// The distinct pre-order location numbers in location_column, sorted,
+	// to tell whether any users are in a location's range at all.
+	std::vector<Id_t> location_keys;
 	// School id to list of userids
 	Id_to_id_set_t schools;
 	// Interest id to list of userids
 	Id_to_id_set_t interests;
+	// Summaries of the keys of schools and interests, kept up to date on
+	// every insert, rebuilt after a full load and resized after a reload
+	// once they fill up (see Load::build_chunk_filters).
+	Id_filter_t school_filter;
+	Id_filter_t interest_filter;
 	// Sexuality sets
 	Id_set_t heterosexual;
 	Id_set_t homosexual;
@@ -47,21 +372,11 @@ public:
 	Id_set_t new_users;
 	mutable boost::shared_ptr<RWLock> new_users_lock;
 	Id_set_t active_recently;
+	// One for each of All_data_t::composite_specs.  Rebuilt after every
+	// data load (see Load::build_composite_indexes), so one which takes in
+	// online or new users may lag those lists until the reload finishes.
+	std::vector<Composite_index_t> composites;
 
-	// We do a variant of a suffix tree.  See
-	// http://en.wikipedia.org/wiki/Suffix_tree
-	// Consider the case, "greg" with userid 1 and
-	// "eggy" with userid 2.  We would store
-	// the following:
-	// username_suffixes['g']['r'] => [1]
-	// username_suffixes['r']['e'] => [1, 2]
-	// username_suffixes['e']['g'] => [1]
-	// username_suffixes['g']['g'] => [2]
-	// username_suffixes['g']['y'] => [2]
-	Id_set_t username_suffixes[26][26];
-	Id_set_t firstname_suffixes[26][26];
-	Id_set_t lastname_suffixes[26][26];
-	
 	Data_chunk_t();
 };
 
@@ -81,11 +396,19 @@ public:
 	Name_to_id_t usernames_unprocessed;
 	Friend_list_t friends;
 	// Store location hierarchy, so that we can look up a value (say, Alberta)
-	// and get all of the child locations (e.g. Edmonton, Calgary, St. Albert).
-	Id_to_id_set_t location_hierarchy;
+	// and get the range of pre-order numbers covering it and all of its
+	// child locations (e.g. Edmonton, Calgary, St. Albert).
+	Location_hierarchy_t location_hierarchy;
+	// Combinations of filters which each data chunk keeps a single posting
+	// list for (see Data_chunk_t::composites).
+	std::vector<Composite_spec_t> composite_specs;
 	// The last userid that we loaded.  This is used for our regular reload of
 	// new users, to pull information about any new userids.
 	Id_t last_loaded_userid;
+	// The first userid loaded by a reload since the last full load, or 0
+	// if there has been none.  Names from it on are in each data chunk's
+	// recent_name_prefixes rather than its name_prefixes.
+	Id_t first_reloaded_userid;
 
 	All_data_t();
 	// Calculate the size, in bytes, of the data structure.
@@ -20,9 +20,12 @@ HttpClient::~HttpClient() {
 }
 
 std::string
-HttpClient::request(const std::string& url) {
+HttpClient::request(const std::string& url, unsigned int *failures) {
 	unsigned int retries = 0;
 	while (retries < 3) {
+		if (failures != NULL) {
+			*failures = retries;
+		}
 		try {
 			return handle_request(url);
 			break;
@@ -36,6 +39,9 @@ HttpClient::request(const std::string& url) {
 			usleep(retries * retries * 10 * 1000);
 		}
 	}
+	if (failures != NULL) {
+		*failures = retries;
+	}
 	return "";
 }
 
@@ -1,6 +1,7 @@
 #ifndef _HTTP_CLIENT_H_
 #define _HTTP_CLIENT_H_
 
+#include <cstddef>
 #include <stdexcept>
 #include <string>
 
@@ -9,7 +10,10 @@
 // to grab user information from the ruby side.
 class HttpClient {
 public:
-	static std::string request(const std::string& url);
+	// Fetch url, trying up to three times.  If retries is given, it is
+	// set to the number of failed tries.
+	static std::string request(const std::string& url,
+		unsigned int *retries = NULL);
 	~HttpClient();
 
 private:
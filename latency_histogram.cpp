@@ -0,0 +1,93 @@
+#include "latency_histogram.h"
+
+#include <cmath>
+
+Latency_histogram_t::Latency_histogram_t() :
+	counts(BUCKETS, 0)
+{ }
+
+void
+Latency_histogram_t::record(unsigned long micros) {
+	__sync_fetch_and_add(&this->counts[bucket_of(micros)], 1);
+}
+
+unsigned long
+Latency_histogram_t::count() const {
+	unsigned long total = 0;
+	for (std::vector<unsigned int>::const_iterator it = this->counts.begin();
+		it != this->counts.end();
+		++it) {
+
+		total += *it;
+	}
+	return total;
+}
+
+unsigned long
+Latency_histogram_t::percentile(double fraction) const {
+	unsigned long total = count();
+	if (total == 0) {
+		return 0;
+	}
+	unsigned long rank = static_cast<unsigned long>(std::ceil(fraction * total));
+	if (rank == 0) {
+		rank = 1;
+	}
+	unsigned long seen = 0;
+	for (size_t bucket = 0; bucket < BUCKETS; ++bucket) {
+		seen += this->counts[bucket];
+		if (seen >= rank) {
+			return bucket_limit(bucket);
+		}
+	}
+	return bucket_limit(BUCKETS - 1);
+}
+
+unsigned long
+Latency_histogram_t::count_at_most(unsigned long micros) const {
+	unsigned long total = 0;
+	for (size_t bucket = 0;
+		(bucket < BUCKETS) && (bucket_limit(bucket) <= micros);
+		++bucket) {
+
+		total += this->counts[bucket];
+	}
+	return total;
+}
+
+unsigned long
+Latency_histogram_t::sum() const {
+	unsigned long total = 0;
+	unsigned long lowest = 0;
+	for (size_t bucket = 0; bucket < BUCKETS; ++bucket) {
+		unsigned long limit = bucket_limit(bucket);
+		total += this->counts[bucket] * ((lowest + limit) / 2);
+		lowest = limit + 1;
+	}
+	return total;
+}
+
+size_t
+Latency_histogram_t::bucket_of(unsigned long micros) {
+	// Values below 2 * SUB_BUCKETS have a bucket each.
+	if (micros < 2 * SUB_BUCKETS) {
+		return micros;
+	}
+	size_t power = 0;
+	while ((micros >> power) >= 2 * SUB_BUCKETS) {
+		++power;
+	}
+	// Now SUB_BUCKETS <= (micros >> power) < 2 * SUB_BUCKETS.
+	size_t bucket = SUB_BUCKETS * power + (micros >> power);
+	return (bucket < BUCKETS) ? bucket : BUCKETS - 1;
+}
+
+unsigned long
+Latency_histogram_t::bucket_limit(size_t bucket) {
+	if (bucket < 2 * SUB_BUCKETS) {
+		return bucket;
+	}
+	size_t power = bucket / SUB_BUCKETS - 1;
+	unsigned long sub_bucket = bucket % SUB_BUCKETS + SUB_BUCKETS;
+	return ((sub_bucket + 1) << power) - 1;
+}
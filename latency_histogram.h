@@ -0,0 +1,48 @@
+#ifndef _LATENCY_HISTOGRAM_H_
+#define _LATENCY_HISTOGRAM_H_
+
+#include <cstddef>
+#include <vector>
+
+// Counts of latencies, in microseconds, in logarithmic buckets: each power
+// of two is split into SUB_BUCKETS equal parts, so any value is known to
+// within about 6%, from a microsecond up to over an hour, in a couple of
+// kilobytes.  This is the layout of HdrHistogram
+// (http://hdrhistogram.github.io/HdrHistogram/) with a fixed precision.
+class Latency_histogram_t {
+public:
+	static const size_t SUB_BUCKETS = 16;
+	// Values of 2^MAX_POWER microseconds or more are counted as the
+	// largest value.
+	static const size_t MAX_POWER = 32;
+	static const size_t BUCKETS = SUB_BUCKETS * (MAX_POWER - 3);
+
+	Latency_histogram_t();
+
+	// Count a value.  Any number of threads may do this at once.
+	void record(unsigned long micros);
+
+	// Number of values recorded.
+	unsigned long count() const;
+
+	// The value which fraction (e.g. 0.99) of recorded values are at or
+	// below, to within the precision of the buckets, or 0 if none have
+	// been recorded.
+	unsigned long percentile(double fraction) const;
+
+	// Number of values recorded in buckets wholly at or below micros.
+	unsigned long count_at_most(unsigned long micros) const;
+
+	// Total of the values recorded, taking each to be in the middle of
+	// its bucket.
+	unsigned long sum() const;
+
+	// The bucket a value falls in, and the largest value in a bucket.
+	static size_t bucket_of(unsigned long micros);
+	static unsigned long bucket_limit(size_t bucket);
+
+	// Counts in each bucket, BUCKETS of them.
+	std::vector<unsigned int> counts;
+};
+
+#endif
@@ -1,13 +1,16 @@
 #include "load.h"
 
+#include <algorithm>
 #include <boost/tokenizer.hpp>
 #include <cstdlib>
 #include <iostream>
 #include <fstream>
+#include <iterator>
 #include <sstream>
 #include <utility>
 
 #include "http_client.h"
+#include "memory_use.h"
 #include "program_options.h"
 #include "stats.h"
 #include "thread.h"
@@ -20,16 +23,32 @@ public:
 	Id_t start_userid;
 	Id_t max_userid;
 	unsigned int since;
+	// Where to add what the load did, if anywhere.
+	Load_phase_t *phase;
 
 	// Initialising constructor	
 	Load_args_t(
 		All_data_t *new_data,
 		Id_t new_start_userid = 0,
 		Id_t new_max_userid = 0,
-		unsigned int new_since = 0
+		unsigned int new_since = 0,
+		Load_phase_t *new_phase = NULL
 	);
 };
 
+// Fetch url, adding the request, any retries, the bytes received and the
+// time taken to counts.
+static std::string fetch(const std::string& url, Load_phase_t& counts) {
+	Load_clock_t clock;
+	unsigned int retries = 0;
+	std::string response = HttpClient::request(url, &retries);
+	++counts.requests;
+	counts.retries += retries;
+	counts.bytes += response.size();
+	clock.lap(counts.fetch_micros);
+	return response;
+}
+
 Load::Load(All_data_t& the_data) :
 	data(the_data) {
 }
@@ -48,8 +67,16 @@ Load::reload_online_and_new(All_data_t& the_data) {
 	return load.reload_online_and_new();
 }
 
+void
+Load::build_indexes(All_data_t& the_data) {
+	Load load(the_data);
+	load.build_indexes(0);
+}
+
 bool
 Load::load_all_data() {
+	struct timeval started;
+	gettimeofday(&started, NULL);
 	try {
 		// Get overview data
 		Id_t min_userid, max_userid;
@@ -64,8 +91,12 @@ Load::load_all_data() {
 	
 		load_common_data(min_userid, max_userid);
 		load_rare_data();
-		WriteLock lock(this->data.lock);
-		this->data.last_loaded_userid = max_userid;
+		build_indexes(0);
+		{
+			WriteLock lock(this->data.lock);
+			this->data.last_loaded_userid = max_userid;
+		}
+		record_stats(started, true);
 		return true;
 	} catch (...) {
 		if (program_options->verbose() >= 0) {
@@ -76,153 +107,68 @@ Load::load_all_data() {
 }
 
 void
-Load::load_common_data(Id_t min_userid, Id_t max_userid) {
-	// Load friend data
-	std::deque<boost::shared_ptr<Load_args_t> > args_list;
-	for (Id_t i = min_userid; i <= max_userid; i += 1000) {
-		boost::shared_ptr<Load_args_t> args(new Load_args_t(
-			&this->data,
-			i, max_userid
-		));
-		args_list.push_back(args);
-		this->threads.push_back(
-			Thread::create(load_friends,
-				static_cast<void *>(args_list.back().get()))
-		);
-		prune_threads(this->threads, args_list, program_options->min_threads(), program_options->max_threads());
-	}
-	if (program_options->verbose() >= 2) {
-		std::cout << "Waiting for friend data to finish loading" << std::endl;
-	}
-
-	// Wait for friend data to be loaded
-	prune_threads(this->threads, args_list, 0, 0);
-	assert(this->threads.empty());
-	assert(args_list.empty());
-	if (program_options->verbose() >= 2) {
-		std::cout << "Friend data loading finished" << std::endl;
-	}
-
-
-	// Load detail data
-	for (Id_t i = min_userid; i <= max_userid; i += 1000) {
-		boost::shared_ptr<Load_args_t> args(new Load_args_t(
-			&this->data,
-			i, max_userid
-		));
-		args_list.push_back(args);
-		this->threads.push_back(
-			Thread::create(load_details,
-				static_cast<void *>(args_list.back().get()))
-		);
-		prune_threads(this->threads, args_list, program_options->min_threads(), program_options->max_threads());
-	}
-	if (program_options->verbose() >= 2) {
-		std::cout << "Waiting for detail data to finish loading" << std::endl;
-	}
+Load::load_ranges(const std::string& name, void *(*loader)(void *),
+	Id_t min_userid, Id_t max_userid, Id_t step) {
 
-	// Wait for detail data to be loaded
-	prune_threads(this->threads, args_list, 0, 0);
-	assert(this->threads.empty());
-	assert(args_list.empty());
-	if (program_options->verbose() >= 2) {
-		std::cout << "Detail data loading finished" << std::endl;
-	}
-
-
-	// Load username data
-	for (Id_t i = min_userid; i <= max_userid; i += 10000) {
-		boost::shared_ptr<Load_args_t> args(new Load_args_t(
-			&this->data,
-			i, max_userid
-		));
-		args_list.push_back(args);
-		this->threads.push_back(
-			Thread::create(load_usernames,
-				static_cast<void *>(args_list.back().get()))
-		);
-		prune_threads(this->threads, args_list, program_options->min_threads(), program_options->max_threads());
-	}
-	if (program_options->verbose() >= 2) {
-		std::cout << "Waiting for username data to finish loading" << std::endl;
-	}
-
-	// Wait for username data to be loaded
-	prune_threads(this->threads, args_list, 0, 0);
-	assert(this->threads.empty());
-	assert(args_list.empty());
-	if (program_options->verbose() >= 2) {
-		std::cout << "Username data loading finished" << std::endl;
-	}
-
-
-	// Load realname data
-	for (Id_t i = min_userid; i <= max_userid; i += 10000) {
-		boost::shared_ptr<Load_args_t> args(new Load_args_t(
-			&this->data,
-			i, max_userid
-		));
-		args_list.push_back(args);
-		this->threads.push_back(
-			Thread::create(load_realnames,
-				static_cast<void *>(args_list.back().get()))
-		);
-		prune_threads(this->threads, args_list, program_options->min_threads(), program_options->max_threads());
-	}
-	if (program_options->verbose() >= 2) {
-		std::cout << "Waiting for realname data to finish loading" << std::endl;
-	}
-
-	// Wait for realname data to be loaded
-	prune_threads(this->threads, args_list, 0, 0);
-	assert(this->threads.empty());
-	assert(args_list.empty());
-	if (program_options->verbose() >= 2) {
-		std::cout << "Realname data loading finished" << std::endl;
-	}
-
-
-	// Load interests data
-	for (Id_t i = min_userid; i <= max_userid; i += 1000) {
+	Load_phase_t *phase = start_phase(name);
+	std::deque<boost::shared_ptr<Load_args_t> > args_list;
+	for (Id_t i = min_userid; i <= max_userid; i += step) {
 		boost::shared_ptr<Load_args_t> args(new Load_args_t(
 			&this->data,
-			i, max_userid
+			i, max_userid, 0, phase
 		));
 		args_list.push_back(args);
 		this->threads.push_back(
-			Thread::create(load_interests,
+			Thread::create(loader,
 				static_cast<void *>(args_list.back().get()))
 		);
 		prune_threads(this->threads, args_list, program_options->min_threads(), program_options->max_threads());
 	}
 	if (program_options->verbose() >= 2) {
-		std::cout << "Waiting for interests data to finish loading" << std::endl;
+		std::cout << "Waiting for " << name << " data to finish loading" << std::endl;
 	}
 
-	// Wait for interests data to be loaded
+	// Wait for the data to be loaded
 	prune_threads(this->threads, args_list, 0, 0);
 	assert(this->threads.empty());
 	assert(args_list.empty());
+	phase->finish();
 	if (program_options->verbose() >= 2) {
-		std::cout << "Interests data loading finished" << std::endl;
+		std::cout << name << " data loading finished" << std::endl;
 	}
+}
 
+void
+Load::load_common_data(Id_t min_userid, Id_t max_userid) {
+	load_ranges("friends", load_friends, min_userid, max_userid, 1000);
+	load_ranges("details", load_details, min_userid, max_userid, 1000);
+	load_ranges("usernames", load_usernames, min_userid, max_userid, 10000);
+	load_ranges("realnames", load_realnames, min_userid, max_userid, 10000);
+	load_ranges("interests", load_interests, min_userid, max_userid, 1000);
 
 	// Because we join on all threads before dropping out of this scope,
 	// we are sure it is safe to pass this.  Also, when the threads change
 	// any of the data, they do so using RWLocks.
-	Load_args_t args(&this->data);
+	// These run side by side, so their wall times overlap.
+	Load_phase_t *online = start_phase("online");
+	Load_phase_t *new_users = start_phase("new_users");
+	Load_phase_t *active_recently = start_phase("active_recently");
+	Load_args_t online_args(&this->data, 0, 0, 0, online);
+	Load_args_t new_users_args(&this->data, 0, 0, 0, new_users);
+	Load_args_t active_recently_args(&this->data, 0, 0, 0, active_recently);
 
 	this->threads.push_back(
-		Thread::create(load_online_statuses, static_cast<void *>(&args))
+		Thread::create(load_online_statuses,
+			static_cast<void *>(&online_args))
 	);
 
 	this->threads.push_back(
-		Thread::create(load_new_users, static_cast<void *>(&args))
+		Thread::create(load_new_users, static_cast<void *>(&new_users_args))
 	);
 
 	this->threads.push_back(
-		Thread::create(load_active_recently, static_cast<void *>(&args))
+		Thread::create(load_active_recently,
+			static_cast<void *>(&active_recently_args))
 	);
 
 	if (program_options->verbose() >= 2) {
@@ -236,13 +182,22 @@ Load::load_common_data(Id_t min_userid, Id_t max_userid) {
 		pthread_join(*itJoin, NULL);
 	}
 	this->threads.clear();
-	
+	online->finish();
+	new_users->finish();
+	active_recently->finish();
+}
+
+void
+Load::build_shortlists() {
 	// Speed up browses by keeping a denormalised set of age data so we can
 	// quickly serve unrestricted browses
-	WriteLock lock(data.lock);
+	Load_phase_t *shortlists = start_phase("shortlists");
+	Load_clock_t clock;
+	WriteLock lock(this->data.lock);
+	clock.lap(shortlists->lock_micros);
 	std::vector<Age_to_data_t>::iterator itGender;
-	for (itGender = data.data_chunks.begin();
-		itGender != data.data_chunks.end();
+	for (itGender = this->data.data_chunks.begin();
+		itGender != this->data.data_chunks.end();
 		++itGender) {
 		for (Age_to_data_t::iterator itAge = itGender->begin();
 			itAge != itGender->end();
@@ -265,6 +220,8 @@ Load::load_common_data(Id_t min_userid, Id_t max_userid) {
 				itAge->second.shortlist.end()));
 		}
 	}
+	clock.lap(shortlists->insert_micros);
+	shortlists->finish();
 }
 
 void
@@ -272,14 +229,17 @@ Load::load_rare_data() {
 	// Because we join on all threads before dropping out of this scope,
 	// we are sure it is safe to pass this.  Also, when the threads change
 	// any of the data, they do so using RWLocks.
-	Load_args_t args(&this->data);
+	Load_phase_t *birthdays = start_phase("birthdays");
+	Load_phase_t *locations = start_phase("locations");
+	Load_args_t birthdays_args(&this->data, 0, 0, 0, birthdays);
+	Load_args_t locations_args(&this->data, 0, 0, 0, locations);
 
 	this->threads.push_back(
-		Thread::create(load_birthdays, static_cast<void *>(&args))
+		Thread::create(load_birthdays, static_cast<void *>(&birthdays_args))
 	);
 
 	this->threads.push_back(
-		Thread::create(load_locations, static_cast<void *>(&args))
+		Thread::create(load_locations, static_cast<void *>(&locations_args))
 	);
 
 	if (program_options->verbose() >= 2) {
@@ -293,6 +253,427 @@ Load::load_rare_data() {
 		pthread_join(*itJoin, NULL);
 	}
 	this->threads.clear();	
+	birthdays->finish();
+	locations->finish();
+}
+
+void
+Load::build_indexes(Id_t first_new_userid) {
+	build_shortlists();
+	build_location_indexes(first_new_userid);
+	build_chunk_filters(first_new_userid);
+	build_composite_indexes();
+	build_prefix_indexes(first_new_userid);
+}
+
+void
+Load::build_location_indexes(Id_t first_new_userid) {
+	Load_phase_t *phase = start_phase("location_indexes");
+	if (program_options->verbose() >= 2) {
+		std::cout << "Building location indexes" << std::endl;
+	}
+	std::vector<Age_to_data_t>::iterator itGender;
+	for (itGender = this->data.data_chunks.begin();
+		itGender != this->data.data_chunks.end();
+		++itGender) {
+		for (Age_to_data_t::iterator itAge = itGender->begin();
+			itAge != itGender->end();
+			++itAge) {
+
+			// Gather and sort under a read lock, and only take the write
+			// lock to swap in the finished column.
+			Location_column_t new_location_column;
+			std::vector<Id_t> new_location_keys;
+			{
+				Load_clock_t clock;
+				ReadLock lock(this->data.lock);
+				clock.lap(phase->lock_micros);
+				const Data_chunk_t& chunk(itAge->second);
+				Location_column_t added;
+				for (Id_to_id_set_t::const_iterator itLocation =
+						chunk.locations.begin();
+					itLocation != chunk.locations.end();
+					++itLocation) {
+
+					// Locations missing from the hierarchy can only be
+					// found directly through locations.
+					Location_hierarchy_t::const_iterator found;
+					found = this->data.location_hierarchy.find(
+						itLocation->first);
+					if (found == this->data.location_hierarchy.end()) {
+						continue;
+					}
+					for (Id_set_t::const_iterator itUser =
+							itLocation->second.lower_bound(first_new_userid);
+						itUser != itLocation->second.end();
+						++itUser) {
+
+						added.push_back(
+							std::make_pair(found->second.first, *itUser));
+					}
+				}
+				std::sort(added.begin(), added.end());
+				if (first_new_userid == 0) {
+					new_location_column.swap(added);
+				} else if (added.empty()) {
+					clock.lap(phase->insert_micros);
+					continue;
+				} else {
+					// Everyone else is in the column already.
+					new_location_column.reserve(
+						chunk.location_column.size() + added.size());
+					std::merge(chunk.location_column.begin(),
+						chunk.location_column.end(),
+						added.begin(), added.end(),
+						std::back_inserter(new_location_column));
+				}
+
+				for (Location_column_t::const_iterator itEntry =
+						new_location_column.begin();
+					itEntry != new_location_column.end();
+					++itEntry) {
+
+					if (new_location_keys.empty() ||
+						(new_location_keys.back() != itEntry->first)) {
+
+						new_location_keys.push_back(itEntry->first);
+					}
+				}
+				clock.lap(phase->insert_micros);
+			}
+			Load_clock_t clock;
+			WriteLock lock(this->data.lock);
+			clock.lap(phase->lock_micros);
+			itAge->second.location_column.swap(new_location_column);
+			itAge->second.location_keys.swap(new_location_keys);
+			clock.lap(phase->insert_micros);
+		}
+	}
+	phase->finish();
+}
+
+// Fill filter with the keys of ids, sized for as many as there are.
+static void build_filter(const Id_to_id_set_t& ids, Id_filter_t& filter) {
+	Id_filter_t new_filter(ids.size());
+	for (Id_to_id_set_t::const_iterator it = ids.begin();
+		it != ids.end();
+		++it) {
+
+		new_filter.insert(it->first);
+	}
+	filter.swap(new_filter);
+}
+
+void
+Load::build_chunk_filters(Id_t first_new_userid) {
+	Load_phase_t *phase = start_phase("chunk_filters");
+	if (program_options->verbose() >= 2) {
+		std::cout << "Building chunk filters" << std::endl;
+	}
+	std::vector<Age_to_data_t>::iterator itGender;
+	for (itGender = this->data.data_chunks.begin();
+		itGender != this->data.data_chunks.end();
+		++itGender) {
+		for (Age_to_data_t::iterator itAge = itGender->begin();
+			itAge != itGender->end();
+			++itAge) {
+
+			// Build under a read lock, and only take the write lock to
+			// swap in the filters which changed.
+			Id_filter_t new_school_filter, new_interest_filter;
+			bool schools_outgrown, interests_outgrown;
+			{
+				Load_clock_t clock;
+				ReadLock lock(this->data.lock);
+				clock.lap(phase->lock_micros);
+				const Data_chunk_t& chunk(itAge->second);
+				schools_outgrown = (first_new_userid == 0) ||
+					(chunk.schools.size() > chunk.school_filter.capacity());
+				if (schools_outgrown) {
+					build_filter(chunk.schools, new_school_filter);
+				}
+				interests_outgrown = (first_new_userid == 0) ||
+					(chunk.interests.size() >
+					chunk.interest_filter.capacity());
+				if (interests_outgrown) {
+					build_filter(chunk.interests, new_interest_filter);
+				}
+				clock.lap(phase->insert_micros);
+			}
+			if (!schools_outgrown && !interests_outgrown) {
+				continue;
+			}
+			Load_clock_t clock;
+			WriteLock lock(this->data.lock);
+			clock.lap(phase->lock_micros);
+			if (schools_outgrown) {
+				itAge->second.school_filter.swap(new_school_filter);
+			}
+			if (interests_outgrown) {
+				itAge->second.interest_filter.swap(new_interest_filter);
+			}
+			clock.lap(phase->insert_micros);
+		}
+	}
+	phase->finish();
+}
+
+void
+Load::build_composite_indexes() {
+	Load_phase_t *phase = start_phase("composite_indexes");
+	std::vector<Composite_spec_t> specs;
+	std::vector<std::string> configured(program_options->composite_indexes());
+	for (std::vector<std::string>::const_iterator it = configured.begin();
+		it != configured.end();
+		++it) {
+
+		try {
+			specs.push_back(Composite_spec_t::parse(*it));
+		} catch (const char *error) {
+			if (program_options->verbose() >= 0) {
+				std::cout << "Ignoring composite_index " << *it << ": " <<
+					error << std::endl;
+			}
+		}
+	}
+	if (program_options->verbose() >= 2) {
+		std::cout << "Building " << specs.size() << " composite indexes" <<
+			std::endl;
+	}
+
+	// Build every chunk's indexes under a read lock, then swap them all
+	// in, with the specs they were built for, under one short write lock.
+	std::vector<std::vector<Composite_index_t> > built;
+	std::vector<Age_to_data_t>::iterator itGender;
+	{
+		Load_clock_t clock;
+		ReadLock lock(this->data.lock);
+		clock.lap(phase->lock_micros);
+		for (itGender = this->data.data_chunks.begin();
+			itGender != this->data.data_chunks.end();
+			++itGender) {
+			for (Age_to_data_t::const_iterator itAge = itGender->begin();
+				itAge != itGender->end();
+				++itAge) {
+
+				built.push_back(std::vector<Composite_index_t>(specs.size()));
+				for (size_t i = 0; i < specs.size(); ++i) {
+					build_composite_index(itAge->second, specs[i],
+						built.back()[i]);
+				}
+			}
+		}
+		clock.lap(phase->insert_micros);
+	}
+
+	Load_clock_t clock;
+	WriteLock lock(this->data.lock);
+	clock.lap(phase->lock_micros);
+	this->data.composite_specs.swap(specs);
+	std::vector<std::vector<Composite_index_t> >::iterator itBuilt;
+	itBuilt = built.begin();
+	for (itGender = this->data.data_chunks.begin();
+		itGender != this->data.data_chunks.end();
+		++itGender) {
+		for (Age_to_data_t::iterator itAge = itGender->begin();
+			itAge != itGender->end();
+			++itAge, ++itBuilt) {
+
+			itAge->second.composites.swap(*itBuilt);
+		}
+	}
+	clock.lap(phase->insert_micros);
+	phase->finish();
+}
+
+void
+Load::build_composite_index(const Data_chunk_t& chunk,
+	const Composite_spec_t& spec, Composite_index_t& index) {
+
+	// Everyone in the chunk matching all the yes/no filters.
+	std::vector<const Id_set_t *> lists;
+	if (spec.flags & Composite_spec_t::WITH_PICTURE) {
+		lists.push_back(&chunk.with_picture);
+	}
+	if (spec.flags & Composite_spec_t::SINGLE) {
+		lists.push_back(&chunk.single_users);
+	}
+	if (spec.flags & Composite_spec_t::BIRTHDAY) {
+		lists.push_back(&chunk.birthdays);
+	}
+	if (spec.flags & Composite_spec_t::ACTIVE_RECENTLY) {
+		lists.push_back(&chunk.active_recently);
+	}
+	ReadLock lock_online(chunk.online_lock);
+	if (spec.flags & Composite_spec_t::ONLINE) {
+		lists.push_back(&chunk.online);
+	}
+	ReadLock lock_new_users(chunk.new_users_lock);
+	if (spec.flags & Composite_spec_t::NEW_USERS) {
+		lists.push_back(&chunk.new_users);
+	}
+
+	// Only copy a list if we have to intersect it with another.
+	const Id_set_t *users = &chunk.userids;
+	Id_set_t intersection;
+	if (!lists.empty()) {
+		users = lists[0];
+		for (size_t i = 1; i < lists.size(); ++i) {
+			Id_set_t next;
+			std::set_intersection(users->begin(), users->end(),
+				lists[i]->begin(), lists[i]->end(),
+				std::inserter(next, next.end()));
+			intersection.swap(next);
+			users = &intersection;
+		}
+	}
+
+	switch (spec.key) {
+	case Composite_spec_t::NO_KEY:
+		if (users == &intersection) {
+			index.users.swap(intersection);
+		} else {
+			index.users = *users;
+		}
+		break;
+	case Composite_spec_t::SCHOOL:
+		for (Id_to_id_set_t::const_iterator itSchool = chunk.schools.begin();
+			itSchool != chunk.schools.end();
+			++itSchool) {
+
+			Id_set_t matching;
+			std::set_intersection(
+				itSchool->second.begin(), itSchool->second.end(),
+				users->begin(), users->end(),
+				std::inserter(matching, matching.end()));
+			if (!matching.empty()) {
+				index.schools[itSchool->first].swap(matching);
+			}
+		}
+		break;
+	case Composite_spec_t::LOCATION:
+		for (Location_column_t::const_iterator itEntry =
+				chunk.location_column.begin();
+			itEntry != chunk.location_column.end();
+			++itEntry) {
+
+			if (users->find(itEntry->second) != users->end()) {
+				index.location_column.push_back(*itEntry);
+			}
+		}
+		break;
+	}
+}
+
+// Whether entry is for a user before userid.
+static bool before_userid(const Name_index_t::Name_entry_t& entry,
+	Id_t userid) {
+
+	return entry.first < userid;
+}
+
+// Add the names which autocompletion finds chunk's users from first_userid
+// on by to entries.
+static void gather_names(const Data_chunk_t& chunk, Id_t first_userid,
+	std::vector<Prefix_index_t::Entry_t>& entries) {
+
+	const Name_index_t& usernames(chunk.usernames);
+	Name_index_t::Name_entries_t::const_iterator it;
+	for (it = std::lower_bound(usernames.names.begin(),
+			usernames.names.end(), first_userid, before_userid);
+		it != usernames.names.end();
+		++it) {
+
+		if (it->second.length == 0) continue;
+		entries.push_back(std::make_pair(
+			usernames.arena.str(it->second), it->first));
+	}
+	const Name_index_t& firstnames(chunk.firstnames);
+	const Name_index_t& lastnames(chunk.lastnames);
+	for (it = std::lower_bound(firstnames.names.begin(),
+			firstnames.names.end(), first_userid, before_userid);
+		it != firstnames.names.end();
+		++it) {
+
+		if (it->second.length == 0) continue;
+		Name_t firstname = firstnames.arena.str(it->second);
+		entries.push_back(std::make_pair(firstname, it->first));
+		const Name_ref_t *lastname;
+		lastname = lastnames.find_name(it->first);
+		if ((lastname != NULL) && (lastname->length != 0)) {
+			entries.push_back(std::make_pair(
+				firstname + " " + lastnames.arena.str(*lastname),
+				it->first));
+		}
+	}
+	for (it = std::lower_bound(lastnames.names.begin(),
+			lastnames.names.end(), first_userid, before_userid);
+		it != lastnames.names.end();
+		++it) {
+
+		if (it->second.length == 0) continue;
+		entries.push_back(std::make_pair(
+			lastnames.arena.str(it->second), it->first));
+	}
+}
+
+void
+Load::build_prefix_indexes(Id_t first_new_userid) {
+	Load_phase_t *phase = start_phase("prefix_indexes");
+	if (program_options->verbose() >= 2) {
+		std::cout << "Building prefix indexes" << std::endl;
+	}
+	// Users from first_recent_userid on go in recent_name_prefixes.
+	Id_t first_recent_userid = 0;
+	if (first_new_userid != 0) {
+		ReadLock lock(this->data.lock);
+		first_recent_userid = this->data.first_reloaded_userid;
+		if (first_recent_userid == 0) {
+			first_recent_userid = first_new_userid;
+		}
+	}
+	std::vector<Age_to_data_t>::iterator itGender;
+	for (itGender = this->data.data_chunks.begin();
+		itGender != this->data.data_chunks.end();
+		++itGender) {
+		for (Age_to_data_t::iterator itAge = itGender->begin();
+			itAge != itGender->end();
+			++itAge) {
+
+			// Gather the names under a read lock, and only take the write
+			// lock to swap in the finished index.
+			Prefix_index_t new_name_prefixes;
+			{
+				Load_clock_t clock;
+				ReadLock lock(this->data.lock);
+				clock.lap(phase->lock_micros);
+				const Data_chunk_t& chunk(itAge->second);
+				if ((first_new_userid != 0) &&
+					(chunk.userids.lower_bound(first_new_userid) ==
+					chunk.userids.end())) {
+
+					continue;
+				}
+				std::vector<Prefix_index_t::Entry_t> entries;
+				gather_names(chunk, first_recent_userid, entries);
+				new_name_prefixes.build(entries);
+				clock.lap(phase->insert_micros);
+			}
+			Load_clock_t clock;
+			WriteLock lock(this->data.lock);
+			clock.lap(phase->lock_micros);
+			if (first_new_userid == 0) {
+				itAge->second.name_prefixes.swap(new_name_prefixes);
+				Prefix_index_t().swap(itAge->second.recent_name_prefixes);
+			} else {
+				itAge->second.recent_name_prefixes.swap(new_name_prefixes);
+			}
+			clock.lap(phase->insert_micros);
+		}
+	}
+	WriteLock lock(this->data.lock);
+	this->data.first_reloaded_userid = first_recent_userid;
+	phase->finish();
 }
 
 void
@@ -307,7 +688,8 @@ Load::load_overview(Id_t &min_userid, Id_t &max_userid) {
 	if (program_options->verbose() >= 2) {
 		std::cout << url.str() << std::endl;
 	}
-	std::stringstream request(HttpClient::request(url.str()));
+	Load_phase_t *phase = start_phase("overview");
+	std::stringstream request(fetch(url.str(), *phase));
 	// ... and read the data
 	if (!request.eof()) {
 		request >> time >> comma >> min_userid >> comma >> max_userid;
@@ -317,26 +699,34 @@ Load::load_overview(Id_t &min_userid, Id_t &max_userid) {
 		if (program_options->min_userid_mult() < 0.999) {
 			min_userid = max_userid * program_options->min_userid_mult();
 		}
+		++phase->rows;
 	}
+	phase->finish();
 }
 
 bool
 Load::reload_online_and_new() {
+	struct timeval started;
+	gettimeofday(&started, NULL);
 	try {
 		Id_t min_userid, max_userid;
+		Id_t first_new_userid;
 		load_overview(min_userid, max_userid);
 		{
 			ReadLock lock(this->data.lock);
 			if (min_userid < this->data.last_loaded_userid) {
 				min_userid = this->data.last_loaded_userid + 1;
 			}
+			first_new_userid = this->data.last_loaded_userid + 1;
 		}
 		load_common_data(min_userid, max_userid);
+		build_indexes(first_new_userid);
 		{
 			WriteLock lock(this->data.lock);
 			this->data.last_loaded_userid = max_userid;
 		}
 		global_stats->incrDataReloadFast();
+		record_stats(started, false);
 		return true;
 	} catch (...) {
 		if (program_options->verbose() >= 0) {
@@ -346,6 +736,54 @@ Load::reload_online_and_new() {
 	return false;
 }
 
+Load_phase_t *
+Load::start_phase(const std::string& name) {
+	this->phases.push_back(Load_phase_t(name));
+	return &this->phases.back();
+}
+
+void
+Load::record_stats(const struct timeval& started, const bool full) const {
+	struct timeval finished;
+	gettimeofday(&finished, NULL);
+	unsigned long taken;
+	taken = (finished.tv_sec - started.tv_sec) * 1000;
+	taken += (finished.tv_usec - started.tv_usec) / 1000;
+	global_stats->setLoadTime(full, taken);
+	global_stats->setLoadPhases(full, std::vector<Load_phase_t>(
+		this->phases.begin(), this->phases.end()));
+	if (program_options->verbose() >= (full ? 1 : 2)) {
+		std::cout << (full ? "Full load" : "Reload") << " took " << taken <<
+			"ms" << std::endl;
+		for (std::deque<Load_phase_t>::const_iterator it =
+			this->phases.begin();
+			it != this->phases.end();
+			++it) {
+
+			std::cout << "  " << it->str() << std::endl;
+		}
+	}
+
+	ReadLock lock(this->data.lock);
+	size_t users = 0, data_chunks = 0;
+	for (std::vector<Age_to_data_t>::const_iterator it =
+		this->data.data_chunks.begin();
+		it != this->data.data_chunks.end();
+		++it) {
+
+		for (Age_to_data_t::const_iterator itChunk = it->begin();
+			itChunk != it->end();
+			++itChunk) {
+
+			users += itChunk->second.userids.size();
+			++data_chunks;
+		}
+	}
+	global_stats->setDataSizes(users, this->data.friends.size(),
+		this->data.usernames_unprocessed.size(), data_chunks);
+	global_stats->setStructureMemory(Memory_use_t::of(this->data));
+}
+
 void
 Load::prune_threads(std::deque<pthread_t>& threads,
 	std::deque<boost::shared_ptr<Load_args_t> >& args_list,
@@ -363,13 +801,34 @@ Load::prune_threads(std::deque<pthread_t>& threads,
 	assert(threads.size() <= max_threads);
 }
 
-std::set<std::pair<char, char> >
-string_elems(const Name_t& in) {
-	std::set<std::pair<char, char> > retval;
-	for (size_t i = 0; (i + 1) < in.length(); ++i) {
-		retval.insert(std::make_pair(in.at(i), in.at(i + 1)));
+void
+number_locations(Id_t root, const Id_to_id_set_t& children,
+	Location_hierarchy_t& hierarchy, Id_t& next_number) {
+
+	// Walk with an explicit stack; each entry is a location and the next
+	// of its children to visit.
+	std::vector<std::pair<Id_t, Id_set_t::const_iterator> > stack;
+	hierarchy[root] = Location_range_t(next_number, next_number);
+	++next_number;
+	stack.push_back(std::make_pair(root, children.find(root)->second.begin()));
+	while (!stack.empty()) {
+		Id_t location = stack.back().first;
+		if (stack.back().second == children.find(location)->second.end()) {
+			// Finished this subtree, so it ends with the last number used.
+			hierarchy[location].last = next_number - 1;
+			stack.pop_back();
+			continue;
+		}
+		Id_t child = *(stack.back().second++);
+		if (hierarchy.find(child) != hierarchy.end()) {
+			// Already numbered; the data contains a loop.
+			continue;
+		}
+		hierarchy[child] = Location_range_t(next_number, next_number);
+		++next_number;
+		stack.push_back(std::make_pair(child,
+			children.find(child)->second.begin()));
 	}
-	return retval;
 }
 
 void *
@@ -384,7 +843,9 @@ load_birthdays(void *the_data) {
 	if (program_options->verbose() >= 2) {
 		std::cout << url.str() << std::endl;
 	}
-	std::stringstream request(HttpClient::request(url.str()));
+	Load_phase_t counts;
+	std::stringstream request(fetch(url.str(), counts));
+	Load_clock_t clock;
 	
 	Id_t userid;
 	unsigned int age;
@@ -394,9 +855,16 @@ load_birthdays(void *the_data) {
 		request >> userid >> comma >> age >> comma >> sex;
 		if (age > 80) age = 0;
 		if (age < 13) age = 0;
+		clock.lap(counts.parse_micros);
 		
 		WriteLock lock(data.lock);
+		clock.lap(counts.lock_micros);
 		data.data_chunks[sex == 'f' ? 1 : 0][age].birthdays.insert(userid);
+		clock.lap(counts.insert_micros);
+		++counts.rows;
+	}
+	if (args.phase != NULL) {
+		args.phase->add(counts);
 	}
 	return static_cast<void *>(0);
 }
@@ -413,7 +881,9 @@ load_online_statuses(void *the_data) {
 	if (program_options->verbose() >= 2) {
 		std::cout << url.str() << std::endl;
 	}
-	std::stringstream request(HttpClient::request(url.str()));
+	Load_phase_t counts;
+	std::stringstream request(fetch(url.str(), counts));
+	Load_clock_t clock;
 	
 	// Drop existing data
 	{
@@ -431,6 +901,7 @@ load_online_statuses(void *the_data) {
 			}
 		}
 	}
+	clock.lap(counts.insert_micros);
 
 	Id_t userid;
 	unsigned int age;
@@ -440,9 +911,16 @@ load_online_statuses(void *the_data) {
 		request >> userid >> comma >> age >> comma >> sex;
 		if (age > 80) age = 0;
 		if (age < 13) age = 0;
+		clock.lap(counts.parse_micros);
 		
 		WriteLock lock(data.data_chunks[sex == 'f' ? 1 : 0][age].online_lock);
+		clock.lap(counts.lock_micros);
 		data.data_chunks[sex == 'f' ? 1 : 0][age].online.insert(userid);
+		clock.lap(counts.insert_micros);
+		++counts.rows;
+	}
+	if (args.phase != NULL) {
+		args.phase->add(counts);
 	}
 	return static_cast<void *>(0);
 }
@@ -459,7 +937,9 @@ load_new_users(void *the_data) {
 	if (program_options->verbose() >= 2) {
 		std::cout << url.str() << std::endl;
 	}
-	std::stringstream request(HttpClient::request(url.str()));
+	Load_phase_t counts;
+	std::stringstream request(fetch(url.str(), counts));
+	Load_clock_t clock;
 	
 	// Drop existing data
 	{
@@ -477,6 +957,7 @@ load_new_users(void *the_data) {
 			}
 		}
 	}
+	clock.lap(counts.insert_micros);
 
 	Id_t userid;
 	unsigned int age;
@@ -486,9 +967,16 @@ load_new_users(void *the_data) {
 		request >> userid >> comma >> age >> comma >> sex;
 		if (age > 80) age = 0;
 		if (age < 13) age = 0;
+		clock.lap(counts.parse_micros);
 		
 		WriteLock lock(data.data_chunks[sex == 'f' ? 1 : 0][age].new_users_lock);
+		clock.lap(counts.lock_micros);
 		data.data_chunks[sex == 'f' ? 1 : 0][age].new_users.insert(userid);
+		clock.lap(counts.insert_micros);
+		++counts.rows;
+	}
+	if (args.phase != NULL) {
+		args.phase->add(counts);
 	}
 	return static_cast<void *>(0);
 }
@@ -505,7 +993,9 @@ load_active_recently(void *the_data) {
 	if (program_options->verbose() >= 2) {
 		std::cout << url.str() << std::endl;
 	}
-	std::stringstream request(HttpClient::request(url.str()));
+	Load_phase_t counts;
+	std::stringstream request(fetch(url.str(), counts));
+	Load_clock_t clock;
 	
 	// Drop existing data
 	{
@@ -522,6 +1012,7 @@ load_active_recently(void *the_data) {
 			}
 		}
 	}
+	clock.lap(counts.insert_micros);
 
 	Id_t userid;
 	unsigned int age;
@@ -531,9 +1022,16 @@ load_active_recently(void *the_data) {
 		request >> userid >> comma >> age >> comma >> sex;
 		if (age > 80) age = 0;
 		if (age < 13) age = 0;
+		clock.lap(counts.parse_micros);
 		
 		WriteLock lock(data.lock);
+		clock.lap(counts.lock_micros);
 		data.data_chunks[sex == 'f' ? 1 : 0][age].active_recently.insert(userid);
+		clock.lap(counts.insert_micros);
+		++counts.rows;
+	}
+	if (args.phase != NULL) {
+		args.phase->add(counts);
 	}
 	return static_cast<void *>(0);
 }
@@ -543,10 +1041,6 @@ load_locations(void *the_data) {
 	Load_args_t args = *static_cast<Load_args_t *>(the_data);
 	All_data_t& data(*args.data);
 
-	// Will swap this in to the "global" data once we are done loading.
-	// This minimises the necessary lock time.
-	Id_to_id_set_t new_location_hierarchy;
-	
 	// Load location data and generate location hierarchy
 	std::stringstream url;
 	url << program_options->source_url();
@@ -555,51 +1049,54 @@ load_locations(void *the_data) {
 	if (program_options->verbose() >= 2) {
 		std::cout << url.str() << std::endl;
 	}
-	std::stringstream request(HttpClient::request(url.str()));
+	Load_phase_t counts;
+	std::stringstream request(fetch(url.str(), counts));
+	Load_clock_t clock;
 	
 	Id_t locationid, parentid;
 	char comma;
 	if (program_options->verbose() >= 3) {
 		std::cout << "Building location hierarchy" << std::endl;
 	}
-	// Temporarily store a reverse of the location hierarchy.
-	// This speeds up building hierarchy by approximately 250x.
-	Id_to_id_set_t reverse_hierarchy;
-	// Let's assume the existing set of sets is correct, and we are
-	// adding (parentid, locationid) => (2, 5).
-	// We insert 2 => 2 and 5 => 5.
-	// We then scan the existing list to see any time we have 2 in
-	// the list, and also insert 5 there.
-	// The end result is that we can look up a parent location and find
-	// all descendents of that parent.
+	// Parent location to its direct children.  Every location we hear
+	// about has an entry, even if it has no children.
+	Id_to_id_set_t children;
+	Id_set_t has_parent;
 	while (!request.eof()) {
 		request >> locationid >> comma >> parentid;
-		new_location_hierarchy[parentid].insert(parentid);
-		new_location_hierarchy[locationid].insert(locationid);
-		reverse_hierarchy[parentid].insert(parentid);
-		reverse_hierarchy[locationid].insert(locationid);
-		Id_set_t::iterator itRev;
-		Id_set_t to_add_reverse;
-		for (itRev = reverse_hierarchy[parentid].begin();
-			itRev != reverse_hierarchy[parentid].end();
-			++itRev) {
-
-			new_location_hierarchy[*itRev].insert(locationid);
-			to_add_reverse.insert(*itRev);
-		}
-		Id_set_t set_union;
-		std::set_union(reverse_hierarchy[locationid].begin(),
-			reverse_hierarchy[locationid].end(),
-			to_add_reverse.begin(), to_add_reverse.end(),
-			std::inserter(set_union, set_union.end()));
-		reverse_hierarchy[locationid].swap(set_union);
+		children[parentid].insert(locationid);
+		children[locationid];
+		if (locationid != parentid) {
+			has_parent.insert(locationid);
+		}
+		++counts.rows;
+	}
+
+	// Number every tree from its root.  Will swap this in to the "global"
+	// data once we are done loading.  This minimises the necessary lock time.
+	Location_hierarchy_t new_location_hierarchy;
+	Id_t next_number = 1;
+	for (Id_to_id_set_t::const_iterator itRoot = children.begin();
+		itRoot != children.end();
+		++itRoot) {
+
+		if (has_parent.find(itRoot->first) == has_parent.end()) {
+			number_locations(itRoot->first, children,
+				new_location_hierarchy, next_number);
+		}
 	}
 	
+	clock.lap(counts.parse_micros);
 	{
 		WriteLock lock2(data.lock);
+		clock.lap(counts.lock_micros);
 		data.location_hierarchy.swap(new_location_hierarchy);
 	}
+	clock.lap(counts.insert_micros);
 
+	if (args.phase != NULL) {
+		args.phase->add(counts);
+	}
 	return static_cast<void *>(0);
 }
 
@@ -616,16 +1113,25 @@ load_friends(void *the_data) {
 	if (program_options->verbose() >= 2) {
 		std::cout << url.str() << std::endl;
 	}
-	std::stringstream request(HttpClient::request(url.str()));
+	Load_phase_t counts;
+	std::stringstream request(fetch(url.str(), counts));
+	Load_clock_t clock;
 		
 	Id_t userid, friendid;
 	char comma;
 	while (!request.eof()) {
 		request >> userid >> comma >> friendid;
+		clock.lap(counts.parse_micros);
 		WriteLock lock2(data.lock);
+		clock.lap(counts.lock_micros);
 		data.friends[userid].insert(friendid);
+		clock.lap(counts.insert_micros);
+		++counts.rows;
 	}
 	
+	if (args.phase != NULL) {
+		args.phase->add(counts);
+	}
 	return static_cast<void *>(0);
 }
 
@@ -642,7 +1148,9 @@ load_details(void *the_data) {
 	if (program_options->verbose() >= 2) {
 		std::cout << url.str() << std::endl;
 	}
-	std::stringstream request(HttpClient::request(url.str()));
+	Load_phase_t counts;
+	std::stringstream request(fetch(url.str(), counts));
+	Load_clock_t clock;
 
 	Id_t userid;
 	unsigned int age;
@@ -657,7 +1165,9 @@ load_details(void *the_data) {
 		request >> userid >> comma >> age >> comma >> sex >> comma >> school >> comma >> loc >> comma >> sexuality >> comma >> with_picture >> comma >> single;
 		if (age > 80) age = 0;
 		if (age < 13) age = 0;
+		clock.lap(counts.parse_micros);
 		WriteLock lock(data.lock);
+		clock.lap(counts.lock_micros);
 		data.data_chunks[sex == 'f' ? 1 : 0]
 			[age].userids.insert(userid);
 		data.data_chunks[sex == 'f' ? 1 : 0]
@@ -665,6 +1175,8 @@ load_details(void *the_data) {
 		if (school != 0) {
 			data.data_chunks[sex == 'f' ? 1 : 0]
 				[age].schools[school].insert(userid);
+			data.data_chunks[sex == 'f' ? 1 : 0]
+				[age].school_filter.insert(school);
 		}
 		if (sexuality == 1) {
 			data.data_chunks[sex == 'f' ? 1 : 0]
@@ -684,8 +1196,13 @@ load_details(void *the_data) {
 			data.data_chunks[sex == 'f' ? 1 : 0]
 				[age].single_users.insert(userid);
 		}
+		clock.lap(counts.insert_micros);
+		++counts.rows;
 	}
 		
+	if (args.phase != NULL) {
+		args.phase->add(counts);
+	}
 	return static_cast<void *>(0);
 }
 
@@ -702,11 +1219,13 @@ load_usernames(void *the_data) {
 	if (program_options->verbose() >= 2) {
 		std::cout << url.str() << std::endl;
 	}
-	std::stringstream request(HttpClient::request(url.str()));
+	Load_phase_t counts;
+	std::stringstream request(fetch(url.str(), counts));
+	Load_clock_t clock;
 
+	bool with_trigrams = program_options->name_trigrams();
 	Name_t username, username_unprocessed;
 	Id_t userid;
-	std::set<std::pair<char, char> > elems;
 	unsigned int age;
 	char sex;
 	char comma;
@@ -715,26 +1234,25 @@ load_usernames(void *the_data) {
 		getline(request, username); // Some usernames have embedded spaces
 		username_unprocessed = Utility::strip_whitespace(
 			Utility::downcase(username));
-		username = Utility::strip_string(username);
+		username = Utility::normalize_name(username);
 		if (age > 80) age = 0;
 		if (age < 13) age = 0;
-		elems = string_elems(username);
+		clock.lap(counts.parse_micros);
 
 		WriteLock lock(data.lock);
+		clock.lap(counts.lock_micros);
 		data.data_chunks[sex == 'f' ? 1 : 0]
 			[age].userids.insert(userid);
 		data.usernames_unprocessed[username_unprocessed] = userid;
-		std::set<std::pair<char, char> >::const_iterator elemIt;
-		for (elemIt = elems.begin(); elemIt != elems.end(); ++elemIt) {
-			data.data_chunks[sex == 'f' ? 1 : 0][age].
-				username_suffixes[elemIt->first-'a'][elemIt->second-'a'].
-				insert(userid);
-		}
 		data.data_chunks[sex == 'f' ? 1 : 0]
-			[age].usernames[userid] = username;
-
+			[age].usernames.insert(userid, username, with_trigrams);
+		clock.lap(counts.insert_micros);
+		++counts.rows;
 	}
 
+	if (args.phase != NULL) {
+		args.phase->add(counts);
+	}
 	return static_cast<void *>(0);
 }
 
@@ -751,14 +1269,16 @@ load_realnames(void *the_data) {
 	if (program_options->verbose() >= 2) {
 		std::cout << url.str() << std::endl;
 	}
-	std::stringstream request(HttpClient::request(url.str()));
+	Load_phase_t counts;
+	std::stringstream request(fetch(url.str(), counts));
+	Load_clock_t clock;
 	
 	Name_t firstname, lastname;
 	Id_t userid;
 	unsigned int age;
 	char sex;
 	char *end_ptr;
-	std::set<std::pair<char, char> > elems_first, elems_last;
+	bool with_trigrams = program_options->name_trigrams();
 	while (!request.eof()) {
 		std::string s_buf;
 		getline(request, s_buf);
@@ -774,34 +1294,26 @@ load_realnames(void *the_data) {
 		if (++beg == tok.end()) continue;
 		sex = beg->c_str()[0];
 		if (++beg == tok.end()) continue;
-		firstname = Utility::strip_string(*beg);
+		firstname = Utility::normalize_name(*beg);
 		if (++beg == tok.end()) continue;
-		lastname = Utility::strip_string(*beg);
-		
-		elems_first = string_elems(firstname);
-		elems_last = string_elems(lastname);
+		lastname = Utility::normalize_name(*beg);
+		clock.lap(counts.parse_micros);
 
 		WriteLock lock(data.lock);
+		clock.lap(counts.lock_micros);
 		data.data_chunks[sex == 'f' ? 1 : 0]
 			[age].userids.insert(userid);
-		std::set<std::pair<char, char> >::const_iterator elemIt;
-		for (elemIt = elems_first.begin(); elemIt != elems_first.end(); ++elemIt) {
-			data.data_chunks[sex == 'f' ? 1 : 0][age].
-				firstname_suffixes[elemIt->first-'a'][elemIt->second-'a'].
-				insert(userid);
-		}
 		data.data_chunks[sex == 'f' ? 1 : 0]
-			[age].firstnames[userid] = firstname;
-
-		for (elemIt = elems_last.begin(); elemIt != elems_last.end(); ++elemIt) {
-			data.data_chunks[sex == 'f' ? 1 : 0][age].
-				lastname_suffixes[elemIt->first-'a'][elemIt->second-'a'].
-				insert(userid);
-		}
+			[age].firstnames.insert(userid, firstname, with_trigrams);
 		data.data_chunks[sex == 'f' ? 1 : 0]
-			[age].lastnames[userid] = lastname;
+			[age].lastnames.insert(userid, lastname, with_trigrams);
+		clock.lap(counts.insert_micros);
+		++counts.rows;
 	}
 
+	if (args.phase != NULL) {
+		args.phase->add(counts);
+	}
 	return static_cast<void *>(0);
 }
 
@@ -818,7 +1330,9 @@ load_interests(void *the_data) {
 	if (program_options->verbose() >= 2) {
 		std::cout << url.str() << std::endl;
 	}
-	std::stringstream request(HttpClient::request(url.str()));
+	Load_phase_t counts;
+	std::stringstream request(fetch(url.str(), counts));
+	Load_clock_t clock;
 	
 	Id_t userid;
 	unsigned int age;
@@ -834,12 +1348,20 @@ load_interests(void *the_data) {
 		std::string s_buf;
 		getline(request, s_buf);
 		std::stringstream interests_stream(s_buf);
+		clock.lap(counts.parse_micros);
 		WriteLock lock2(data.lock);
+		clock.lap(counts.lock_micros);
 		while (interests_stream >> comma >> interest) {
 			data.data_chunks[sex == 'f' ? 1 : 0][age].interests[interest].insert(userid);
+			data.data_chunks[sex == 'f' ? 1 : 0][age].interest_filter.insert(interest);
 		}
+		clock.lap(counts.insert_micros);
+		++counts.rows;
 	}
 
+	if (args.phase != NULL) {
+		args.phase->add(counts);
+	}
 	return static_cast<void *>(0);
 }
 
@@ -848,10 +1370,12 @@ Load_args_t::Load_args_t(
 	All_data_t *new_data,
 	Id_t new_start_userid,
 	Id_t new_max_userid,
-	unsigned int new_since
+	unsigned int new_since,
+	Load_phase_t *new_phase
 ) :
 	data(new_data),
 	start_userid(new_start_userid),
 	max_userid(new_max_userid),
-	since(new_since)
+	since(new_since),
+	phase(new_phase)
 { }
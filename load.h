@@ -4,8 +4,11 @@
 #include <boost/shared_ptr.hpp>
 #include <deque>
 #include <pthread.h>
+#include <string>
+#include <sys/time.h>
 
 #include "data_structures.h"
+#include "load_phase.h"
 #include "thread.h"
 #include "lock.h"
 
@@ -20,6 +23,11 @@ public:
 	// Reload only the online and new user data.
 	// Return true if the data load succeeded.
 	static bool reload_online_and_new(All_data_t& the_data);
+
+	// Build the indexes derived from the loaded data, as a load does once
+	// it has everything.  For data made some other way, such as by a
+	// benchmark.
+	static void build_indexes(All_data_t& the_data);
 	
 private:
 	friend void* load_friends(void *);
@@ -40,10 +48,59 @@ private:
 	// Load most data, for a given range of userids, from the server.
 	// See load_rare_data.
 	void load_common_data(Id_t min_userid, Id_t max_userid);
+
+	// Run loader over min_userid to max_userid, step users at a time, on
+	// as many threads as we are allowed, as the phase called name.
+	void load_ranges(const std::string& name, void *(*loader)(void *),
+		Id_t min_userid, Id_t max_userid, Id_t step);
 	
 	// Load data that does not change very often.  We only need to load this
 	// data on initial startup and then once per day.
 	void load_rare_data();
+
+	// Run all of the build_ functions below, in order.  Users from
+	// first_new_userid on are those added since the last load, or all of
+	// them after a full load, when first_new_userid is 0.
+	void build_indexes(Id_t first_new_userid);
+
+	// Rebuild, for each data chunk, a random sample of up to 1000 of its
+	// users, to serve unrestricted browses from.
+	void build_shortlists();
+
+	// Rebuild, for each data chunk, the column of users sorted by the
+	// pre-order number of their location.  This lets a location search,
+	// including all descendent locations, be answered with a single range
+	// scan per chunk.  After a reload only the new users are merged in.
+	void build_location_indexes(Id_t first_new_userid);
+
+	// Rebuild the filters summarising which schools and interests each
+	// data chunk has, sized for the number it has now.  The loaders add
+	// to the filters as they go, so after a reload only those which have
+	// outgrown their size are rebuilt.
+	void build_chunk_filters(Id_t first_new_userid);
+
+	// Rebuild, for each data chunk, the composite indexes configured by
+	// composite_index.  Must follow build_location_indexes.
+	void build_composite_indexes();
+
+	// Fill in index with the users in chunk matching spec.
+	static void build_composite_index(const Data_chunk_t& chunk,
+		const Composite_spec_t& spec, Composite_index_t& index);
+
+	// Rebuild, for each data chunk, the sorted list of names used for
+	// autocompletion.  After a reload only the names of users added since
+	// the last full load are indexed again, and only in chunks which
+	// gained users.
+	void build_prefix_indexes(Id_t first_new_userid);
+
+	// Begin a new phase of the load, called name.  The phase stays where
+	// it is until we are done.
+	Load_phase_t *start_phase(const std::string& name);
+
+	// Tell global_stats how long a load begun at started took, and each
+	// phase of it, how big the data now is, and how much memory each part
+	// of it takes.  Log the phases too.
+	void record_stats(const struct timeval& started, const bool full) const;
 	
 	// Prune the list of running threads, so our virtual memory
 	// usage doesn't go sky high.  We'll join on the threads in
@@ -67,6 +124,10 @@ private:
 	
 	// Keep track of the threads we've spawned.
 	std::deque<pthread_t> threads;
+
+	// What each phase of the load did, in the order they started.  A
+	// deque, so that the loading threads' pointers into it stay good.
+	std::deque<Load_phase_t> phases;
 	
 private:
 	Load();
@@ -76,10 +137,10 @@ private:
 	Load& operator=(const Load& rhs);
 };
 
-// Convert input string into a set of char-pairs.
-// For example, "chris" becomes [[ch],[hr],[ri],[is]]
-std::set<std::pair<char, char> >
-string_elems(const Name_t& in);
+// Number root and all of its descendents in depth-first pre-order,
+// starting at next_number, and record each location's range in hierarchy.
+void number_locations(Id_t root, const Id_to_id_set_t& children,
+	Location_hierarchy_t& hierarchy, Id_t& next_number);
 
 // Load the list of friends so we can quickly find friends_of.
 void *load_friends(void *data);
@@ -0,0 +1,76 @@
+#include "load_phase.h"
+
+#include <sstream>
+
+// Microseconds from from to to.
+static unsigned long micros_between(const struct timeval& from,
+	const struct timeval& to) {
+
+	return (to.tv_sec - from.tv_sec) * 1000000 + (to.tv_usec - from.tv_usec);
+}
+
+Load_phase_t::Load_phase_t(const std::string& new_name) :
+	name(new_name), requests(0), retries(0), bytes(0), rows(0),
+	fetch_micros(0), parse_micros(0), lock_micros(0), insert_micros(0),
+	wall_micros(0) {
+
+	gettimeofday(&this->started, NULL);
+}
+
+void
+Load_phase_t::add(const Load_phase_t& part) {
+	__sync_fetch_and_add(&this->requests, part.requests);
+	__sync_fetch_and_add(&this->retries, part.retries);
+	__sync_fetch_and_add(&this->bytes, part.bytes);
+	__sync_fetch_and_add(&this->rows, part.rows);
+	__sync_fetch_and_add(&this->fetch_micros, part.fetch_micros);
+	__sync_fetch_and_add(&this->parse_micros, part.parse_micros);
+	__sync_fetch_and_add(&this->lock_micros, part.lock_micros);
+	__sync_fetch_and_add(&this->insert_micros, part.insert_micros);
+}
+
+void
+Load_phase_t::finish() {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	this->wall_micros = micros_between(this->started, now);
+}
+
+unsigned long
+Load_phase_t::rows_per_second() const {
+	if (this->wall_micros == 0) {
+		return 0;
+	}
+	return static_cast<unsigned long>(
+		static_cast<double>(this->rows) * 1000000 / this->wall_micros);
+}
+
+std::string
+Load_phase_t::str() const {
+	std::stringstream out;
+	out << this->name << ": " << this->wall_micros / 1000 << "ms";
+	if (this->requests != 0) {
+		out << ", " << this->rows << " rows (" << rows_per_second() <<
+			"/s), " << this->bytes << " bytes in " << this->requests <<
+			" requests (" << this->retries << " retries); fetch " <<
+			this->fetch_micros / 1000 << "ms, parse " <<
+			this->parse_micros / 1000 << "ms,";
+	} else {
+		out << ";";
+	}
+	out << " lock wait " << this->lock_micros / 1000 << "ms, insert " <<
+		this->insert_micros / 1000 << "ms";
+	return out.str();
+}
+
+Load_clock_t::Load_clock_t() {
+	gettimeofday(&this->last, NULL);
+}
+
+void
+Load_clock_t::lap(unsigned long& micros) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	micros += micros_between(this->last, now);
+	this->last = now;
+}
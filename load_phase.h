@@ -0,0 +1,65 @@
+#ifndef _LOAD_PHASE_H_
+#define _LOAD_PHASE_H_
+
+#include <string>
+#include <sys/time.h>
+
+// What one phase of a data load (such as fetching friends, or building the
+// location indexes) did, summed over all the threads doing it, so we can
+// see where load time goes, and whether it is the site or us.  Times are
+// in microseconds, and except for wall_micros are summed over threads, so
+// may add up to more than the phase took.
+class Load_phase_t {
+public:
+	std::string name;
+	// HTTP requests made, retries after failures, and bytes received.
+	unsigned long requests;
+	unsigned long retries;
+	unsigned long bytes;
+	// Rows of data read.
+	unsigned long rows;
+	// Waiting for the site.
+	unsigned long fetch_micros;
+	// Parsing what it sent.
+	unsigned long parse_micros;
+	// Waiting for the data's write lock.
+	unsigned long lock_micros;
+	// Adding rows to the data, with the lock held.
+	unsigned long insert_micros;
+	// From when we were made to finish().
+	unsigned long wall_micros;
+
+	// The phase starts now.
+	Load_phase_t(const std::string& new_name = "");
+
+	// Add the counts and times of one thread's part of the phase.  Any
+	// number of threads may do this at once.
+	void add(const Load_phase_t& part);
+
+	// The phase finishes now.
+	void finish();
+
+	// Rows read per second of wall time.
+	unsigned long rows_per_second() const;
+
+	// A one line summary, for logging.
+	std::string str() const;
+
+private:
+	struct timeval started;
+};
+
+// Times the successive steps of loading, adding each to a total.
+class Load_clock_t {
+public:
+	Load_clock_t();
+
+	// Add the microseconds since the last lap (or since we were made) to
+	// micros.
+	void lap(unsigned long& micros);
+
+private:
+	struct timeval last;
+};
+
+#endif
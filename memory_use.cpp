@@ -0,0 +1,158 @@
+#include "memory_use.h"
+
+#include <sstream>
+
+#include "lock.h"
+#include "utility.h"
+
+size_t
+Memory_use_t::total() const {
+	size_t bytes = 0;
+	for (Parts_t::const_iterator it = this->structures.begin();
+		it != this->structures.end();
+		++it) {
+
+		bytes += it->second;
+	}
+	return bytes;
+}
+
+Memory_use_t
+Memory_use_t::of(const All_data_t& data) {
+	Memory_use_t use;
+	static const char *SEXES[] = { "m", "f" };
+	for (size_t sex = 0; sex < data.data_chunks.size(); ++sex) {
+		for (Age_to_data_t::const_iterator itChunk =
+			data.data_chunks[sex].begin();
+			itChunk != data.data_chunks[sex].end();
+			++itChunk) {
+
+			const Data_chunk_t& chunk(itChunk->second);
+			Parts_t parts;
+			// The chunk itself, in its map entry, and its locks.
+			add(parts, "chunk_headers", Utility::heap_bytes(
+				4 * sizeof(void *) + sizeof(Age_to_data_t::value_type)) +
+				2 * Utility::heap_bytes(sizeof(RWLock)));
+
+			const Name_index_t *names[] = {
+				&chunk.usernames, &chunk.firstnames, &chunk.lastnames
+			};
+			const char *name_parts[] = {
+				"usernames", "firstnames", "lastnames"
+			};
+			for (size_t i = 0; i < 3; ++i) {
+				size_t text = names[i]->arena.heap_bytes();
+				add(parts, name_parts[i], heap_bytes(*names[i]) - text);
+				add(parts, "name_strings", text);
+			}
+			add(parts, "name_prefixes", chunk.name_prefixes.heap_bytes() +
+				chunk.recent_name_prefixes.heap_bytes());
+			add(parts, "userids", heap_bytes(chunk.userids) +
+				heap_bytes(chunk.shortlist));
+			add(parts, "locations", heap_bytes(chunk.locations) +
+				Utility::vector_heap_bytes(chunk.location_column) +
+				Utility::vector_heap_bytes(chunk.location_keys));
+			add(parts, "schools", heap_bytes(chunk.schools));
+			add(parts, "interests", heap_bytes(chunk.interests));
+			add(parts, "chunk_filters", chunk.school_filter.heap_bytes() +
+				chunk.interest_filter.heap_bytes());
+			add(parts, "sexuality", heap_bytes(chunk.heterosexual) +
+				heap_bytes(chunk.homosexual) + heap_bytes(chunk.bisexual));
+			size_t flags = heap_bytes(chunk.with_picture) +
+				heap_bytes(chunk.single_users) +
+				heap_bytes(chunk.birthdays) +
+				heap_bytes(chunk.active_recently);
+			{
+				ReadLock lock(chunk.online_lock);
+				flags += heap_bytes(chunk.online);
+			}
+			{
+				ReadLock lock(chunk.new_users_lock);
+				flags += heap_bytes(chunk.new_users);
+			}
+			add(parts, "flags", flags);
+			size_t composites = Utility::vector_heap_bytes(chunk.composites);
+			for (std::vector<Composite_index_t>::const_iterator it =
+				chunk.composites.begin();
+				it != chunk.composites.end();
+				++it) {
+
+				composites += heap_bytes(*it);
+			}
+			add(parts, "composites", composites);
+
+			size_t chunk_bytes = 0;
+			for (Parts_t::const_iterator it = parts.begin();
+				it != parts.end();
+				++it) {
+
+				add(use.structures, it->first, it->second);
+				chunk_bytes += it->second;
+			}
+			std::stringstream name;
+			name << (sex < 2 ? SEXES[sex] : "x") << "_" << itChunk->first;
+			use.chunks.push_back(std::make_pair(name.str(), chunk_bytes));
+		}
+	}
+	add(use.structures, "friends", heap_bytes(data.friends));
+	add(use.structures, "username_lookup",
+		data.usernames_unprocessed.heap_bytes());
+	add(use.structures, "location_hierarchy",
+		Utility::tree_heap_bytes(data.location_hierarchy));
+	return use;
+}
+
+size_t
+Memory_use_t::heap_bytes(const Id_set_t& set) {
+	return Utility::tree_heap_bytes(set);
+}
+
+size_t
+Memory_use_t::heap_bytes(const Id_to_id_set_t& map) {
+	size_t bytes = Utility::tree_heap_bytes(map);
+	for (Id_to_id_set_t::const_iterator it = map.begin();
+		it != map.end();
+		++it) {
+
+		bytes += heap_bytes(it->second);
+	}
+	return bytes;
+}
+
+size_t
+Memory_use_t::heap_bytes(const Gram_to_id_set_t& map) {
+	size_t bytes = Utility::tree_heap_bytes(map);
+	for (Gram_to_id_set_t::const_iterator it = map.begin();
+		it != map.end();
+		++it) {
+
+		bytes += heap_bytes(it->second);
+	}
+	return bytes;
+}
+
+size_t
+Memory_use_t::heap_bytes(const Name_index_t& index) {
+	size_t (*set_bytes)(const Id_set_t&) = &Memory_use_t::heap_bytes;
+	return Utility::vector_heap_bytes(index.names) +
+		index.arena.heap_bytes() + index.exact.heap_bytes(set_bytes) +
+		heap_bytes(index.unigrams) + heap_bytes(index.bigrams) +
+		heap_bytes(index.trigrams);
+}
+
+size_t
+Memory_use_t::heap_bytes(const Composite_index_t& index) {
+	return heap_bytes(index.users) + heap_bytes(index.schools) +
+		Utility::vector_heap_bytes(index.location_column);
+}
+
+void
+Memory_use_t::add(Parts_t& parts, const std::string& name, size_t bytes) {
+	for (Parts_t::iterator it = parts.begin(); it != parts.end(); ++it) {
+		if (it->first == name) {
+			it->second += bytes;
+			return;
+		}
+	}
+	parts.push_back(std::make_pair(name, bytes));
+}
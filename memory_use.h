@@ -0,0 +1,45 @@
+#ifndef _MEMORY_USE_H_
+#define _MEMORY_USE_H_
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "data_structures.h"
+
+// How much memory each part of the data takes, so that we can tell which
+// is growing, and measure what a change of layout saves.  These are
+// estimates from the layouts of the GNU ISO C++ Library and glibc malloc
+// (see Utility::heap_bytes), not measurements, but they are made the same
+// way every time, so they compare like with like.
+class Memory_use_t {
+public:
+	// Name of a part to its bytes.
+	typedef std::vector<std::pair<std::string, size_t> > Parts_t;
+
+	// Bytes in each kind of structure, over all data chunks, such as
+	// "schools" or "friends".
+	Parts_t structures;
+	// Bytes in each data chunk, named by sex and age, such as "f_25".
+	Parts_t chunks;
+
+	// Sum of structures.
+	size_t total() const;
+
+	// Measure data.  The caller must hold a read lock on it.
+	static Memory_use_t of(const All_data_t& data);
+
+	// Bytes allocated on the heap by each kind of container, and by what
+	// the entries point to in turn.
+	static size_t heap_bytes(const Id_set_t& set);
+	static size_t heap_bytes(const Id_to_id_set_t& map);
+	static size_t heap_bytes(const Gram_to_id_set_t& map);
+	static size_t heap_bytes(const Name_index_t& index);
+	static size_t heap_bytes(const Composite_index_t& index);
+
+private:
+	// Add bytes to the part called name, adding the part if need be.
+	static void add(Parts_t& parts, const std::string& name, size_t bytes);
+};
+
+#endif
@@ -0,0 +1,350 @@
+#include "metrics_server.h"
+
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <netinet/in.h>
+#include <sstream>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <vector>
+
+#include "latency_histogram.h"
+#include "load_phase.h"
+#include "memory_use.h"
+#include "program_options.h"
+#include "query_arena.h"
+#include "stats.h"
+#include "thread.h"
+
+// Upper bounds of the histogram buckets we report, in microseconds.
+// Latency_histogram_t keeps far more, but the bounds need not line up
+// exactly with its buckets, as those are only about 6% wide.
+static const unsigned long HISTOGRAM_BOUNDS[] = {
+	100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000,
+	500000, 1000000, 2500000, 5000000, 10000000
+};
+
+// A scraper hanging up on us must not kill the searches with SIGPIPE.
+#ifdef MSG_NOSIGNAL
+static const int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+static const int SEND_FLAGS = 0;
+#endif
+
+// The HELP and TYPE lines which come before a metric's samples.
+static void describe(std::ostream& out, const std::string& name,
+	const std::string& type, const std::string& help) {
+
+	out << "# HELP " << name << " " << help << "\n";
+	out << "# TYPE " << name << " " << type << "\n";
+}
+
+// Samples of a histogram of latencies, in seconds, for one shape.
+static void histogram(std::ostream& out, const std::string& name,
+	const std::string& shape, const Latency_histogram_t& latencies) {
+
+	const size_t bounds =
+		sizeof(HISTOGRAM_BOUNDS) / sizeof(HISTOGRAM_BOUNDS[0]);
+	for (size_t i = 0; i < bounds; ++i) {
+		out << name << "_bucket{shape=\"" << shape << "\",le=\"" <<
+			HISTOGRAM_BOUNDS[i] / 1e6 << "\"} " <<
+			latencies.count_at_most(HISTOGRAM_BOUNDS[i]) << "\n";
+	}
+	out << name << "_bucket{shape=\"" << shape << "\",le=\"+Inf\"} " <<
+		latencies.count() << "\n";
+	out << name << "_sum{shape=\"" << shape << "\"} " <<
+		latencies.sum() / 1e6 << "\n";
+	out << name << "_count{shape=\"" << shape << "\"} " <<
+		latencies.count() << "\n";
+}
+
+Metrics_server_t::Metrics_server_t(int port) :
+	sock(-1) {
+
+	if (port == 0) {
+		return;
+	}
+	if ((this->sock = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+		throw "Unable to create metrics socket";
+	}
+	int opt = 1;
+	setsockopt(this->sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+	struct sockaddr_in address;
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = INADDR_ANY;
+	address.sin_port = htons(port);
+	// The child we are replacing may not have let go of it yet.
+	for (unsigned int retries = 0; retries < 10; ++retries) {
+		if (bind(this->sock, (struct sockaddr *)&address,
+			sizeof(address)) != -1) {
+
+			if (listen(this->sock, 8) == -1) {
+				break;
+			}
+			return;
+		}
+		sleep(1);
+	}
+	if (program_options->verbose() >= 0) {
+		std::cout << "Unable to listen on metrics port " << port <<
+			", carrying on without" << std::endl;
+	}
+	close(this->sock);
+	this->sock = -1;
+}
+
+Metrics_server_t::~Metrics_server_t() {
+	if (this->sock != -1) {
+		close(this->sock);
+	}
+}
+
+void
+Metrics_server_t::threaded_accept() {
+	if (this->sock != -1) {
+		this->thread = Thread::create(metrics_accept_connections,
+			static_cast<void *>(this), false);
+	}
+}
+
+std::string
+Metrics_server_t::metrics() {
+	std::stringstream out;
+	out << std::setprecision(12);
+
+	describe(out, "vor_uptime_seconds", "gauge",
+		"Seconds since the server started.");
+	out << "vor_uptime_seconds " << global_stats->getRunningTime() << "\n";
+	describe(out, "vor_memory_bytes", "gauge",
+		"Resident memory of the serving process.");
+	out << "vor_memory_bytes " <<
+		static_cast<unsigned long>(global_stats->getMemoryUse()) * 1024 <<
+		"\n";
+	Memory_use_t use = global_stats->getStructureMemory();
+	describe(out, "vor_structure_bytes", "gauge",
+		"Estimated memory taken by each part of the data.");
+	for (Memory_use_t::Parts_t::const_iterator it = use.structures.begin();
+		it != use.structures.end();
+		++it) {
+
+		out << "vor_structure_bytes{structure=\"" << it->first << "\"} " <<
+			it->second << "\n";
+	}
+	describe(out, "vor_query_arena_bytes", "gauge",
+		"Memory held for the temporaries of searches.");
+	out << "vor_query_arena_bytes " << Query_arena_t::bytes_held() << "\n";
+	describe(out, "vor_in_flight", "gauge", "Searches being run now.");
+	out << "vor_in_flight " << global_stats->getInFlight() << "\n";
+
+	std::map<std::string, unsigned int> search_reqs =
+		global_stats->getSearchReqs();
+	describe(out, "vor_searches_total", "counter", "Searches run.");
+	out << "vor_searches_total " << search_reqs["search_reqs"] << "\n";
+	search_reqs.erase("search_reqs");
+	describe(out, "vor_search_params_total", "counter",
+		"Searches using each parameter.");
+	for (std::map<std::string, unsigned int>::const_iterator it =
+		search_reqs.begin();
+		it != search_reqs.end();
+		++it) {
+
+		out << "vor_search_params_total{param=\"" << it->first << "\"} " <<
+			it->second << "\n";
+	}
+	describe(out, "vor_search_seconds_total", "counter",
+		"Time spent running searches.");
+	out << "vor_search_seconds_total " <<
+		global_stats->getSearchTime() / 1e3 << "\n";
+	describe(out, "vor_search_network_seconds_total", "counter",
+		"Time spent answering searches, including the network.");
+	out << "vor_search_network_seconds_total " <<
+		global_stats->getSearchTimeNetwork() / 1e3 << "\n";
+
+	describe(out, "vor_data_reloads_total", "counter",
+		"Full loads, and reloads of new and online users.");
+	out << "vor_data_reloads_total{kind=\"full\"} " <<
+		global_stats->getDataReloadFull() << "\n";
+	out << "vor_data_reloads_total{kind=\"fast\"} " <<
+		global_stats->getDataReloadFast() << "\n";
+	describe(out, "vor_load_duration_seconds", "gauge",
+		"How long the last load of each kind took.");
+	out << "vor_load_duration_seconds{kind=\"full\"} " <<
+		global_stats->getLoadTimeFull() / 1e3 << "\n";
+	out << "vor_load_duration_seconds{kind=\"fast\"} " <<
+		global_stats->getLoadTimeFast() / 1e3 << "\n";
+
+	const char *kinds[] = { "full", "fast" };
+	std::vector<Load_phase_t> phases[2] = {
+		global_stats->getLoadPhases(true), global_stats->getLoadPhases(false)
+	};
+	describe(out, "vor_load_phase_seconds", "gauge",
+		"Time each phase of the last load of each kind took, and spent in "
+		"each step, summed over its threads.");
+	for (size_t i = 0; i < 2; ++i) {
+		for (std::vector<Load_phase_t>::const_iterator it = phases[i].begin();
+			it != phases[i].end();
+			++it) {
+
+			const unsigned long micros[] = {
+				it->wall_micros, it->fetch_micros, it->parse_micros,
+				it->lock_micros, it->insert_micros
+			};
+			const char *steps[] = {
+				"wall", "fetch", "parse", "lock_wait", "insert"
+			};
+			for (size_t j = 0; j < 5; ++j) {
+				out << "vor_load_phase_seconds{kind=\"" << kinds[i] <<
+					"\",phase=\"" << it->name << "\",step=\"" << steps[j] <<
+					"\"} " << micros[j] / 1e6 << "\n";
+			}
+		}
+	}
+	const char *counts[] = { "rows", "bytes", "requests", "retries" };
+	const char *counts_help[] = {
+		"Rows read by each phase of the last load of each kind.",
+		"Bytes fetched by each phase of the last load of each kind.",
+		"HTTP requests made by each phase of the last load of each kind.",
+		"HTTP requests retried by each phase of the last load of each kind."
+	};
+	for (size_t k = 0; k < 4; ++k) {
+		std::string name = std::string("vor_load_phase_") + counts[k];
+		describe(out, name, "gauge", counts_help[k]);
+		for (size_t i = 0; i < 2; ++i) {
+			for (std::vector<Load_phase_t>::const_iterator it =
+				phases[i].begin();
+				it != phases[i].end();
+				++it) {
+
+				const unsigned long values[] = {
+					it->rows, it->bytes, it->requests, it->retries
+				};
+				out << name << "{kind=\"" << kinds[i] << "\",phase=\"" <<
+					it->name << "\"} " << values[k] << "\n";
+			}
+		}
+	}
+
+	describe(out, "vor_users", "gauge", "Users loaded.");
+	out << "vor_users " << global_stats->getUsers() << "\n";
+	describe(out, "vor_friend_lists", "gauge", "Users with friends loaded.");
+	out << "vor_friend_lists " << global_stats->getFriendLists() << "\n";
+	describe(out, "vor_usernames", "gauge", "Usernames indexed.");
+	out << "vor_usernames " << global_stats->getUsernames() << "\n";
+	describe(out, "vor_data_chunks", "gauge",
+		"Data chunks, one for each gender and age.");
+	out << "vor_data_chunks " << global_stats->getDataChunks() << "\n";
+
+	std::vector<std::string> shapes = global_stats->getShapes();
+	describe(out, "vor_search_duration_seconds", "histogram",
+		"Time taken by each shape of search.");
+	for (std::vector<std::string>::const_iterator it = shapes.begin();
+		it != shapes.end();
+		++it) {
+
+		histogram(out, "vor_search_duration_seconds", *it,
+			global_stats->getSearchLatency(*it));
+	}
+	describe(out, "vor_search_network_duration_seconds", "histogram",
+		"Time taken by each shape of search, including the network.");
+	for (std::vector<std::string>::const_iterator it = shapes.begin();
+		it != shapes.end();
+		++it) {
+
+		histogram(out, "vor_search_network_duration_seconds", *it,
+			global_stats->getNetworkLatency(*it));
+	}
+	return out.str();
+}
+
+void
+Metrics_server_t::accept_connections() {
+	socklen_t addrlen = sizeof(struct sockaddr_in);
+	struct sockaddr_in address;
+
+	while (true) {
+		int new_socket;
+		new_socket = accept(this->sock, (struct sockaddr *)&address, &addrlen);
+		if (new_socket < 0) {
+			continue;
+		}
+		// Don't let a scraper which never finishes its request stop us.
+		struct timeval timeout;
+		timeout.tv_sec = 5;
+		timeout.tv_usec = 0;
+		setsockopt(new_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+			sizeof(timeout));
+		setsockopt(new_socket, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+			sizeof(timeout));
+#ifdef SO_NOSIGPIPE
+		int opt = 1;
+		setsockopt(new_socket, SOL_SOCKET, SO_NOSIGPIPE, &opt, sizeof(opt));
+#endif
+		handle_request(new_socket);
+	}
+}
+
+void
+Metrics_server_t::handle_request(int incoming_socket) const {
+	FILE *conn = fdopen(incoming_socket, "r");
+	if (conn == NULL) {
+		close(incoming_socket);
+		return;
+	}
+
+	// Only the request line matters; skip the headers.
+	char buf[1024];
+	std::string method, path;
+	if (fgets(buf, sizeof(buf), conn)) {
+		std::stringstream request_line(buf);
+		request_line >> method >> path;
+	}
+	while (fgets(buf, sizeof(buf), conn) &&
+		(strcmp(buf, "\r\n") != 0) && (strcmp(buf, "\n") != 0)) {
+	}
+	path = path.substr(0, path.find('?'));
+
+	std::string status, body;
+	if ((method != "GET") && (method != "HEAD")) {
+		status = "405 Method Not Allowed";
+		body = "Only GET is supported\n";
+	} else if (path != "/metrics") {
+		status = "404 Not Found";
+		body = "Try /metrics\n";
+	} else {
+		status = "200 OK";
+		body = metrics();
+	}
+	std::stringstream response;
+	response << "HTTP/1.0 " << status << "\r\n" <<
+		"Content-Type: text/plain; version=0.0.4\r\n" <<
+		"Content-Length: " << body.size() << "\r\n" <<
+		"Connection: close\r\n\r\n";
+	if (method != "HEAD") {
+		response << body;
+	}
+
+	// Write to the socket directly, as the stream is only for reading.
+	std::string out = response.str();
+	size_t written = 0;
+	while (written < out.size()) {
+		ssize_t res = send(incoming_socket, out.data() + written,
+			out.size() - written, SEND_FLAGS);
+		if (res <= 0) {
+			break;
+		}
+		written += res;
+	}
+	fclose(conn);
+}
+
+void* metrics_accept_connections(void *arg) {
+	Metrics_server_t *server = static_cast<Metrics_server_t *>(arg);
+	server->accept_connections();
+	return NULL;
+}
@@ -0,0 +1,48 @@
+#ifndef _METRICS_SERVER_H_
+#define _METRICS_SERVER_H_
+
+#include <pthread.h>
+#include <string>
+
+// A tiny HTTP server answering GET /metrics with our statistics in the
+// Prometheus text format
+// (https://prometheus.io/docs/instrumenting/exposition_formats/), so
+// monitoring can scrape them instead of parsing the stats command.  It has
+// its own port and a single thread of its own, and only reads global_stats,
+// whose counters take no lock, so a scrape never holds up a search.
+class Metrics_server_t {
+public:
+	// Listen on port, or do nothing at all if port is 0.  If the port
+	// can't be had, we carry on without metrics rather than without
+	// searches.
+	Metrics_server_t(int port);
+	~Metrics_server_t();
+
+	// Spawn the thread answering requests, if we are listening.
+	void threaded_accept();
+
+	// The metrics, in the Prometheus text format.
+	static std::string metrics();
+
+private:
+	friend void* metrics_accept_connections(void *);
+
+	// Answer requests, one at a time, forever.
+	void accept_connections();
+
+	// Read one HTTP request from incoming_socket, answer it, and close it.
+	void handle_request(int incoming_socket) const;
+
+private:
+	Metrics_server_t(const Metrics_server_t& other);
+	Metrics_server_t& operator=(const Metrics_server_t& rhs);
+
+private:
+	int sock;
+	pthread_t thread;
+};
+
+// Remap back to Metrics_server_t::accept_connections
+void* metrics_accept_connections(void *);
+
+#endif
@@ -0,0 +1,138 @@
+#include "name_arena.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#include "utility.h"
+
+Name_ref_t::Name_ref_t(unsigned int new_offset, unsigned int new_length) :
+	offset(new_offset), length(new_length)
+{ }
+
+Name_arena_t::Name_arena_t(bool new_interning) :
+	interning(new_interning), count(0)
+{
+	if (this->interning) {
+		this->slots.resize(16);
+	}
+}
+
+Name_ref_t
+Name_arena_t::add(const std::string& name) {
+	if (name.empty()) {
+		return Name_ref_t();
+	}
+	size_t hash = 0;
+	if (this->interning) {
+		hash = hash_of(name.data(), name.data() + name.length());
+		const Name_ref_t& slot(this->slots[probe(name, hash)]);
+		if (slot.length != 0) {
+			return slot;
+		}
+	}
+
+	Name_ref_t ref(this->text.length(), name.length());
+	this->text.append(name);
+	if (this->interning) {
+		if ((this->count + 1) * 2 > this->slots.size()) {
+			grow();
+		}
+		this->slots[probe(name, hash)] = ref;
+		++this->count;
+	}
+	return ref;
+}
+
+const char *
+Name_arena_t::begin(const Name_ref_t& ref) const {
+	assert(ref.offset + ref.length <= this->text.length());
+	return this->text.data() + ref.offset;
+}
+
+const char *
+Name_arena_t::end(const Name_ref_t& ref) const {
+	return begin(ref) + ref.length;
+}
+
+std::string
+Name_arena_t::str(const Name_ref_t& ref) const {
+	return std::string(begin(ref), end(ref));
+}
+
+bool
+Name_arena_t::equals(const Name_ref_t& ref, const std::string& name) const {
+	return (ref.length == name.length()) &&
+		(::memcmp(begin(ref), name.data(), ref.length) == 0);
+}
+
+bool
+Name_arena_t::contains(const Name_ref_t& ref, const std::string& query) const {
+	if (query.length() > ref.length) {
+		return false;
+	}
+	return std::search(begin(ref), end(ref), query.begin(), query.end()) !=
+		end(ref);
+}
+
+size_t
+Name_arena_t::size() const {
+	return this->text.length();
+}
+
+size_t
+Name_arena_t::heap_bytes() const {
+	return Utility::heap_bytes(this->text) +
+		Utility::vector_heap_bytes(this->slots);
+}
+
+void
+Name_arena_t::swap(Name_arena_t& other) {
+	std::swap(this->interning, other.interning);
+	this->text.swap(other.text);
+	this->slots.swap(other.slots);
+	std::swap(this->count, other.count);
+}
+
+size_t
+Name_arena_t::hash_of(const char *begin, const char *end) {
+	size_t hash = 2166136261u;
+	for (const char *it = begin; it != end; ++it) {
+		hash ^= static_cast<unsigned char>(*it);
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+size_t
+Name_arena_t::probe(const std::string& name, size_t hash) const {
+	size_t mask = this->slots.size() - 1;
+	size_t index = hash & mask;
+	while (this->slots[index].length != 0) {
+		if (equals(this->slots[index], name)) {
+			break;
+		}
+		index = (index + 1) & mask;
+	}
+	return index;
+}
+
+void
+Name_arena_t::grow() {
+	std::vector<Name_ref_t> old_slots(this->slots.size() * 2);
+	old_slots.swap(this->slots);
+	size_t mask = this->slots.size() - 1;
+	for (std::vector<Name_ref_t>::const_iterator it = old_slots.begin();
+		it != old_slots.end();
+		++it) {
+
+		if (it->length == 0) {
+			continue;
+		}
+		size_t index = hash_of(begin(*it), end(*it)) & mask;
+		while (this->slots[index].length != 0) {
+			index = (index + 1) & mask;
+		}
+		this->slots[index] = *it;
+	}
+}
@@ -0,0 +1,71 @@
+#ifndef _NAME_ARENA_H_
+#define _NAME_ARENA_H_
+
+#include <string>
+#include <vector>
+
+// Where a name lives in a Name_arena_t.
+class Name_ref_t {
+public:
+	unsigned int offset;
+	unsigned int length;
+
+	Name_ref_t(unsigned int new_offset = 0, unsigned int new_length = 0);
+};
+
+// Names packed end to end in one contiguous buffer.  Each name costs its
+// own length plus an eight byte Name_ref_t, rather than a std::string and
+// a separate heap block, and scanning many names reads memory in order.
+// Names are never removed.
+// If interning, a name which has been added before is stored only once,
+// which matters for first and last names ("michael" appears many
+// thousands of times over).
+class Name_arena_t {
+public:
+	Name_arena_t(bool new_interning = false);
+
+	// Store name, returning where to find it.
+	Name_ref_t add(const std::string& name);
+
+	// The name's bytes.  Only valid until the next add().
+	const char *begin(const Name_ref_t& ref) const;
+	const char *end(const Name_ref_t& ref) const;
+
+	// A copy of the name.
+	std::string str(const Name_ref_t& ref) const;
+
+	bool equals(const Name_ref_t& ref, const std::string& name) const;
+
+	// Does the name contain query?
+	bool contains(const Name_ref_t& ref, const std::string& query) const;
+
+	// Bytes of name data stored.
+	size_t size() const;
+
+	// Bytes allocated on the heap, including room to grow.
+	size_t heap_bytes() const;
+
+	void swap(Name_arena_t& other);
+
+private:
+	// FNV-1a hash of the bytes in [begin, end).
+	static size_t hash_of(const char *begin, const char *end);
+
+	// Index of the interning slot holding name, or of the empty slot
+	// where it belongs.
+	size_t probe(const std::string& name, size_t hash) const;
+
+	// Double the number of interning slots and rehash everything.
+	void grow();
+
+private:
+	bool interning;
+	std::string text;
+	// Open addressing table of the distinct names stored, for interning.
+	// Empty names are never interned, so a zero length marks an empty
+	// slot.
+	std::vector<Name_ref_t> slots;
+	size_t count;
+};
+
+#endif
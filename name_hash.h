@@ -0,0 +1,185 @@
+#ifndef _NAME_HASH_H_
+#define _NAME_HASH_H_
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "name_arena.h"
+#include "utility.h"
+
+// A hash table from names to values, using open addressing with linear
+// probing.  Lookups hash the name once and then compare against a short,
+// contiguous run of slots, rather than walking a tree of string compares
+// as std::map does.  The names themselves are kept in a Name_arena_t.
+// Entries cannot be removed.
+template <typename Value>
+class Name_hash_t {
+public:
+	Name_hash_t();
+
+	// Return the value stored for name, or NULL if there is none.
+	const Value *find(const std::string& name) const;
+
+	// Return the value stored for name, adding a default value if
+	// there is none.
+	Value& operator[](const std::string& name);
+
+	// Number of names stored.
+	size_t size() const;
+
+	// Bytes allocated on the heap, including the names.  If
+	// value_heap_bytes is given, it is called for each value to count
+	// what the value has allocated in turn.
+	size_t heap_bytes(size_t (*value_heap_bytes)(const Value&) = NULL) const;
+
+	void swap(Name_hash_t& other);
+
+private:
+	class Slot_t {
+	public:
+		Name_ref_t name;
+		Value value;
+		size_t hash;
+		bool used;
+
+		Slot_t() : hash(0), used(false) {}
+	};
+
+	// FNV-1a hash of the name.
+	static size_t hash_of(const std::string& name);
+
+	// Index of the slot holding name, or of the empty slot where it
+	// belongs.
+	size_t probe(const std::string& name, size_t hash) const;
+
+	// Double the number of slots and rehash everything.
+	void grow();
+
+private:
+	// Always a power of two in size, and never more than half full, so
+	// that probe sequences stay short.
+	std::vector<Slot_t> slots;
+	size_t count;
+	Name_arena_t names;
+};
+
+template <typename Value>
+Name_hash_t<Value>::Name_hash_t() :
+	slots(16), count(0)
+{ }
+
+template <typename Value>
+const Value *
+Name_hash_t<Value>::find(const std::string& name) const {
+	const Slot_t& slot(this->slots[probe(name, hash_of(name))]);
+	return slot.used ? &slot.value : NULL;
+}
+
+template <typename Value>
+Value&
+Name_hash_t<Value>::operator[](const std::string& name) {
+	size_t hash = hash_of(name);
+	size_t index = probe(name, hash);
+	if (!this->slots[index].used) {
+		if ((this->count + 1) * 2 > this->slots.size()) {
+			grow();
+			index = probe(name, hash);
+		}
+		Slot_t& slot(this->slots[index]);
+		slot.name = this->names.add(name);
+		slot.hash = hash;
+		slot.used = true;
+		++this->count;
+	}
+	return this->slots[index].value;
+}
+
+template <typename Value>
+size_t
+Name_hash_t<Value>::size() const {
+	return this->count;
+}
+
+template <typename Value>
+size_t
+Name_hash_t<Value>::heap_bytes(size_t (*value_heap_bytes)(const Value&)) const {
+	size_t bytes = Utility::vector_heap_bytes(this->slots) +
+		this->names.heap_bytes();
+	if (value_heap_bytes != NULL) {
+		for (typename std::vector<Slot_t>::const_iterator it =
+			this->slots.begin();
+			it != this->slots.end();
+			++it) {
+
+			if (it->used) {
+				bytes += value_heap_bytes(it->value);
+			}
+		}
+	}
+	return bytes;
+}
+
+template <typename Value>
+void
+Name_hash_t<Value>::swap(Name_hash_t& other) {
+	this->slots.swap(other.slots);
+	std::swap(this->count, other.count);
+	this->names.swap(other.names);
+}
+
+template <typename Value>
+size_t
+Name_hash_t<Value>::hash_of(const std::string& name) {
+	size_t hash = 2166136261u;
+	for (std::string::const_iterator it = name.begin();
+		it != name.end();
+		++it) {
+
+		hash ^= static_cast<unsigned char>(*it);
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+template <typename Value>
+size_t
+Name_hash_t<Value>::probe(const std::string& name, size_t hash) const {
+	size_t mask = this->slots.size() - 1;
+	size_t index = hash & mask;
+	while (this->slots[index].used) {
+		const Slot_t& slot(this->slots[index]);
+		if ((slot.hash == hash) && this->names.equals(slot.name, name)) {
+			break;
+		}
+		index = (index + 1) & mask;
+	}
+	return index;
+}
+
+template <typename Value>
+void
+Name_hash_t<Value>::grow() {
+	std::vector<Slot_t> old_slots(this->slots.size() * 2);
+	old_slots.swap(this->slots);
+	size_t mask = this->slots.size() - 1;
+	for (typename std::vector<Slot_t>::iterator it = old_slots.begin();
+		it != old_slots.end();
+		++it) {
+
+		if (!it->used) {
+			continue;
+		}
+		size_t index = it->hash & mask;
+		while (this->slots[index].used) {
+			index = (index + 1) & mask;
+		}
+		Slot_t& slot(this->slots[index]);
+		slot.name = it->name;
+		std::swap(slot.value, it->value);
+		slot.hash = it->hash;
+		slot.used = true;
+	}
+}
+
+#endif
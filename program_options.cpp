@@ -11,6 +11,7 @@ ProgramOptions::ProgramOptions(const int argc, char* argv[]) :
 	desc("Options") {
 		
 	int opt_i;
+	bool opt_b;
 	double opt_d;
 	std::string opt_s;
 	this->desc.add_options()
@@ -35,6 +36,27 @@ ProgramOptions::ProgramOptions(const int argc, char* argv[]) :
 		 "Verbosity level, 0-3")
 		("min_userid_mult", po::value<double>(&opt_d)->default_value(1.0),
 		 "minimum userid as multiple of maximum userid (debugging only)")
+		("name_trigrams", po::value<bool>(&opt_b)->default_value(true),
+		 "Index names by trigram as well as bigram")
+		("composite_index",
+		 po::value<std::vector<std::string> >()->composing(),
+		 "Keep one list for a combination of filters, e.g. online,with_picture"
+		 " (may be given more than once)")
+		("query_capture_file",
+		 po::value<std::string>(&opt_s)->default_value(""),
+		 "Record a sample of queries here, to warm up after a full reload")
+		("query_capture_sample", po::value<int>(&opt_i)->default_value(100),
+		 "Record one in this many queries")
+		("warmup_queries", po::value<int>(&opt_i)->default_value(200),
+		 "Replay this many of the most frequent recorded queries after a"
+		 " full reload")
+		("slow_query_ms", po::value<int>(&opt_i)->default_value(0),
+		 "Log searches taking at least this long, stage by stage (0 for none)")
+		("slow_query_file",
+		 po::value<std::string>(&opt_s)->default_value(""),
+		 "Where to log slow searches (default standard output)")
+		("metrics_port", po::value<int>(&opt_i)->default_value(0),
+		 "Serve metrics over HTTP at /metrics on this port (0 for none)")
 	;
 	
 	try {
@@ -107,3 +129,46 @@ int
 ProgramOptions::verbose() const {
 	return this->vm["verbose"].as<int>();
 }
+
+bool
+ProgramOptions::name_trigrams() const {
+	return this->vm["name_trigrams"].as<bool>();
+}
+
+std::vector<std::string>
+ProgramOptions::composite_indexes() const {
+	if (!this->vm.count("composite_index")) {
+		return std::vector<std::string>();
+	}
+	return this->vm["composite_index"].as<std::vector<std::string> >();
+}
+
+std::string
+ProgramOptions::query_capture_file() const {
+	return this->vm["query_capture_file"].as<std::string>();
+}
+
+int
+ProgramOptions::query_capture_sample() const {
+	return this->vm["query_capture_sample"].as<int>();
+}
+
+int
+ProgramOptions::warmup_queries() const {
+	return this->vm["warmup_queries"].as<int>();
+}
+
+int
+ProgramOptions::slow_query_ms() const {
+	return this->vm["slow_query_ms"].as<int>();
+}
+
+std::string
+ProgramOptions::slow_query_file() const {
+	return this->vm["slow_query_file"].as<std::string>();
+}
+
+int
+ProgramOptions::metrics_port() const {
+	return this->vm["metrics_port"].as<int>();
+}
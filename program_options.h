@@ -4,6 +4,7 @@
 #include <boost/shared_ptr.hpp>
 #include <boost/program_options.hpp>
 #include <string>
+#include <vector>
 
 class ProgramOptions {
 public:
@@ -19,6 +20,14 @@ public:
 	int reload_hour() const;
 	int reload_frequency() const;
 	int verbose() const;
+	bool name_trigrams() const;
+	std::vector<std::string> composite_indexes() const;
+	std::string query_capture_file() const;
+	int query_capture_sample() const;
+	int warmup_queries() const;
+	int slow_query_ms() const;
+	std::string slow_query_file() const;
+	int metrics_port() const;
 	
 private:
 	// Display help message
@@ -0,0 +1,194 @@
+#include "query_arena.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <pthread.h>
+#include <vector>
+
+namespace {
+
+// Size of the first block on a thread; later blocks double in size.
+const size_t FIRST_BLOCK_SIZE = 64 * 1024;
+// Memory a thread keeps between requests, and the pool keeps between
+// threads.  Anything beyond this is given back to malloc.
+const size_t RETAINED_BYTES = 4 * 1024 * 1024;
+// Everything handed out is aligned to this.
+const size_t ALIGNMENT = 16;
+
+class Block_t {
+public:
+	char *memory;
+	size_t size;
+
+	Block_t(char *new_memory = NULL, size_t new_size = 0) :
+		memory(new_memory), size(new_size) {}
+};
+
+// Spare blocks left behind by threads which have exited.
+pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+std::vector<Block_t> pool;
+size_t pool_bytes = 0;
+
+// Bytes malloced for blocks and not yet freed, on any thread.
+size_t held_bytes = 0;
+
+// Give a block back to malloc.
+void free_block(const Block_t& block) {
+	::free(block.memory);
+	__sync_fetch_and_sub(&held_bytes, block.size);
+}
+
+class Thread_arena_t {
+public:
+	std::vector<Block_t> blocks;
+	// Block we are allocating from, and how far into it we are.
+	size_t current;
+	size_t offset;
+	// Nesting of Scope_t, and bytes handed out in the outermost.
+	unsigned int depth;
+	size_t used;
+
+	Thread_arena_t() : current(0), offset(0), depth(0), used(0) {}
+
+	// Make sure the current block has room for bytes.
+	void reserve(size_t bytes) {
+		while (this->current < this->blocks.size()) {
+			if (this->offset + bytes <= this->blocks[this->current].size) {
+				return;
+			}
+			++this->current;
+			this->offset = 0;
+		}
+		size_t size = FIRST_BLOCK_SIZE;
+		if (!this->blocks.empty()) {
+			size = this->blocks.back().size * 2;
+		}
+		size = std::max(size, bytes);
+		this->blocks.push_back(new_block(size));
+		this->current = this->blocks.size() - 1;
+		this->offset = 0;
+	}
+
+	// Start again from the first block, giving back anything beyond what
+	// we keep for the next request.
+	void reset() {
+		size_t kept = 0;
+		size_t i = 0;
+		while ((i < this->blocks.size()) &&
+			(kept + this->blocks[i].size <= RETAINED_BYTES)) {
+
+			kept += this->blocks[i].size;
+			++i;
+		}
+		for (size_t j = i; j < this->blocks.size(); ++j) {
+			free_block(this->blocks[j]);
+		}
+		this->blocks.resize(i);
+		this->current = 0;
+		this->offset = 0;
+		this->used = 0;
+	}
+
+	// A block of at least size bytes, from the pool if it has one.
+	static Block_t new_block(size_t size) {
+		{
+			pthread_mutex_lock(&pool_mutex);
+			for (std::vector<Block_t>::iterator it = pool.begin();
+				it != pool.end();
+				++it) {
+
+				if (it->size >= size) {
+					Block_t block = *it;
+					pool.erase(it);
+					pool_bytes -= block.size;
+					pthread_mutex_unlock(&pool_mutex);
+					return block;
+				}
+			}
+			pthread_mutex_unlock(&pool_mutex);
+		}
+		char *memory = static_cast<char *>(::malloc(size));
+		if (memory == NULL) {
+			throw std::bad_alloc();
+		}
+		__sync_fetch_and_add(&held_bytes, size);
+		return Block_t(memory, size);
+	}
+};
+
+pthread_key_t arena_key;
+pthread_once_t arena_key_once = PTHREAD_ONCE_INIT;
+
+// Called as a thread exits, to hand its blocks to the pool.
+void release_arena(void *arena_ptr) {
+	Thread_arena_t *arena = static_cast<Thread_arena_t *>(arena_ptr);
+	pthread_mutex_lock(&pool_mutex);
+	for (std::vector<Block_t>::const_iterator it = arena->blocks.begin();
+		it != arena->blocks.end();
+		++it) {
+
+		if (pool_bytes + it->size <= RETAINED_BYTES) {
+			pool.push_back(*it);
+			pool_bytes += it->size;
+		} else {
+			free_block(*it);
+		}
+	}
+	pthread_mutex_unlock(&pool_mutex);
+	delete arena;
+}
+
+void create_arena_key() {
+	pthread_key_create(&arena_key, release_arena);
+}
+
+Thread_arena_t& thread_arena() {
+	pthread_once(&arena_key_once, create_arena_key);
+	Thread_arena_t *arena;
+	arena = static_cast<Thread_arena_t *>(pthread_getspecific(arena_key));
+	if (arena == NULL) {
+		arena = new Thread_arena_t;
+		pthread_setspecific(arena_key, arena);
+	}
+	return *arena;
+}
+
+}
+
+Query_arena_t::Scope_t::Scope_t() {
+	++thread_arena().depth;
+}
+
+Query_arena_t::Scope_t::~Scope_t() {
+	Thread_arena_t& arena(thread_arena());
+	assert(arena.depth > 0);
+	if (--arena.depth == 0) {
+		arena.reset();
+	}
+}
+
+void *
+Query_arena_t::allocate(size_t bytes) {
+	Thread_arena_t& arena(thread_arena());
+	assert(arena.depth > 0);
+	bytes = (bytes + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+	if (bytes == 0) {
+		bytes = ALIGNMENT;
+	}
+	arena.reserve(bytes);
+	void *memory = arena.blocks[arena.current].memory + arena.offset;
+	arena.offset += bytes;
+	arena.used += bytes;
+	return memory;
+}
+
+size_t
+Query_arena_t::bytes_used() {
+	return thread_arena().used;
+}
+
+size_t
+Query_arena_t::bytes_held() {
+	return held_bytes;
+}
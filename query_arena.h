@@ -0,0 +1,100 @@
+#ifndef _QUERY_ARENA_H_
+#define _QUERY_ARENA_H_
+
+#include <cstddef>
+#include <limits>
+#include <new>
+
+// Memory for the temporary containers built while answering a request.
+// Each thread has its own arena, so there is no locking; allocating is a
+// pointer bump, and freeing does nothing.  Everything is released in one
+// step when the outermost Query_arena_t::Scope_t on the thread ends, so
+// containers using Arena_allocator_t must be destroyed before then.
+//
+// Requests are handled on short lived threads, so when a thread exits
+// its blocks go to a shared pool for the next thread to pick up, rather
+// than back to malloc.
+class Query_arena_t {
+public:
+	// Marks the lifetime of a request's temporaries.  Declare it before
+	// any container which uses the arena.  Scopes may nest; only the
+	// outermost one releases memory.
+	class Scope_t {
+	public:
+		Scope_t();
+		~Scope_t();
+
+	private:
+		Scope_t(const Scope_t& other);
+		Scope_t& operator=(const Scope_t& rhs);
+	};
+
+	// Allocate from this thread's arena.  Must be within a Scope_t.
+	static void *allocate(size_t bytes);
+
+	// Bytes allocated on this thread since the outermost scope began.
+	static size_t bytes_used();
+
+	// Bytes of blocks held by all threads' arenas and kept for new
+	// threads, whether in use or not.
+	static size_t bytes_held();
+
+private:
+	Query_arena_t();
+};
+
+// A standard allocator drawing from the thread's Query_arena_t.
+template <typename T>
+class Arena_allocator_t {
+public:
+	typedef T value_type;
+	typedef T *pointer;
+	typedef const T *const_pointer;
+	typedef T& reference;
+	typedef const T& const_reference;
+	typedef size_t size_type;
+	typedef ptrdiff_t difference_type;
+
+	template <typename U>
+	struct rebind {
+		typedef Arena_allocator_t<U> other;
+	};
+
+	Arena_allocator_t() {}
+	Arena_allocator_t(const Arena_allocator_t&) {}
+	template <typename U>
+	Arena_allocator_t(const Arena_allocator_t<U>&) {}
+
+	pointer address(reference x) const { return &x; }
+	const_pointer address(const_reference x) const { return &x; }
+
+	pointer allocate(size_type n, const void * = 0) {
+		if (n > max_size()) {
+			throw std::bad_alloc();
+		}
+		return static_cast<pointer>(Query_arena_t::allocate(n * sizeof(T)));
+	}
+
+	// Memory is released when the scope ends.
+	void deallocate(pointer, size_type) {}
+
+	size_type max_size() const {
+		return std::numeric_limits<size_type>::max() / sizeof(T);
+	}
+
+	void construct(pointer p, const T& value) { new(p) T(value); }
+	void destroy(pointer p) { p->~T(); }
+};
+
+// All arena allocators share the same (per-thread) memory.
+template <typename T, typename U>
+bool operator==(const Arena_allocator_t<T>&, const Arena_allocator_t<U>&) {
+	return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const Arena_allocator_t<T>&, const Arena_allocator_t<U>&) {
+	return false;
+}
+
+#endif
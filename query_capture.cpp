@@ -0,0 +1,108 @@
+#include "query_capture.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <map>
+
+Query_capture_t::Query_capture_t(const std::string& new_path,
+	unsigned int new_sample_every) :
+	path(new_path), sample_every(new_sample_every), seen(0), file(NULL),
+	lock(new RWLock) {
+
+	if (this->sample_every == 0) {
+		this->sample_every = 1;
+	}
+	if (!this->path.empty()) {
+		open();
+	}
+}
+
+Query_capture_t::~Query_capture_t() {
+	if (this->file != NULL) {
+		fclose(this->file);
+	}
+}
+
+void
+Query_capture_t::record(const Request_t& request) {
+	if (this->path.empty()) {
+		return;
+	}
+	// Most requests are not sampled, so they should cost no more than
+	// counting them.
+	if ((__sync_fetch_and_add(&this->seen, 1) % this->sample_every) != 0) {
+		return;
+	}
+	std::string line = request.normalized();
+	if (line.empty()) {
+		return;
+	}
+
+	WriteLock lock(this->lock);
+	if ((this->file == NULL) || (ftell(this->file) >= MAX_BYTES)) {
+		open();
+		if (this->file == NULL) {
+			return;
+		}
+	}
+	fprintf(this->file, "%s\n", line.c_str());
+	fflush(this->file);
+}
+
+// Orders (count, request) pairs by count, highest first.
+static bool
+more_frequent(const std::pair<unsigned int, std::string>& lhs,
+	const std::pair<unsigned int, std::string>& rhs) {
+
+	return lhs.first > rhs.first;
+}
+
+std::vector<Request_t>
+Query_capture_t::top_requests(const std::string& path, size_t n) {
+	std::map<std::string, unsigned int> counts;
+	const std::string paths[] = { path + ".old", path };
+	for (size_t i = 0; i < 2; ++i) {
+		std::ifstream ifs(paths[i].c_str());
+		std::string line;
+		while (std::getline(ifs, line)) {
+			if (!line.empty()) {
+				++counts[line];
+			}
+		}
+	}
+
+	std::vector<std::pair<unsigned int, std::string> > by_count;
+	for (std::map<std::string, unsigned int>::const_iterator it =
+			counts.begin();
+		it != counts.end();
+		++it) {
+
+		by_count.push_back(std::make_pair(it->second, it->first));
+	}
+	std::stable_sort(by_count.begin(), by_count.end(), more_frequent);
+	if (by_count.size() > n) {
+		by_count.resize(n);
+	}
+
+	std::vector<Request_t> requests;
+	for (std::vector<std::pair<unsigned int, std::string> >::const_iterator
+			it = by_count.begin();
+		it != by_count.end();
+		++it) {
+
+		requests.push_back(Request_t::from_normalized(it->second));
+	}
+	return requests;
+}
+
+void
+Query_capture_t::open() {
+	if (this->file != NULL) {
+		fclose(this->file);
+		this->file = NULL;
+		std::string old_path = this->path + ".old";
+		rename(this->path.c_str(), old_path.c_str());
+	}
+	this->file = fopen(this->path.c_str(), "a");
+}
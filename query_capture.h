@@ -0,0 +1,52 @@
+#ifndef _QUERY_CAPTURE_H_
+#define _QUERY_CAPTURE_H_
+
+#include <boost/shared_ptr.hpp>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "lock.h"
+#include "request.h"
+
+// Keeps a sample of the requests the server answers, normalized (see
+// Request_t::normalized), one per line in a local file.  A freshly loaded
+// child replays the most frequent of them before taking over, so that it
+// starts with warm caches (see warm_up in vor.cpp).
+// Once the file passes MAX_BYTES it is moved aside to path.old and a new
+// one is begun, so at most twice that is kept on disk.
+class Query_capture_t {
+public:
+	static const long MAX_BYTES = 8 * 1024 * 1024;
+
+	// Record one in every sample_every requests to path.  An empty path
+	// records nothing.
+	Query_capture_t(const std::string& new_path, unsigned int sample_every);
+	~Query_capture_t();
+
+	// Perhaps record request.
+	void record(const Request_t& request);
+
+	// The n most frequent requests recorded at path, most frequent first.
+	static std::vector<Request_t> top_requests(const std::string& path,
+		size_t n);
+
+private:
+	// Open the file for appending, moving it aside first if it is full.
+	void open();
+
+private:
+	Query_capture_t(const Query_capture_t& other);
+	Query_capture_t& operator=(const Query_capture_t& rhs);
+
+private:
+	std::string path;
+	unsigned int sample_every;
+	// Requests seen, counted atomically rather than under lock.
+	unsigned long seen;
+	// lock guards file.
+	FILE *file;
+	boost::shared_ptr<RWLock> lock;
+};
+
+#endif
@@ -0,0 +1,267 @@
+#include "request.h"
+
+#include <algorithm>
+#include <boost/algorithm/string/trim.hpp>
+#include <cstdlib>
+#include <sstream>
+
+#include "utility.h"
+
+namespace {
+
+// A parameter and the stats counter for searches using it.
+struct Counted_key_t {
+	const char *key;
+	Stats::Counter_t counter;
+};
+
+// Parameters taking a single word, which count towards search_reqs.
+const Counted_key_t COUNTED_KEYS[] = {
+	{ "min_age", Stats::MIN_AGE_REQS },
+	{ "max_age", Stats::MAX_AGE_REQS },
+	{ "sex", Stats::SEX_REQS },
+	{ "location", Stats::LOCATION_REQS },
+	{ "school", Stats::SCHOOL_REQS },
+	{ "sexuality", Stats::SEXUALITY_REQS },
+	{ "with_picture", Stats::WITH_PICTURE_REQS },
+	{ "single", Stats::SINGLE_REQS },
+	{ "birthday", Stats::BIRTHDAY_REQS },
+	{ "online", Stats::ONLINE_REQS },
+	{ "new_users", Stats::NEW_USERS_REQS },
+	{ "active_recently", Stats::ACTIVE_RECENTLY_REQS },
+	{ "might_know", Stats::MIGHT_KNOW_REQS }
+};
+// Parameters taking a single word, which only modify a search, but also
+// count towards search_reqs.
+const Counted_key_t COUNTED_MODIFIER_KEYS[] = {
+	{ "fuzzy", Stats::FUZZY_REQS },
+	{ "interest_min_match", Stats::INTEREST_MIN_MATCH_REQS }
+};
+// Parameters taking a single word, which only modify a search.
+const char *const MODIFIER_KEYS[] = {
+	"no_friends", "autocomplete_limit"
+};
+// Parameters which may be given more than once, and only modify a search.
+// Each search using them is counted once.
+const Counted_key_t LIST_KEYS[] = {
+	{ "not_school", Stats::NOT_SCHOOL_REQS },
+	{ "not_location", Stats::NOT_LOCATION_REQS },
+	{ "not_interest", Stats::NOT_INTEREST_REQS }
+};
+
+template <size_t N>
+bool
+one_of(const std::string& key, const char *const (&keys)[N]) {
+	for (size_t i = 0; i < N; ++i) {
+		if (key == keys[i]) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// The entry in keys for key, or NULL if there is none.
+template <size_t N>
+const Counted_key_t *
+find_key(const std::string& key, const Counted_key_t (&keys)[N]) {
+	for (size_t i = 0; i < N; ++i) {
+		if (key == keys[i].key) {
+			return &keys[i];
+		}
+	}
+	return NULL;
+}
+
+// Hand back counter for a COUNTED_PARAMETER, if the caller wants it.
+Request_t::Line_t
+counted(Stats::Counter_t *counter, Stats::Counter_t which) {
+	if (counter != NULL) {
+		*counter = which;
+	}
+	return Request_t::COUNTED_PARAMETER;
+}
+
+}
+
+Request_t::Request_t() :
+	searcher_userid(0), searcher_school(0), searcher_location(0),
+	perform_search(false), perform_autocomplete(false), explain(false)
+{ }
+
+Request_t::Line_t
+Request_t::parse(const std::string& key, std::istream& rest,
+	Stats::Counter_t *counter) {
+
+	std::string value;
+	char *end_ptr;
+	const Counted_key_t *found;
+	if (key == "searcher_userid") {
+		rest >> this->searcher_userid;
+		this->perform_search = true;
+		return counted(counter, Stats::SEARCHER_USERID_REQS);
+	} else if (key == "searcher_school") {
+		rest >> this->searcher_school;
+		this->perform_search = true;
+		return counted(counter, Stats::SEARCHER_SCHOOL_REQS);
+	} else if (key == "searcher_location") {
+		rest >> this->searcher_location;
+		this->perform_search = true;
+		return counted(counter, Stats::SEARCHER_LOCATION_REQS);
+	} else if ((key == "name") || (key == "autocomplete")) {
+		// The rest of the line, spaces and all
+		std::getline(rest, value);
+		boost::algorithm::trim(value);
+		this->params[key] = value;
+		if (key == "name") {
+			this->perform_search = true;
+			return counted(counter, Stats::NAME_REQS);
+		} else {
+			this->perform_autocomplete = true;
+			return counted(counter, Stats::AUTOCOMPLETE_REQS);
+		}
+	} else if ((key == "interest") || (key == "interest_any")) {
+		rest >> value;
+		std::vector<Id_t>& interests(this->param_lists[key]);
+		interests.push_back(::strtol(value.c_str(), &end_ptr, 10));
+		this->perform_search = true;
+		// Count the search, not each interest in it.
+		if (interests.size() > 1) {
+			return PARAMETER;
+		}
+		return counted(counter, (key == "interest") ?
+			Stats::INTEREST_REQS : Stats::INTEREST_ANY_REQS);
+	} else if (key == "exclude_ids") {
+		// Any number of userids, on one or more lines
+		std::vector<Id_t>& userids(this->param_lists[key]);
+		bool first = userids.empty();
+		Id_t userid;
+		while (rest >> userid) {
+			userids.push_back(userid);
+		}
+		if (!first) {
+			return PARAMETER;
+		}
+		return counted(counter, Stats::EXCLUDE_IDS_REQS);
+	} else if ((found = find_key(key, LIST_KEYS)) != NULL) {
+		rest >> value;
+		std::vector<Id_t>& ids(this->param_lists[key]);
+		ids.push_back(::strtol(value.c_str(), &end_ptr, 10));
+		if (ids.size() > 1) {
+			return PARAMETER;
+		}
+		return counted(counter, found->counter);
+	} else if ((found = find_key(key, COUNTED_KEYS)) != NULL) {
+		rest >> value;
+		this->params[key] = value;
+		this->perform_search = true;
+		return counted(counter, found->counter);
+	} else if (key == "explain") {
+		this->explain = true;
+		return PARAMETER;
+	} else if ((found = find_key(key, COUNTED_MODIFIER_KEYS)) != NULL) {
+		rest >> value;
+		this->params[key] = value;
+		return counted(counter, found->counter);
+	} else if (one_of(key, MODIFIER_KEYS)) {
+		rest >> value;
+		this->params[key] = value;
+		return PARAMETER;
+	}
+	return NOT_PARAMETER;
+}
+
+std::string
+Request_t::normalized() const {
+	std::vector<std::string> pairs;
+	for (Params_t::const_iterator it = this->params.begin();
+		it != this->params.end();
+		++it) {
+
+		if (it->second.empty()) {
+			continue;
+		}
+		std::string value(it->second);
+		if ((it->first == "name") || (it->first == "autocomplete")) {
+			// Name matching ignores case anyway.
+			value = Utility::downcase(value);
+		}
+		std::replace(value.begin(), value.end(), '\t', ' ');
+		pairs.push_back(it->first + " " + value);
+	}
+	for (Param_lists_t::const_iterator it = this->param_lists.begin();
+		it != this->param_lists.end();
+		++it) {
+
+		std::vector<Id_t> values(it->second);
+		std::sort(values.begin(), values.end());
+		for (std::vector<Id_t>::const_iterator itValue = values.begin();
+			itValue != values.end();
+			++itValue) {
+
+			std::stringstream pair;
+			pair << it->first << " " << *itValue;
+			pairs.push_back(pair.str());
+		}
+	}
+
+	std::string line;
+	for (std::vector<std::string>::const_iterator it = pairs.begin();
+		it != pairs.end();
+		++it) {
+
+		if (!line.empty()) {
+			line += "\t";
+		}
+		line += *it;
+	}
+	return line;
+}
+
+std::string
+Request_t::shape() const {
+	// The most expensive part of the search decides.
+	Params_t::const_iterator found = this->params.find("name");
+	if ((found != this->params.end()) && !found->second.empty()) {
+		return "name";
+	}
+	if ((this->param_lists.find("interest") != this->param_lists.end()) ||
+		(this->param_lists.find("interest_any") != this->param_lists.end())) {
+
+		return "interest";
+	}
+	found = this->params.find("location");
+	if ((found != this->params.end()) && !found->second.empty()) {
+		return "location";
+	}
+	found = this->params.find("might_know");
+	if ((found != this->params.end()) && (found->second == "true")) {
+		return "might_know";
+	}
+	return "browse";
+}
+
+Request_t
+Request_t::from_normalized(const std::string& line) {
+	Request_t request;
+	std::stringstream pairs(line);
+	std::string pair;
+	while (std::getline(pairs, pair, '\t')) {
+		std::stringstream rest(pair);
+		std::string key;
+		rest >> key;
+		request.parse(key, rest);
+	}
+	return request;
+}
+
+std::vector<Id_t>
+Request_t::run(const Search& search, Search_trace_t *trace) const {
+	if (this->perform_autocomplete) {
+		return search.autocomplete(this->params);
+	}
+	if (this->perform_search) {
+		return search.do_search(this->searcher_userid, this->searcher_school,
+			this->searcher_location, this->params, this->param_lists, trace);
+	}
+	return std::vector<Id_t>();
+}
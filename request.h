@@ -0,0 +1,62 @@
+#ifndef _REQUEST_H_
+#define _REQUEST_H_
+
+#include <istream>
+#include <string>
+#include <vector>
+
+#include "search.h"
+#include "stats.h"
+
+// The parameters of a search or autocomplete request, as sent to the
+// server one "key value" line at a time.
+class Request_t {
+public:
+	// What parse() made of a line.
+	enum Line_t {
+		// Not a search parameter, e.g. a command such as "stats".
+		NOT_PARAMETER,
+		// A search parameter.
+		PARAMETER,
+		// A search parameter which is counted in the search_reqs stats.
+		COUNTED_PARAMETER
+	};
+
+	Id_t searcher_userid;
+	Id_t searcher_school;
+	Id_t searcher_location;
+	Params_t params; // General search parameters
+	Param_lists_t param_lists; // Parameters given more than once
+	bool perform_search;
+	bool perform_autocomplete;
+	// Return the search plan rather than the results (see
+	// Search_trace_t::plan).
+	bool explain;
+
+	Request_t();
+
+	// Take in a parameter, given its lower case key and an input stream
+	// positioned at the rest of its line.  For a COUNTED_PARAMETER, if
+	// counter is not NULL, the stats counter for its key goes in counter.
+	Line_t parse(const std::string& key, std::istream& rest,
+		Stats::Counter_t *counter = NULL);
+
+	// The request on one line, as tab separated "key value" pairs, in a
+	// canonical order.  Who is searching is left out, so that the same
+	// search made by different users looks the same.
+	std::string normalized() const;
+
+	// What sort of search this is, for latency stats: "name", "interest",
+	// "location", "might_know" or otherwise "browse".
+	std::string shape() const;
+
+	// Parse a line made by normalized().
+	static Request_t from_normalized(const std::string& line);
+
+	// Run the request, returning matching userids.  A search is traced
+	// if trace is not NULL (see Search::do_search).
+	std::vector<Id_t> run(const Search& search,
+		Search_trace_t *trace = NULL) const;
+};
+
+#endif
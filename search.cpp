@@ -3,10 +3,103 @@
 #include <algorithm>
 #include <assert.h>
 #include <iostream>
+#include <sstream>
 
 #include "program_options.h"
 #include "utility.h"
 
+// When intersecting with a posting list this many times the size of our
+// results, look each result up rather than walking the whole list.
+static const size_t PROBE_RATIO = 16;
+
+// End a stage of the search, if we are tracing it.
+static void mark(Search_trace_t *trace, const char *stage,
+	const Result_set_t& results,
+	const std::vector<const Data_chunk_t *>& age_sex_data) {
+
+	if (trace != NULL) {
+		trace->mark(stage, results.size(), age_sex_data.size());
+	}
+}
+
+// End a filter stage, where matches users matched the filter alone.
+static void mark_filter(Search_trace_t *trace, const char *stage,
+	size_t matches, const Result_set_t& results,
+	const std::vector<const Data_chunk_t *>& age_sex_data,
+	const std::string& note = "") {
+
+	if (trace != NULL) {
+		trace->mark_filter(stage, matches, results.size(), age_sex_data.size(),
+			note);
+	}
+}
+
+// End a filter stage, where the users in lists matched the filter alone.
+static void mark_filter(Search_trace_t *trace, const char *stage,
+	const Posting_lists_t& lists, const Result_set_t& results,
+	const std::vector<const Data_chunk_t *>& age_sex_data,
+	const std::string& note = "") {
+
+	if (trace != NULL) {
+		size_t matches = 0;
+		for (Posting_lists_t::const_iterator it = lists.begin();
+			it != lists.end();
+			++it) {
+
+			matches += (*it)->size();
+		}
+		mark_filter(trace, stage, matches, results, age_sex_data, note);
+	}
+}
+
+// End the stage choosing which chunks to search, of the selected we
+// started with.
+static void mark_chunks(Search_trace_t *trace, size_t selected,
+	const std::vector<const Data_chunk_t *>& age_sex_data) {
+
+	if (trace != NULL) {
+		size_t users = 0;
+		std::vector<const Data_chunk_t *>::const_iterator it;
+		for (it = age_sex_data.begin(); it != age_sex_data.end(); ++it) {
+			users += (*it)->userids.size();
+		}
+		trace->set_population(users);
+		std::stringstream note;
+		note << age_sex_data.size() << " of " << selected << " chunks, " <<
+			users << " users";
+		trace->mark("chunks", 0, age_sex_data.size(), note.str());
+	}
+}
+
+// The number of users in both results and within, or all of results if
+// within is NULL.
+static size_t count_common(const Result_set_t& results,
+	const Result_set_t *within) {
+
+	if (within == NULL) {
+		return results.size();
+	}
+	const Result_set_t& smaller(results.size() < within->size() ?
+		results : *within);
+	const Result_set_t& larger(results.size() < within->size() ?
+		*within : results);
+	size_t count = 0;
+	for (Result_set_t::const_iterator it = smaller.begin();
+		it != smaller.end();
+		++it) {
+
+		if (larger.find(*it) != larger.end()) {
+			++count;
+		}
+	}
+	return count;
+}
+
+// Order posting lists by size, shortest first.
+static bool shorter_list(const Id_set_t *lhs, const Id_set_t *rhs) {
+	return lhs->size() < rhs->size();
+}
+
 Search::Search(const All_data_t &the_data) :
 	data(the_data) {
 		
@@ -19,225 +112,190 @@ Search::do_search(
 	Id_t searcher_school,
 	Id_t searcher_location,
 	Params_t params,
-	std::vector<Id_t> interests
+	Param_lists_t param_lists,
+	Search_trace_t *trace
 ) const {
-	Id_set_t all_results;
-	Id_set_t local_results;
+	// Everything below is released in one go when we return.
+	Query_arena_t::Scope_t arena_scope;
+	// We work with the index data in place rather than copying it, so
+	// it must not change under us.
+	ReadLock lock(this->data.lock);
+	Result_set_t all_results;
+	if (trace != NULL) {
+		trace->mark("lock", 0);
+	}
+	Result_set_t local_results;
 	bool allow_copy = true;
 	char *end_ptr;
 	std::vector<Id_t> retval; // Appropriately sorted
 	// We want to pull the following out to the front of the results.
-	Id_t exact_match_username;
-	Id_set_t exact_matches_realname;
+	Id_t exact_match_username = 0;
+	Result_set_t exact_matches_realname;
+	// And push these to the back, by edit distance.
+	std::vector<Result_set_t> close_matches;
 
- 	// Pointer to data for sex and ages of interest.  Most of our searching
-	// is limited to a specific sex and age range, and so we store pointers
-	// to the data there.
-	std::vector<const Data_chunk_t *> age_sex_data;
-	unsigned int min_age = ::strtol(params["min_age"].c_str(), &end_ptr, 10);
-	unsigned int max_age = ::strtol(params["max_age"].c_str(), &end_ptr, 10);
-	if (min_age > 80) min_age = 13;
-	if (min_age < 13) min_age = 13;
-	if (max_age > 80) max_age = 80;
-	if (max_age < 13) max_age = 80;
-	for (unsigned int age = min_age; age <= max_age; ++age) {
-		if ((params["sex"] == "f") || (params["sex"] == "F") ||
-		 	(params["sex"] == "")) {
-			
-			const Age_to_data_t& gender(this->data.data_chunks[1]);
-			assert(&gender != NULL);
-			Age_to_data_t::const_iterator by_age = gender.find(age);
-			if (by_age != gender.end()) {
-				age_sex_data.push_back(&(by_age->second));
-			}
-		}
-		if ((params["sex"] == "m") || (params["sex"] == "M") ||
-		 	(params["sex"] == "")) {
-			
-			const Age_to_data_t& gender(this->data.data_chunks[0]);
-			assert(&gender != NULL);
-			Age_to_data_t::const_iterator by_age = gender.find(age);
-			if (by_age != gender.end()) {
-				age_sex_data.push_back(&(by_age->second));
-			}
-		}
-	}
+	// Pointer to data for sex and ages of interest.
+	std::vector<const Data_chunk_t *> age_sex_data = select_chunks(params);
+
+	// The most selective filters can rule out whole chunks before we do
+	// any other work on them.
+	Id_t location = ::strtol(params["location"].c_str(), &end_ptr, 10);
+	Id_t school = ::strtol(params["school"].c_str(), &end_ptr, 10);
+	const std::vector<Id_t>& all_interests(param_lists["interest"]);
+	std::vector<Id_t> any_interests(param_lists["interest_any"]);
+	std::sort(any_interests.begin(), any_interests.end());
+	any_interests.erase(std::unique(any_interests.begin(),
+		any_interests.end()), any_interests.end());
+	size_t min_match = ::strtol(params["interest_min_match"].c_str(),
+		&end_ptr, 10);
+	if (min_match == 0) min_match = 1;
+	size_t selected = age_sex_data.size();
+	prune_chunks(age_sex_data, school, location, all_interests,
+		any_interests, min_match);
+	mark_chunks(trace, selected, age_sex_data);
 	
-	// Do name searches
+	// Do name searches.  Close matches, if asked for, are anything else
+	// within a small number of edits, and cost far more to look for than
+	// substring matches, so the name filter then waits until the other
+	// filters have narrowed down the users to look at (see below).
 	Name_t name = params["name"];
-	if (name.length() > 0) {
-		std::pair<Id_t, Id_set_t> local_results_username;
-		local_results_username = search_usernames(age_sex_data, name);
-		
-		size_t separator = name.find(" ");
-		std::string firstname;
-		std::string lastname;
-		if (separator == std::string::npos) {
-			firstname = name;
-			lastname = name;
-		} else {
-			firstname = name.substr(0, separator);
-			lastname = name.substr(separator + 1);
-		}
-
-		std::pair<Id_set_t, Id_set_t> local_results_firstname;
-		local_results_firstname = search_firstnames(age_sex_data, firstname);
-		std::pair<Id_set_t, Id_set_t> local_results_lastname;
-		local_results_lastname = search_lastnames(age_sex_data, lastname);
-		
-		std::pair<Id_set_t, Id_set_t> local_results_name;
-		if (separator == std::string::npos) {
-			// Only passed a first or a last name so valid results are all
-			// those that appear in either result set
-			local_results_name = local_results_firstname;
-			for (Id_set_t::const_iterator it = local_results_lastname.first.begin();
-				it != local_results_lastname.first.end();
-				++it) {
-				
-				local_results_name.first.insert(*it);
-			}
-			for (Id_set_t::const_iterator it = local_results_lastname.second.begin();
-				it != local_results_lastname.second.end();
-				++it) {
-				
-				local_results_name.second.insert(*it);
-			}
-		} else {
-			// Passed both first and last name so valid results are all
-			// those that appear in both result sets
-			std::set_intersection(
-				local_results_firstname.first.begin(),
-				local_results_firstname.first.end(),
-				local_results_lastname.first.begin(),
-				local_results_lastname.first.end(),
-				std::inserter(local_results_name.first,
-				local_results_name.first.end()));
-			std::set_intersection(
-				local_results_firstname.second.begin(),
-				local_results_firstname.second.end(),
-				local_results_lastname.second.begin(),
-				local_results_lastname.second.end(),
-				std::inserter(local_results_name.second,
-				local_results_name.second.end()));
-		}
-
-		// Okay, now we have a list of matching usernames and a list of
-		// matching realnames.  We accept any results in either of
-		// these lists.
-		local_results = local_results_username.second;
-		for (Id_set_t::const_iterator it = local_results_name.second.begin();
-			it != local_results_name.second.end();
-			++it) {
-			
-			local_results.insert(*it);
-		}
-
+	unsigned int fuzzy = ::strtol(params["fuzzy"].c_str(), &end_ptr, 10);
+	if (fuzzy > 2) fuzzy = 2;
+	if ((name.length() > 0) && (fuzzy == 0)) {
+		search_name(age_sex_data, name, local_results, exact_match_username,
+			exact_matches_realname);
+		size_t matches = local_results.size();
 		intersect(all_results, local_results, allow_copy);
-
-		exact_match_username = local_results_username.first;
-		exact_matches_realname.swap(local_results_name.first);
-		// Remove the username match if one exists
-		Id_set_t::iterator found;
-		found = exact_matches_realname.find(exact_match_username);
-		if (found != exact_matches_realname.end()) {
-			exact_matches_realname.erase(found);
-		}
-
 		allow_copy = false;
+		mark_filter(trace, "name", matches, all_results, age_sex_data);
 	}
 	
 	
 	// Great, let's search on interests
-	if (!interests.empty()) {
-		local_results = search_interests(age_sex_data, interests);
+	Result_scores_t interest_scores;
+	if (!all_interests.empty() || !any_interests.empty()) {
+		local_results = search_interests(age_sex_data, all_interests,
+			any_interests, min_match, interest_scores);
+		size_t matches = local_results.size();
 		intersect(all_results, local_results, allow_copy);
 		allow_copy = false;
+		mark_filter(trace, "interest", matches, all_results, age_sex_data);
 	}
 
-	// Location
-	Id_t location = ::strtol(params["location"].c_str(), &end_ptr, 10);
-	if (location != 0) {
-		// Handle all decendent locations as well
-		Id_to_id_set_t::const_iterator found;
-		ReadLock lock(this->data.lock);
-		found = this->data.location_hierarchy.find(location);
-		Id_set_t location_results;
-		if (found != this->data.location_hierarchy.end()) {
-			for (Id_set_t::const_iterator it = found->second.begin();
-				it != found->second.end();
-				++it) {
-				
-				local_results = search_location(age_sex_data, *it);
-				for (Id_set_t::const_iterator itLocal = local_results.begin();
-					itLocal != local_results.end();
-					++itLocal) {
-						
-					location_results.insert(*itLocal);
-				}
-			}
+	// A composite index may answer several of the filters below with a
+	// single list.
+	unsigned int covered = 0;
+	Composite_spec_t::Key_t covered_key = Composite_spec_t::NO_KEY;
+	int composite = choose_composite(age_sex_data,
+		Composite_spec_t::flags_of(params), school, location);
+	if (composite >= 0) {
+		const Composite_spec_t& spec(this->data.composite_specs[composite]);
+		if (spec.key == Composite_spec_t::LOCATION) {
+			local_results = search_composite_location(age_sex_data, composite,
+				location);
+			size_t matches = local_results.size();
+			intersect(all_results, local_results, allow_copy);
+			mark_filter(trace, "composite", matches, all_results, age_sex_data,
+				spec.str());
 		} else {
-			location_results = search_location(age_sex_data, location);
+			Posting_lists_t lists;
+			lists = composite_lists(age_sex_data, composite, school);
+			intersect(all_results, lists, allow_copy);
+			mark_filter(trace, "composite", lists, all_results, age_sex_data,
+				spec.str());
 		}
-		intersect(all_results, location_results, allow_copy);
 		allow_copy = false;
+		covered = spec.flags;
+		covered_key = spec.key;
+	}
+
+	// Location
+	if ((location != 0) && (covered_key != Composite_spec_t::LOCATION)) {
+		// search_location handles all decendent locations as well
+		local_results = search_location(age_sex_data, location);
+		size_t matches = local_results.size();
+		intersect(all_results, local_results, allow_copy);
+		allow_copy = false;
+		mark_filter(trace, "location", matches, all_results, age_sex_data);
 	}
 	
 	// School
-	Id_t school = ::strtol(params["school"].c_str(), &end_ptr, 10);
-	if (school != 0) {
-		local_results = search_school(age_sex_data, school);
-		intersect(all_results, local_results, allow_copy);
+	if ((school != 0) && (covered_key != Composite_spec_t::SCHOOL)) {
+		Posting_lists_t lists = search_school(age_sex_data, school);
+		intersect(all_results, lists, allow_copy);
 		allow_copy = false;
+		mark_filter(trace, "school", lists, all_results, age_sex_data);
 	}
 
 	// Sexuality
 	unsigned short sexuality = ::strtol(params["sexuality"].c_str(), &end_ptr, 10);
 	if ((sexuality >= 1) && (sexuality <= 3)) {
-		local_results = search_sexuality(age_sex_data, sexuality);
-		intersect(all_results, local_results, allow_copy);
+		Posting_lists_t lists = search_sexuality(age_sex_data, sexuality);
+		intersect(all_results, lists, allow_copy);
 		allow_copy = false;
+		mark_filter(trace, "sexuality", lists, all_results, age_sex_data);
 	}
 	
 	// With picture?
-	if (params["with_picture"] == "true") {
-		local_results = search_with_picture(age_sex_data);
-		intersect(all_results, local_results, allow_copy);
+	if ((params["with_picture"] == "true") &&
+		!(covered & Composite_spec_t::WITH_PICTURE)) {
+
+		Posting_lists_t lists = search_with_picture(age_sex_data);
+		intersect(all_results, lists, allow_copy);
 		allow_copy = false;
+		mark_filter(trace, "with_picture", lists, all_results, age_sex_data);
 	}
 	
 	// Single?
-	if (params["single"] == "true") {
-		local_results = search_single_users(age_sex_data);
-		intersect(all_results, local_results, allow_copy);
+	if ((params["single"] == "true") &&
+		!(covered & Composite_spec_t::SINGLE)) {
+
+		Posting_lists_t lists = search_single_users(age_sex_data);
+		intersect(all_results, lists, allow_copy);
 		allow_copy = false;
+		mark_filter(trace, "single", lists, all_results, age_sex_data);
 	}
 	
 	// Birthday?
-	if (params["birthday"] == "true") {
-		local_results = search_birthdays(age_sex_data);
-		intersect(all_results, local_results, allow_copy);
+	if ((params["birthday"] == "true") &&
+		!(covered & Composite_spec_t::BIRTHDAY)) {
+
+		Posting_lists_t lists = search_birthdays(age_sex_data);
+		intersect(all_results, lists, allow_copy);
 		allow_copy = false;
+		mark_filter(trace, "birthday", lists, all_results, age_sex_data);
 	}
 	
 	// Online?
-	if (params["online"] == "true") {
+	if ((params["online"] == "true") &&
+		!(covered & Composite_spec_t::ONLINE)) {
+
 		local_results = search_online(age_sex_data);
+		size_t matches = local_results.size();
 		intersect(all_results, local_results, allow_copy);
 		allow_copy = false;
+		mark_filter(trace, "online", matches, all_results, age_sex_data);
 	}
 	
 	// New users?
-	if (params["new_users"] == "true") {
+	if ((params["new_users"] == "true") &&
+		!(covered & Composite_spec_t::NEW_USERS)) {
+
 		local_results = search_new_users(age_sex_data);
+		size_t matches = local_results.size();
 		intersect(all_results, local_results, allow_copy);
 		allow_copy = false;
+		mark_filter(trace, "new_users", matches, all_results, age_sex_data);
 	}
 	
 	// Active recently?
-	if (params["active_recently"] == "true") {
-		local_results = search_active_recently(age_sex_data);
-		intersect(all_results, local_results, allow_copy);
+	if ((params["active_recently"] == "true") &&
+		!(covered & Composite_spec_t::ACTIVE_RECENTLY)) {
+
+		Posting_lists_t lists = search_active_recently(age_sex_data);
+		intersect(all_results, lists, allow_copy);
 		allow_copy = false;
+		mark_filter(trace, "active_recently", lists, all_results, age_sex_data);
 	}
 	
 	// Should we be reordering the result set?
@@ -252,32 +310,93 @@ Search::do_search(
 		no_friends = true;
 	}
 
+	// Names with close matches, only looked for among the users left.
+	if ((name.length() > 0) && (fuzzy > 0)) {
+		search_name(age_sex_data, name, local_results, exact_match_username,
+			exact_matches_realname);
+		const Result_set_t *within = allow_copy ? NULL : &all_results;
+		std::stringstream note;
+		if (count_common(local_results, within) >= MAX_RESULTS) {
+			// Close matches come last, and would never be seen.
+			note << "fuzzy skipped";
+		} else {
+			close_matches.resize(fuzzy);
+			size_t capped = 0;
+			Id_to_distance_t distances;
+			distances = search_fuzzy_names(age_sex_data, name, fuzzy,
+				local_results, within, capped);
+			for (Id_to_distance_t::const_iterator it = distances.begin();
+				it != distances.end();
+				++it) {
+
+				if ((it->second > 0) && local_results.insert(it->first).second) {
+					close_matches[it->second - 1].insert(it->first);
+				}
+			}
+			if (capped > 0) {
+				note << capped << " capped";
+			}
+		}
+		size_t matches = local_results.size();
+		intersect(all_results, local_results, allow_copy);
+		allow_copy = false;
+		mark_filter(trace, "name", matches, all_results, age_sex_data,
+			note.str());
+	}
+
 	// Did we actually perform a search?  If not, [sigh] grab all
 	// the results
 	if (allow_copy) {
-		local_results = dump_all_users(age_sex_data, reorder);
-		intersect(all_results, local_results, allow_copy);
+		Posting_lists_t lists = dump_all_users(age_sex_data, reorder);
+		intersect(all_results, lists, allow_copy);
 		allow_copy = true;
+		mark_filter(trace, "browse", lists, all_results, age_sex_data);
+	}
+
+	// Take out anyone excluded, before they can use up any of the
+	// result set.
+	subtract(all_results, param_lists["exclude_ids"]);
+	const std::vector<Id_t>& not_schools(param_lists["not_school"]);
+	for (std::vector<Id_t>::const_iterator it = not_schools.begin();
+		(it != not_schools.end()) && !all_results.empty();
+		++it) {
+
+		subtract(all_results, search_school(age_sex_data, *it));
+	}
+	const std::vector<Id_t>& not_locations(param_lists["not_location"]);
+	for (std::vector<Id_t>::const_iterator it = not_locations.begin();
+		(it != not_locations.end()) && !all_results.empty();
+		++it) {
+
+		subtract(all_results, search_location(age_sex_data, *it));
+	}
+	const std::vector<Id_t>& not_interests(param_lists["not_interest"]);
+	for (std::vector<Id_t>::const_iterator it = not_interests.begin();
+		(it != not_interests.end()) && !all_results.empty();
+		++it) {
+
+		subtract(all_results, interest_lists(age_sex_data, *it));
 	}
+	mark(trace, "exclude", all_results, age_sex_data);
 	
 	
 	// Now, pull out our exact matches to the front, if they are
 	// still there.  If not, they failed matching other criteria and so
 	// we don't want them in our result set.
 	if (exact_match_username > 0) {
-		Id_set_t::iterator found;
+		Result_set_t::iterator found;
 		found = all_results.find(exact_match_username);
 		if (found != all_results.end()) {
 			all_results.erase(found);
 			retval.push_back(exact_match_username);
 		}
 	}
-	for (Id_set_t::const_iterator it = exact_matches_realname.begin();
+	for (Result_set_t::const_iterator it = exact_matches_realname.begin();
 		it != exact_matches_realname.end();
 		++it) {
 	
-		Id_set_t::iterator found = all_results.find(*it);
-		std::vector<Id_t> local_results;
+		Result_set_t::iterator found = all_results.find(*it);
+		Result_list_t local_results;
 		if (found != all_results.end()) {
 			all_results.erase(found);
 			local_results.push_back(*it);
@@ -287,21 +406,44 @@ Search::do_search(
 			std::inserter(retval, retval.end()));
 	}
 
+	// Likewise, pull out the close matches to go at the very end.
+	Result_list_t only_close;
+	for (std::vector<Result_set_t>::const_iterator itDistance = close_matches.begin();
+		itDistance != close_matches.end();
+		++itDistance) {
+
+		Result_list_t local_results;
+		for (Result_set_t::const_iterator it = itDistance->begin();
+			it != itDistance->end();
+			++it) {
+
+			Result_set_t::iterator found = all_results.find(*it);
+			if (found != all_results.end()) {
+				all_results.erase(found);
+				local_results.push_back(*it);
+			}
+		}
+		std::random_shuffle(local_results.begin(), local_results.end());
+		std::copy(local_results.begin(), local_results.end(),
+			std::inserter(only_close, only_close.end()));
+	}
 	
 	// Extract the subset of friends, placing them first
 	// TODO: Should replace with set union
-	Id_set_t friends;
-	std::vector<Id_t> only_friends;
+	static const Id_set_t no_friends_found;
+	const Id_set_t *friends_found = &no_friends_found;
+	Result_list_t only_friends;
 	{
 		Friend_list_t::const_iterator itFriends;
 		itFriends = this->data.friends.find(searcher_userid);
 		if (itFriends != this->data.friends.end()) {
-			friends = itFriends->second;
+			friends_found = &itFriends->second;
 		}
 	}
+	const Id_set_t& friends(*friends_found);
 	
 	if (no_friends) {
-		Id_set_t::iterator found;
+		Result_set_t::iterator found;
 		// Remove those from the all_results list.
 		for (Id_set_t::const_iterator itFriends = friends.begin();
 			itFriends != friends.end();
@@ -323,7 +465,7 @@ Search::do_search(
 	}
 
 #if 0
-	for (Id_set_t::iterator it = all_results.begin();
+	for (Result_set_t::iterator it = all_results.begin();
 		it != all_results.end(); 
 		/* Increment below */ ) {
 
@@ -341,10 +483,10 @@ Search::do_search(
 #endif
 	
 	// Now, friends-of-friends
-	std::vector<Id_t> only_f_of_f;
+	Result_list_t only_f_of_f;
 	if (reorder) {
-		Id_set_t friends_of_friends(friends);
-		// For each friend, bring in their friends as well.
+		// Our friends' friends.  Our own friends are checked in place.
+		Result_set_t friends_of_friends;
 		for (Id_set_t::const_iterator itFriends = friends.begin();
 			itFriends != friends.end();
 			++itFriends) {
@@ -353,18 +495,17 @@ Search::do_search(
 			itFofF = this->data.friends.find(*itFriends);
 			if (itFofF != this->data.friends.end()) {
 				// Found a batch of friends of friends, copy them in.
-				std::copy(itFofF->second.begin(), itFofF->second.end(),
-					std::inserter(friends_of_friends,
-					friends_of_friends.end()));
+				friends_of_friends.insert(itFofF->second.begin(),
+					itFofF->second.end());
 			}
 		}
-		for (Id_set_t::iterator it = all_results.begin();
+		for (Result_set_t::iterator it = all_results.begin();
 			it != all_results.end(); 
 			/* Increment below */ ) {
 
-			Id_set_t::const_iterator found;
-			found = friends_of_friends.find(*it);
-			if (found != friends_of_friends.end()) {
+			bool found = (friends.find(*it) != friends.end()) ||
+				(friends_of_friends.find(*it) != friends_of_friends.end());
+			if (found) {
 				// In list of friends
 				only_f_of_f.push_back(*it);
 				all_results.erase(it++);
@@ -373,84 +514,73 @@ Search::do_search(
 			}
 		}
 		std::random_shuffle(only_f_of_f.begin(), only_f_of_f.end());
+		rank(only_f_of_f, interest_scores);
 	}
 	
 	// Now, by school
-	std::vector<Id_t> only_school;
+	Result_list_t only_school;
 	if (reorder) {
-		Id_set_t in_school; // users in the searcher's school
+		Posting_lists_t in_school; // users in the searcher's school
 		{
 			if (searcher_school != 0) {
 				in_school = search_school(age_sex_data, searcher_school);
 			}
 		}
 		// Find only those in the searcher's school
-		std::set_intersection(all_results.begin(), all_results.end(),
-			in_school.begin(), in_school.end(),
-			std::inserter(only_school, only_school.end()));
+		for (Posting_lists_t::const_iterator itList = in_school.begin();
+			itList != in_school.end();
+			++itList) {
+
+			std::set_intersection(all_results.begin(), all_results.end(),
+				(*itList)->begin(), (*itList)->end(),
+				std::inserter(only_school, only_school.end()));
+		}
 		// And remove those from the all_results list.
-		for (std::vector<Id_t>::const_iterator itSchool = only_school.begin();
+		for (Result_list_t::const_iterator itSchool = only_school.begin();
 			itSchool != only_school.end();
 			++itSchool) {
 			
-			Id_set_t::iterator found = all_results.find(*itSchool);
+			Result_set_t::iterator found = all_results.find(*itSchool);
 			if (found != all_results.end()) {
 				all_results.erase(found);
 			}
 		}
 		std::random_shuffle(only_school.begin(), only_school.end());
+		rank(only_school, interest_scores);
 	}
 
 	// Now, by location
-	std::vector<Id_t> only_location;
+	Result_list_t only_location;
 	if (reorder) {
-		Id_set_t in_location; // users in the searcher's location
-		{
-			if (searcher_location != 0) {
-				// Handle all decendent locations as well
-				Id_to_id_set_t::const_iterator found;
-				ReadLock lock(this->data.lock);
-				found = this->data.location_hierarchy.find(searcher_location);
-				if (found != this->data.location_hierarchy.end()) {
-					for (Id_set_t::const_iterator it = found->second.begin();
-						it != found->second.end();
-						++it) {
-
-						local_results = search_location(age_sex_data, *it);
-						for (Id_set_t::const_iterator itLocal = local_results.begin();
-							itLocal != local_results.end();
-							++itLocal) {
-
-							in_location.insert(*itLocal);
-						}
-					}
-				} else {
-					in_location = search_location(age_sex_data, location);
-				}
-			}
+		Result_set_t in_location; // users in the searcher's location
+		if (searcher_location != 0) {
+			in_location = search_location(age_sex_data, searcher_location);
 		}
 		// Find only those in the searcher's location
 		std::set_intersection(all_results.begin(), all_results.end(),
 			in_location.begin(), in_location.end(),
 			std::inserter(only_location, only_location.end()));
 		// And remove those from the all_results list.
-		for (std::vector<Id_t>::const_iterator itLocation = only_location.begin();
+		for (Result_list_t::const_iterator itLocation = only_location.begin();
 			itLocation != only_location.end();
 			++itLocation) {
 			
-			Id_set_t::iterator found = all_results.find(*itLocation);
+			Result_set_t::iterator found = all_results.find(*itLocation);
 			if (found != all_results.end()) {
 				all_results.erase(found);
 			}
 		}
 		std::random_shuffle(only_location.begin(), only_location.end());
+		rank(only_location, interest_scores);
 	}
+	mark(trace, "might_know", all_results, age_sex_data);
 
 	// And the rest
-	std::vector<Id_t> remaining_results;
+	Result_list_t remaining_results;
 	std::copy(all_results.begin(), all_results.end(),
 		std::inserter(remaining_results, remaining_results.end()));
 	std::random_shuffle(remaining_results.begin(), remaining_results.end());
+	rank(remaining_results, interest_scores);
 
 	// Join the rest of our results together
 	std::copy(only_friends.begin(), only_friends.end(),
@@ -463,564 +593,719 @@ Search::do_search(
 		std::inserter(retval, retval.end()));
 	std::copy(remaining_results.begin(), remaining_results.end(),
 		std::inserter(retval, retval.end()));
+	std::copy(only_close.begin(), only_close.end(),
+		std::inserter(retval, retval.end()));
+	if (trace != NULL) {
+		trace->mark("shuffle", retval.size(), age_sex_data.size());
+	}
 	
 	return retval;
 }
 
-Id_set_t
+std::vector<Id_t>
+Search::autocomplete(Params_t params) const {
+	Query_arena_t::Scope_t arena_scope;
+	char *end_ptr;
+	Name_t prefix = Utility::normalize_name(params["autocomplete"], true);
+	unsigned int limit = ::strtol(params["autocomplete_limit"].c_str(),
+		&end_ptr, 10);
+	if (limit == 0) limit = 10;
+	std::vector<Id_t> retval;
+	if (prefix.empty()) {
+		return retval;
+	}
+
+	// Take the first few completions from each chunk, then keep the
+	// first few of those overall.  Completions are in alphabetical order,
+	// so an exact match is always at the front.
+	std::vector<const Data_chunk_t *> age_sex_data = select_chunks(params);
+	std::vector<Prefix_index_t::Entry_t> completions;
+	{
+		ReadLock lock(this->data.lock);
+		std::vector<const Data_chunk_t *>::const_iterator it;
+		for (it = age_sex_data.begin(); it != age_sex_data.end(); ++it) {
+			(*it)->name_prefixes.complete(prefix, limit, completions);
+			(*it)->recent_name_prefixes.complete(prefix, limit,
+				completions);
+		}
+	}
+	std::sort(completions.begin(), completions.end());
+
+	// A user may match by more than one of their names.
+	Result_set_t seen;
+	for (std::vector<Prefix_index_t::Entry_t>::const_iterator it =
+			completions.begin();
+		(it != completions.end()) && (retval.size() < limit);
+		++it) {
+
+		if (seen.insert(it->second).second) {
+			retval.push_back(it->second);
+		}
+	}
+	return retval;
+}
+
+std::vector<const Data_chunk_t *>
+Search::select_chunks(Params_t& params) const {
+ 	// Most of our searching is limited to a specific sex and age range,
+	// and so we store pointers to the data there.
+	std::vector<const Data_chunk_t *> age_sex_data;
+	char *end_ptr;
+	unsigned int min_age = ::strtol(params["min_age"].c_str(), &end_ptr, 10);
+	unsigned int max_age = ::strtol(params["max_age"].c_str(), &end_ptr, 10);
+	if (min_age > 80) min_age = 13;
+	if (min_age < 13) min_age = 13;
+	if (max_age > 80) max_age = 80;
+	if (max_age < 13) max_age = 80;
+	for (unsigned int age = min_age; age <= max_age; ++age) {
+		if ((params["sex"] == "f") || (params["sex"] == "F") ||
+		 	(params["sex"] == "")) {
+			
+			const Age_to_data_t& gender(this->data.data_chunks[1]);
+			assert(&gender != NULL);
+			Age_to_data_t::const_iterator by_age = gender.find(age);
+			if (by_age != gender.end()) {
+				age_sex_data.push_back(&(by_age->second));
+			}
+		}
+		if ((params["sex"] == "m") || (params["sex"] == "M") ||
+		 	(params["sex"] == "")) {
+			
+			const Age_to_data_t& gender(this->data.data_chunks[0]);
+			assert(&gender != NULL);
+			Age_to_data_t::const_iterator by_age = gender.find(age);
+			if (by_age != gender.end()) {
+				age_sex_data.push_back(&(by_age->second));
+			}
+		}
+	}
+	return age_sex_data;
+}
+
+void
+Search::prune_chunks(std::vector<const Data_chunk_t *>& age_sex_data,
+	Id_t school, Id_t location,
+	const std::vector<Id_t>& all_interests,
+	const std::vector<Id_t>& any_interests, size_t min_match) const {
+
+	Location_hierarchy_t::const_iterator range;
+	range = this->data.location_hierarchy.find(location);
+	std::vector<const Data_chunk_t *>::iterator itKeep = age_sex_data.begin();
+	for (std::vector<const Data_chunk_t *>::const_iterator it =
+			age_sex_data.begin();
+		it != age_sex_data.end();
+		++it) {
+
+		const Data_chunk_t& chunk(**it);
+		if ((school != 0) && !chunk.school_filter.may_contain(school)) {
+			continue;
+		}
+
+		if (location != 0) {
+			if (range == this->data.location_hierarchy.end()) {
+				if (chunk.locations.find(location) == chunk.locations.end()) {
+					continue;
+				}
+			} else {
+				// Any key within the location's pre-order range will do.
+				std::vector<Id_t>::const_iterator itKey;
+				itKey = std::lower_bound(chunk.location_keys.begin(),
+					chunk.location_keys.end(), range->second.first);
+				if ((itKey == chunk.location_keys.end()) ||
+					(*itKey > range->second.last)) {
+
+					continue;
+				}
+			}
+		}
+
+		bool possible = true;
+		for (std::vector<Id_t>::const_iterator itInterest =
+				all_interests.begin();
+			possible && (itInterest != all_interests.end());
+			++itInterest) {
+
+			possible = chunk.interest_filter.may_contain(*itInterest);
+		}
+		if (possible && !any_interests.empty()) {
+			size_t present = 0;
+			for (std::vector<Id_t>::const_iterator itInterest =
+					any_interests.begin();
+				(present < min_match) && (itInterest != any_interests.end());
+				++itInterest) {
+
+				if (chunk.interest_filter.may_contain(*itInterest)) {
+					++present;
+				}
+			}
+			possible = (present >= min_match);
+		}
+		if (!possible) {
+			continue;
+		}
+
+		*itKeep++ = *it;
+	}
+	age_sex_data.erase(itKeep, age_sex_data.end());
+}
+
+Posting_lists_t
 Search::dump_all_users(
 	const std::vector<const Data_chunk_t *>& age_sex_data,
 	bool dump_all_users) const {
 		
 	assert(&age_sex_data != NULL);
-		
-	// The set of matches
-	Id_set_t found_list;
+	Posting_lists_t lists;
 	
 	// We already know the gender and age range we are interested in:
 	std::vector<const Data_chunk_t *>::const_iterator it;
-	ReadLock lock(this->data.lock);
 	for (it = age_sex_data.begin(); it != age_sex_data.end(); ++it) {
 		if (dump_all_users) {
 			// Pull from our full list of userids in this chunk.
-			for (Id_set_t::const_iterator itFull = (*it)->userids.begin();
-				itFull != (*it)->userids.end();
-				++itFull) {
-			
-				found_list.insert(*itFull);
-			}
+			lists.push_back(&(*it)->userids);
 		} else {
 			// Pull from our short list, which contains enough userids but
 			// hopefully much less than the full list.
-			for (Id_set_t::const_iterator itShort = (*it)->shortlist.begin();
-				itShort != (*it)->shortlist.end();
-				++itShort) {
-			
-				found_list.insert(*itShort);
-			}
+			lists.push_back(&(*it)->shortlist);
 		}
 	}
-	return found_list;
+	return lists;
 }
 
 
-std::pair<Id_t, Id_set_t>
+std::pair<Id_t, Result_set_t>
 Search::search_usernames(const std::vector<const Data_chunk_t *>& age_sex_data,
 	Name_t username) const {
 		
 	assert(&age_sex_data != NULL);
 	Name_t username_unprocessed = Utility::downcase(username);
-	username = Utility::strip_string(username);
+	username = Utility::normalize_name(username);
 	// The set of matches for all ages and genders.
-	Id_set_t found_list;
-	
-	std::vector<const Data_chunk_t *>::const_iterator it;
-	for (it = age_sex_data.begin(); it != age_sex_data.end(); ++it) {
-		if (username.length() == 1) {
-			// Special case, length == 1 is hard to search for
-			const Data_chunk_t& data_chunk(**it);
-			assert(&data_chunk != NULL);
-			ReadLock lock(this->data.lock);
-			for (Id_to_name_t::const_iterator itData = data_chunk.usernames.begin();
-				itData != data_chunk.usernames.end();
-				++itData) {
-				
-				size_t substring_found = itData->second.find(username);
-				if (substring_found != std::string::npos) {
-					found_list.insert(itData->first);
-				}
-			}
-		} else if (username.length() > 1) {
-			Id_set_t chunk_found_list; // The set of matches for this data chunk
-			const Data_chunk_t& data_chunk(**it);
-			assert(&data_chunk != NULL);
-			ReadLock lock(this->data.lock);
-		
-			// For each 'element' in the username
-			// For 'greg', this would be "gr", "re", and "eg"
-			for (size_t i = 0; (i + 1) < username.length(); ++i) {
-				const char& a(username[i]);
-				const char& b(username[i+1]);
-				assert(&a != NULL);
-				assert(&b != NULL);
-				assert(a >= 'a');
-				assert(a <= 'z');
-				assert(b >= 'a');
-				assert(b <= 'z');
-				if (i == 0) {
-					// Insert first set of matches
-					chunk_found_list =
-					 	data_chunk.username_suffixes[a-'a'][b-'a'];
-				} else {
-					// Intersect subsequent matches
-					const Id_set_t& new_found_list(
-						data_chunk.username_suffixes[a-'a'][b-'a']);
-					assert(&new_found_list != NULL);
-					Id_set_t intersection;
-					std::set_intersection(
-						chunk_found_list.begin(), chunk_found_list.end(),
-						new_found_list.begin(), new_found_list.end(),
-						std::inserter(intersection, intersection.end()));
-					chunk_found_list.swap(intersection);
-				} // if (i == 0)
-			} // for (size_t i = 0...)
-		
-			// Now, we have a list of matches from searching the suffixes.
-			// However, they may not be real matches.  Searching "greg",
-			// for example, would match "regr".  That's fine, we have
-			// seriously narrowed down our set of matches.  So, let's
-			// quickly prune these by doing full substring searches on
-			// this narrowed set.  We'll throw out anything that does
-			// not match.
-			for (Id_set_t::iterator itNarrow = chunk_found_list.begin();
-				itNarrow != chunk_found_list.end(); /* Nothing */ ) {
-				
-				size_t substring_found = std::string::npos;
-				Id_to_name_t::const_iterator username_found;
-				username_found = data_chunk.usernames.find(*itNarrow);
-				if (username_found != data_chunk.usernames.end()) {
-					substring_found = username_found->second.find(username);
-				}
-
-				if (substring_found == std::string::npos) {
-					chunk_found_list.erase(itNarrow++);
-				} else {
-					// Match is good
-					++itNarrow;
-				}
-			}
-
-			// Copy the new results into the overall found_list.  It's
-			// a set, so duplicates are automatically eliminated.
-			std::copy(chunk_found_list.begin(), chunk_found_list.end(),
-				std::inserter(found_list, found_list.end()));
-		} // for (it = age_sex_data.begin()...)
-	}
+	Result_set_t found_list;
+	search_names(age_sex_data, &Data_chunk_t::usernames, username,
+		found_list, NULL);
 	
 	// Okay, we have a list of all usernames.  Do we have an exact match?
 	// If so, we'll pull it to the front.
-	ReadLock lock(this->data.lock);
 
-	Name_to_id_t::const_iterator found;
+	const Id_t *found;
 	found = this->data.usernames_unprocessed.find(username_unprocessed);
 	Id_t exact_userid = 0;
-	if (found != this->data.usernames_unprocessed.end()) {
-		exact_userid = found->second;
+	if (found != NULL) {
+		exact_userid = *found;
 	}
 
 	return std::make_pair(exact_userid, found_list);
 }
 
-std::pair<Id_set_t, Id_set_t>
+std::pair<Result_set_t, Result_set_t>
 Search::search_firstnames(const std::vector<const Data_chunk_t *>& age_sex_data,
 	Name_t name) const {
 
 	assert(&age_sex_data != NULL);
-	name = Utility::strip_string(name);
+	name = Utility::normalize_name(name);
 	// The set of exact matches and inexact matches.
-	Id_set_t exact_matches, found_list;
-	std::vector<const Data_chunk_t *>::const_iterator it;
-	
-	// Search firstnames
-	for (it = age_sex_data.begin(); it != age_sex_data.end(); ++it) {
-		Id_set_t chunk_found_list; // The set of matches for this data chunk
-		const Data_chunk_t& data_chunk(**it);
-		assert(&data_chunk != NULL);
-		ReadLock lock(this->data.lock);
-		
-		if (name.length() == 1) {
-			// Special case, length == 1 is hard to search for
-			ReadLock lock(this->data.lock);
-			for (Id_to_name_t::const_iterator it = data_chunk.firstnames.begin();
-				it != data_chunk.firstnames.end();
-				++it) {
-				
-				size_t substring_found = it->second.find(name);
-				if (substring_found != std::string::npos) {
-					found_list.insert(it->first);
-				}
-			}
-		} else if (name.length() > 1) {
-			// For each 'element' in the real name
-			// For 'greg', this would be "gr", "re", and "eg"
-			for (size_t i = 0; (i + 1) < name.length(); ++i) {
-				const char& a(name[i]);
-				const char& b(name[i+1]);
-				assert(&a != NULL);
-				assert(&b != NULL);
-				assert(a >= 'a');
-				assert(a <= 'z');
-				assert(b >= 'a');
-				assert(b <= 'z');
-				if (i == 0) {
-					// Insert first set of matches
-					chunk_found_list =
-					 	data_chunk.firstname_suffixes[a-'a'][b-'a'];
-				} else {
-					// Intersect subsequent matches
-					const Id_set_t& new_found_list(
-						data_chunk.firstname_suffixes[a-'a'][b-'a']);
-					assert(&new_found_list != NULL);
-					Id_set_t intersection;
-					std::set_intersection(
-						chunk_found_list.begin(), chunk_found_list.end(),
-						new_found_list.begin(), new_found_list.end(),
-						std::inserter(intersection, intersection.end()));
-					chunk_found_list.swap(intersection);
-				} // if (i == 0)
-			} // for (size_t i = 0...)
-		
-			// Now, we have a list of matches from searching the suffixes.
-			// However, they may not be real matches.  Searching "greg",
-			// for example, would match "regr".  That's fine, we have
-			// seriously narrowed down our set of matches.  So, let's
-			// quickly prune these by doing full substring searches on
-			// this narrowed set.  We'll throw out anything that does
-			// not match.
-			for (Id_set_t::iterator itNarrow = chunk_found_list.begin();
-				itNarrow != chunk_found_list.end(); /* Nothing */ ) {
-				
-				size_t substring_found = std::string::npos;
-				Id_to_name_t::const_iterator name_found;
-				name_found = data_chunk.firstnames.find(*itNarrow);
-				if (name_found != data_chunk.firstnames.end()) {
-					substring_found = name_found->second.find(name);
-				}
-
-				if (substring_found == std::string::npos) {
-					chunk_found_list.erase(itNarrow++);
-				} else {
-					// Match is good, is it an exact match?
-					if (name_found->second == name) {
-						exact_matches.insert(*itNarrow);
-					}
-					
-					++itNarrow;
-				}
-			}
-			
-			// Copy the new results into the overall found_list.  It's
-			// a set, so duplicates are automatically eliminated.
-			std::copy(chunk_found_list.begin(), chunk_found_list.end(),
-				std::inserter(found_list,
-				found_list.end()));
-		} // for (it = age_sex_data.begin()...)
-	}
-	
+	Result_set_t exact_matches, found_list;
+	search_names(age_sex_data, &Data_chunk_t::firstnames, name,
+		found_list, &exact_matches);
 	return std::make_pair(exact_matches, found_list);
 }
 
-std::pair<Id_set_t, Id_set_t>
+std::pair<Result_set_t, Result_set_t>
 Search::search_lastnames(const std::vector<const Data_chunk_t *>& age_sex_data,
 	Name_t name) const {
 		
 	assert(&age_sex_data != NULL);
-	name = Utility::strip_string(name);
+	name = Utility::normalize_name(name);
 	// The set of exact matches and inexact matches.
-	Id_set_t exact_matches, found_list;
+	Result_set_t exact_matches, found_list;
+	search_names(age_sex_data, &Data_chunk_t::lastnames, name,
+		found_list, &exact_matches);
+	return std::make_pair(exact_matches, found_list);
+}
+
+void
+Search::search_names(const std::vector<const Data_chunk_t *>& age_sex_data,
+	Name_index_t Data_chunk_t::*index, const Name_t& name,
+	Result_set_t& found_list, Result_set_t *exact_matches) const {
+
+	assert(&age_sex_data != NULL);
 	std::vector<const Data_chunk_t *>::const_iterator it;
-	
-	// Search lastnames
 	for (it = age_sex_data.begin(); it != age_sex_data.end(); ++it) {
-		Id_set_t chunk_found_list; // The set of matches for this data chunk
 		const Data_chunk_t& data_chunk(**it);
 		assert(&data_chunk != NULL);
-		ReadLock lock(this->data.lock);
-		
-		if (name.length() == 1) {
-			// Special case, length == 1 is hard to search for
-			ReadLock lock(this->data.lock);
-			for (Id_to_name_t::const_iterator it = data_chunk.lastnames.begin();
-				it != data_chunk.lastnames.end();
-				++it) {
-				
-				size_t substring_found = it->second.find(name);
-				if (substring_found != std::string::npos) {
-					found_list.insert(it->first);
-				}
-			}
-		} else if (name.length() > 1) {
-			// For each 'element' in the real name
-			// For 'greg', this would be "gr", "re", and "eg"
-			for (size_t i = 0; (i + 1) < name.length(); ++i) {
-				const char& a(name[i]);
-				const char& b(name[i+1]);
-				assert(&a != NULL);
-				assert(&b != NULL);
-				assert(a >= 'a');
-				assert(a <= 'z');
-				assert(b >= 'a');
-				assert(b <= 'z');
-				if (i == 0) {
-					// Insert first set of matches
-					chunk_found_list =
-					 	data_chunk.lastname_suffixes[a-'a'][b-'a'];
-				} else {
-					// Intersect subsequent matches
-					const Id_set_t& new_found_list(
-						data_chunk.lastname_suffixes[a-'a'][b-'a']);
-					assert(&new_found_list != NULL);
-					Id_set_t intersection;
-					std::set_intersection(
-						chunk_found_list.begin(), chunk_found_list.end(),
-						new_found_list.begin(), new_found_list.end(),
-						std::inserter(intersection, intersection.end()));
-					chunk_found_list.swap(intersection);
-				} // if (i == 0)
-			} // for (size_t i = 0...)
-		
-			// Now, we have a list of matches from searching the suffixes.
-			// However, they may not be real matches.  Searching "greg",
-			// for example, would match "regr".  That's fine, we have
-			// seriously narrowed down our set of matches.  So, let's
-			// quickly prune these by doing full substring searches on
-			// this narrowed set.  We'll throw out anything that does
-			// not match.
-			for (Id_set_t::iterator itNarrow = chunk_found_list.begin();
-				itNarrow != chunk_found_list.end(); /* Nothing */ ) {
-				
-				size_t substring_found = std::string::npos;
-				Id_to_name_t::const_iterator name_found;
-				name_found = data_chunk.lastnames.find(*itNarrow);
-				if (name_found != data_chunk.lastnames.end()) {
-					substring_found = name_found->second.find(name);
-				}
+		(data_chunk.*index).search(name, found_list, exact_matches);
+	}
+}
 
-				if (substring_found == std::string::npos) {
-					chunk_found_list.erase(itNarrow++);
-				} else {
-					// Match is good, is it an exact match?
-					if (name_found->second == name) {
-						exact_matches.insert(*itNarrow);
-					}
-					
-					++itNarrow;
-				}
-			}
-			
-			// Copy the new results into the overall found_list.  It's
-			// a set, so duplicates are automatically eliminated.
-			std::copy(chunk_found_list.begin(), chunk_found_list.end(),
-				std::inserter(found_list,
-				found_list.end()));
-		} // for (it = age_sex_data.begin()...)
+void
+Search::search_name(const std::vector<const Data_chunk_t *>& age_sex_data,
+	const Name_t& name, Result_set_t& matches, Id_t& exact_username,
+	Result_set_t& exact_realnames) const {
+
+	std::pair<Id_t, Result_set_t> local_results_username;
+	local_results_username = search_usernames(age_sex_data, name);
+	
+	size_t separator = name.find(" ");
+	std::string firstname;
+	std::string lastname;
+	if (separator == std::string::npos) {
+		firstname = name;
+		lastname = name;
+	} else {
+		firstname = name.substr(0, separator);
+		lastname = name.substr(separator + 1);
 	}
+
+	std::pair<Result_set_t, Result_set_t> local_results_firstname;
+	local_results_firstname = search_firstnames(age_sex_data, firstname);
+	std::pair<Result_set_t, Result_set_t> local_results_lastname;
+	local_results_lastname = search_lastnames(age_sex_data, lastname);
 	
-	return std::make_pair(exact_matches, found_list);
+	std::pair<Result_set_t, Result_set_t> local_results_name;
+	if (separator == std::string::npos) {
+		// Only passed a first or a last name so valid results are all
+		// those that appear in either result set
+		local_results_name = local_results_firstname;
+		for (Result_set_t::const_iterator it = local_results_lastname.first.begin();
+			it != local_results_lastname.first.end();
+			++it) {
+			
+			local_results_name.first.insert(*it);
+		}
+		for (Result_set_t::const_iterator it = local_results_lastname.second.begin();
+			it != local_results_lastname.second.end();
+			++it) {
+			
+			local_results_name.second.insert(*it);
+		}
+	} else {
+		// Passed both first and last name so valid results are all
+		// those that appear in both result sets
+		std::set_intersection(
+			local_results_firstname.first.begin(),
+			local_results_firstname.first.end(),
+			local_results_lastname.first.begin(),
+			local_results_lastname.first.end(),
+			std::inserter(local_results_name.first,
+			local_results_name.first.end()));
+		std::set_intersection(
+			local_results_firstname.second.begin(),
+			local_results_firstname.second.end(),
+			local_results_lastname.second.begin(),
+			local_results_lastname.second.end(),
+			std::inserter(local_results_name.second,
+			local_results_name.second.end()));
+	}
+
+	// Okay, now we have a list of matching usernames and a list of
+	// matching realnames.  We accept any results in either of
+	// these lists.
+	matches = local_results_username.second;
+	for (Result_set_t::const_iterator it = local_results_name.second.begin();
+		it != local_results_name.second.end();
+		++it) {
+		
+		matches.insert(*it);
+	}
+
+	exact_username = local_results_username.first;
+	exact_realnames.swap(local_results_name.first);
+	// Remove the username match if one exists
+	Result_set_t::iterator found;
+	found = exact_realnames.find(exact_username);
+	if (found != exact_realnames.end()) {
+		exact_realnames.erase(found);
+	}
+}
+
+Id_to_distance_t
+Search::search_fuzzy_names(const std::vector<const Data_chunk_t *>& age_sex_data,
+	const Name_t& name, unsigned int max_distance,
+	const Result_set_t& known, const Result_set_t *within,
+	size_t& capped) const {
+
+	assert(&age_sex_data != NULL);
+	Id_to_distance_t distances;
+	capped += search_names_fuzzy(age_sex_data, &Data_chunk_t::usernames,
+		Utility::normalize_name(name), max_distance, known, within,
+		distances);
+
+	size_t separator = name.find(" ");
+	if (separator == std::string::npos) {
+		// Either name will do
+		Name_t stripped = Utility::normalize_name(name);
+		capped += search_names_fuzzy(age_sex_data, &Data_chunk_t::firstnames,
+			stripped, max_distance, known, within, distances);
+		capped += search_names_fuzzy(age_sex_data, &Data_chunk_t::lastnames,
+			stripped, max_distance, known, within, distances);
+		return distances;
+	}
+
+	// Both names must match, and the edits add up.
+	Id_to_distance_t first, last;
+	capped += search_names_fuzzy(age_sex_data, &Data_chunk_t::firstnames,
+		Utility::normalize_name(name.substr(0, separator)), max_distance,
+		known, within, first);
+	capped += search_names_fuzzy(age_sex_data, &Data_chunk_t::lastnames,
+		Utility::normalize_name(name.substr(separator + 1)), max_distance,
+		known, within, last);
+	for (Id_to_distance_t::const_iterator itFirst = first.begin();
+		itFirst != first.end();
+		++itFirst) {
+
+		Id_to_distance_t::const_iterator itLast = last.find(itFirst->first);
+		if (itLast == last.end()) {
+			continue;
+		}
+		unsigned int distance = itFirst->second + itLast->second;
+		if (distance > max_distance) {
+			continue;
+		}
+		Id_to_distance_t::iterator found = distances.find(itFirst->first);
+		if (found == distances.end()) {
+			distances[itFirst->first] = distance;
+		} else if (distance < found->second) {
+			found->second = distance;
+		}
+	}
+	return distances;
 }
 
-Id_set_t
+size_t
+Search::search_names_fuzzy(const std::vector<const Data_chunk_t *>& age_sex_data,
+	Name_index_t Data_chunk_t::*index, const Name_t& name,
+	unsigned int max_distance, const Result_set_t& known,
+	const Result_set_t *within, Id_to_distance_t& distances) const {
+
+	assert(&age_sex_data != NULL);
+	// Bigram counting can't narrow down the candidates for a short name,
+	// so allow fewer edits there.
+	size_t length = Utility::code_points(name).size();
+	if (length < 2) {
+		return 0;
+	}
+	if (max_distance > (length - 2) / 2) {
+		max_distance = (length - 2) / 2;
+	}
+	if (max_distance == 0) {
+		// Plain substring matching covers this.
+		return 0;
+	}
+	Fuzzy_pattern_t pattern(name);
+	size_t capped = 0;
+	std::vector<const Data_chunk_t *>::const_iterator it;
+	for (it = age_sex_data.begin(); it != age_sex_data.end(); ++it) {
+		const Data_chunk_t& data_chunk(**it);
+		assert(&data_chunk != NULL);
+		if (!(data_chunk.*index).fuzzy_search(pattern, max_distance, known,
+			within, distances)) {
+
+			++capped;
+		}
+	}
+	return capped;
+}
+
+Result_set_t
 Search::search_interests(const std::vector<const Data_chunk_t *>& age_sex_data,
-	const std::vector<Id_t>& interests) const {
+	const std::vector<Id_t>& all_interests,
+	const std::vector<Id_t>& any_interests, size_t min_match,
+	Result_scores_t& scores) const {
 
 	assert(&age_sex_data != NULL);
 	// The set of matches
-	Id_set_t found_list;
+	Result_set_t found_list;
+	if (!any_interests.empty() && (min_match > any_interests.size())) {
+		return found_list;
+	}
 	
 	// We already know the gender and age range we are interested in:
 	std::vector<const Data_chunk_t *>::const_iterator it;
-	ReadLock lock(this->data.lock);
 	for (it = age_sex_data.begin(); it != age_sex_data.end(); ++it) {
-		// For each interest that we care about
-		Id_set_t all_interests_found_list;
+		// The list for each interest that we care about, in place.  If
+		// any is missing, nobody in this chunk has all of them.
+		Posting_lists_t lists;
 		std::vector<Id_t>::const_iterator itInterests;
-		for (itInterests = interests.begin();
-			itInterests != interests.end();
+		for (itInterests = all_interests.begin();
+			itInterests != all_interests.end();
 			++itInterests) {
 				
 			Id_to_id_set_t::const_iterator itFound;
 			itFound = (*it)->interests.find(*itInterests);
-			if (itFound != (*it)->interests.end()) {
-				// Found a set of userids for the given interest.
-				Id_set_t local_results = itFound->second;
-				intersect(all_interests_found_list, local_results, true);
-			} else {
-				// No users with this interest
-				all_interests_found_list.clear();
-			}
-			if (all_interests_found_list.empty())
+			if (itFound == (*it)->interests.end()) {
 				break;
+			}
+			lists.push_back(&itFound->second);
 		}
-		for (Id_set_t::const_iterator itLocal = all_interests_found_list.begin();
-			itLocal != all_interests_found_list.end();
-			++itLocal) {
-				
-			found_list.insert(*itLocal);
+		if (lists.size() < all_interests.size()) {
+			continue;
+		}
+		if (any_interests.empty()) {
+			intersect_lists(lists, found_list);
+			continue;
+		}
+
+		// Users with every required interest, if there are any
+		Result_set_t required;
+		if (!lists.empty()) {
+			intersect_lists(lists, required);
+			if (required.empty()) {
+				continue;
+			}
+		}
+
+		Posting_lists_t any_lists;
+		for (itInterests = any_interests.begin();
+			itInterests != any_interests.end();
+			++itInterests) {
+
+			Id_to_id_set_t::const_iterator itFound;
+			itFound = (*it)->interests.find(*itInterests);
+			if (itFound != (*it)->interests.end()) {
+				any_lists.push_back(&itFound->second);
+			}
 		}
+		count_lists(any_lists, min_match,
+			lists.empty() ? NULL : &required, found_list, scores);
 	}
 	
 	return found_list;
 }
 
-Id_set_t
+void
+Search::count_lists(const Posting_lists_t& lists, size_t min_match,
+	const Result_set_t *required, Result_set_t& found_list,
+	Result_scores_t& scores) const {
+
+	if (lists.size() < min_match) {
+		return;
+	}
+	// A min-heap of the next userid from each list, and which list.
+	typedef std::pair<Id_t, size_t> Head_t;
+	std::vector<Head_t> heap;
+	std::vector<Id_set_t::const_iterator> positions;
+	for (size_t i = 0; i < lists.size(); ++i) {
+		positions.push_back(lists[i]->begin());
+		if (!lists[i]->empty()) {
+			heap.push_back(std::make_pair(*lists[i]->begin(), i));
+		}
+	}
+	std::greater<Head_t> later;
+	std::make_heap(heap.begin(), heap.end(), later);
+	while (heap.size() >= min_match) {
+		// Pop every list headed by the smallest userid, counting them.
+		Id_t userid = heap.front().first;
+		unsigned int count = 0;
+		while (!heap.empty() && (heap.front().first == userid)) {
+			std::pop_heap(heap.begin(), heap.end(), later);
+			size_t list = heap.back().second;
+			heap.pop_back();
+			++count;
+			if (++positions[list] != lists[list]->end()) {
+				heap.push_back(std::make_pair(*positions[list], list));
+				std::push_heap(heap.begin(), heap.end(), later);
+			}
+		}
+		if ((count >= min_match) &&
+			((required == NULL) || (required->find(userid) != required->end()))) {
+
+			found_list.insert(found_list.end(), userid);
+			scores[userid] = count;
+		}
+	}
+}
+
+Result_set_t
 Search::search_location(const std::vector<const Data_chunk_t *>& age_sex_data,
 	const Id_t location) const {
 
 	assert(&age_sex_data != NULL);
 	// The set of matches
-	Id_set_t found_list;
+	Result_set_t found_list;
 	
 	// We already know the gender and age range we are interested in:
 	std::vector<const Data_chunk_t *>::const_iterator it;
-	ReadLock lock(this->data.lock);
+	Location_hierarchy_t::const_iterator range;
+	range = this->data.location_hierarchy.find(location);
 	for (it = age_sex_data.begin(); it != age_sex_data.end(); ++it) {
-		Id_to_id_set_t::const_iterator itFound;
-		itFound = (*it)->locations.find(location);
-		if (itFound != (*it)->locations.end()) {
-			// Found a set of userids for the given location
-			for (Id_set_t::const_iterator itLocal = itFound->second.begin();
-				itLocal != itFound->second.end();
-				++itLocal) {
-					
-				found_list.insert(*itLocal);
+		if (range == this->data.location_hierarchy.end()) {
+			// Not in the hierarchy, so no children to worry about
+			Id_to_id_set_t::const_iterator itFound;
+			itFound = (*it)->locations.find(location);
+			if (itFound != (*it)->locations.end()) {
+				found_list.insert(itFound->second.begin(),
+					itFound->second.end());
 			}
+			continue;
 		}
+		scan_location_column((*it)->location_column, range->second,
+			found_list);
 	}
 	return found_list;
 }
 
-Id_set_t
+void
+Search::scan_location_column(const Location_column_t& column,
+	const Location_range_t& range, Result_set_t& found_list) const {
+
+	// The location and all its descendents are one run of the column.
+	Location_column_t::const_iterator itBegin, itEnd;
+	itBegin = std::lower_bound(column.begin(), column.end(),
+		std::make_pair(range.first, static_cast<Id_t>(0)));
+	itEnd = std::upper_bound(itBegin, column.end(),
+		std::make_pair(range.last, static_cast<Id_t>(-1)));
+	for (Location_column_t::const_iterator itLocal = itBegin;
+		itLocal != itEnd;
+		++itLocal) {
+
+		found_list.insert(itLocal->second);
+	}
+}
+
+Posting_lists_t
 Search::search_school(const std::vector<const Data_chunk_t *>& age_sex_data,
 	const Id_t school) const {
 
 	assert(&age_sex_data != NULL);
-	// The set of matches
-	Id_set_t found_list;
+	Posting_lists_t lists;
 	
 	// We already know the gender and age range we are interested in:
 	std::vector<const Data_chunk_t *>::const_iterator it;
-	ReadLock lock(this->data.lock);
 	for (it = age_sex_data.begin(); it != age_sex_data.end(); ++it) {
 		Id_to_id_set_t::const_iterator itFound;
 		itFound = (*it)->schools.find(school);
 		if (itFound != (*it)->schools.end()) {
-			// Found a set of userids for the given location
-			for (Id_set_t::const_iterator itLocal = itFound->second.begin();
-				itLocal != itFound->second.end();
-				++itLocal) {
-					
-				found_list.insert(*itLocal);
-			}
+			// Found a set of userids for the given school
+			lists.push_back(&itFound->second);
 		}
 	}
-	return found_list;
+	return lists;
 }
 
-Id_set_t
-Search::search_sexuality(const std::vector<const Data_chunk_t *>& age_sex_data,
-	const unsigned short sexuality) const {
+int
+Search::choose_composite(const std::vector<const Data_chunk_t *>& age_sex_data,
+	unsigned int flags, Id_t school, Id_t location) const {
 
-	assert(&age_sex_data != NULL);
-	// The set of matches
-	Id_set_t found_list;
-	
-	// We already know the gender and age range we are interested in:
+	// A chunk created since the composites were last built has none yet.
 	std::vector<const Data_chunk_t *>::const_iterator it;
-	ReadLock lock(this->data.lock);
 	for (it = age_sex_data.begin(); it != age_sex_data.end(); ++it) {
-		if (sexuality == 1) {
-			for (Id_set_t::const_iterator itLocal = (*it)->heterosexual.begin();
-				itLocal != (*it)->heterosexual.end();
-				++itLocal) {
-					
-				found_list.insert(*itLocal);
-			}
-		} else if (sexuality == 2) {
-			for (Id_set_t::const_iterator itLocal = (*it)->homosexual.begin();
-				itLocal != (*it)->homosexual.end();
-				++itLocal) {
-					
-				found_list.insert(*itLocal);
-			}
-		} else if (sexuality == 3) {
-			for (Id_set_t::const_iterator itLocal = (*it)->bisexual.begin();
-				itLocal != (*it)->bisexual.end();
-				++itLocal) {
-					
-				found_list.insert(*itLocal);
-			}
+		if ((*it)->composites.size() != this->data.composite_specs.size()) {
+			return -1;
 		}
 	}
-	return found_list;
+	// Composite location lists only cover locations in the hierarchy.
+	bool in_hierarchy = (location != 0) &&
+		(this->data.location_hierarchy.find(location) !=
+		 this->data.location_hierarchy.end());
+	int best = -1;
+	size_t best_size = 0;
+	for (size_t i = 0; i < this->data.composite_specs.size(); ++i) {
+		const Composite_spec_t& spec(this->data.composite_specs[i]);
+		if ((spec.flags & ~flags) != 0) {
+			continue;
+		}
+		if (((spec.key == Composite_spec_t::SCHOOL) && (school == 0)) ||
+			((spec.key == Composite_spec_t::LOCATION) && !in_hierarchy)) {
+
+			continue;
+		}
+		if (spec.size() > best_size) {
+			best = i;
+			best_size = spec.size();
+		}
+	}
+	return best;
 }
 
-Id_set_t
-Search::search_with_picture(
-	const std::vector<const Data_chunk_t *>& age_sex_data) const {
+Posting_lists_t
+Search::composite_lists(const std::vector<const Data_chunk_t *>& age_sex_data,
+	size_t composite, Id_t school) const {
 
 	assert(&age_sex_data != NULL);
-	// The set of matches
-	Id_set_t found_list;
-	
-	// We already know the gender and age range we are interested in:
+	const Composite_spec_t& spec(this->data.composite_specs[composite]);
+	Posting_lists_t lists;
 	std::vector<const Data_chunk_t *>::const_iterator it;
-	ReadLock lock(this->data.lock);
 	for (it = age_sex_data.begin(); it != age_sex_data.end(); ++it) {
-		for (Id_set_t::const_iterator itLocal = (*it)->with_picture.begin();
-			itLocal != (*it)->with_picture.end();
-			++itLocal) {
-				
-			found_list.insert(*itLocal);
+		const Composite_index_t& index((*it)->composites[composite]);
+		if (spec.key == Composite_spec_t::NO_KEY) {
+			lists.push_back(&index.users);
+			continue;
+		}
+		Id_to_id_set_t::const_iterator itFound = index.schools.find(school);
+		if (itFound != index.schools.end()) {
+			lists.push_back(&itFound->second);
 		}
 	}
-	return found_list;
+	return lists;
 }
 
-Id_set_t
-Search::search_single_users(
-	const std::vector<const Data_chunk_t *>& age_sex_data) const {
+Result_set_t
+Search::search_composite_location(
+	const std::vector<const Data_chunk_t *>& age_sex_data,
+	size_t composite, Id_t location) const {
 
 	assert(&age_sex_data != NULL);
-	// The set of matches
-	Id_set_t found_list;
-	
-	// We already know the gender and age range we are interested in:
+	Result_set_t found_list;
+	Location_hierarchy_t::const_iterator range;
+	range = this->data.location_hierarchy.find(location);
+	if (range == this->data.location_hierarchy.end()) {
+		return found_list;
+	}
 	std::vector<const Data_chunk_t *>::const_iterator it;
-	ReadLock lock(this->data.lock);
 	for (it = age_sex_data.begin(); it != age_sex_data.end(); ++it) {
-		for (Id_set_t::const_iterator itLocal = (*it)->single_users.begin();
-			itLocal != (*it)->single_users.end();
-			++itLocal) {
-				
-			found_list.insert(*itLocal);
-		}
+		scan_location_column((*it)->composites[composite].location_column,
+			range->second, found_list);
 	}
 	return found_list;
 }
 
-Id_set_t
-Search::search_birthdays(
-	const std::vector<const Data_chunk_t *>& age_sex_data) const {
+Posting_lists_t
+Search::search_sexuality(const std::vector<const Data_chunk_t *>& age_sex_data,
+	const unsigned short sexuality) const {
 
 	assert(&age_sex_data != NULL);
-	// The set of matches
-	Id_set_t found_list;
-	
-	// We already know the gender and age range we are interested in:
-	std::vector<const Data_chunk_t *>::const_iterator it;
-	ReadLock lock(this->data.lock);
-	for (it = age_sex_data.begin(); it != age_sex_data.end(); ++it) {
-		for (Id_set_t::const_iterator itLocal = (*it)->birthdays.begin();
-			itLocal != (*it)->birthdays.end();
-			++itLocal) {
-				
-			found_list.insert(*itLocal);
-		}
+	if (sexuality == 1) {
+		return chunk_lists(age_sex_data, &Data_chunk_t::heterosexual);
+	} else if (sexuality == 2) {
+		return chunk_lists(age_sex_data, &Data_chunk_t::homosexual);
+	} else if (sexuality == 3) {
+		return chunk_lists(age_sex_data, &Data_chunk_t::bisexual);
 	}
-	return found_list;
+	return Posting_lists_t();
+}
+
+Posting_lists_t
+Search::search_with_picture(
+	const std::vector<const Data_chunk_t *>& age_sex_data) const {
+
+	return chunk_lists(age_sex_data, &Data_chunk_t::with_picture);
+}
+
+Posting_lists_t
+Search::search_single_users(
+	const std::vector<const Data_chunk_t *>& age_sex_data) const {
+
+	return chunk_lists(age_sex_data, &Data_chunk_t::single_users);
+}
+
+Posting_lists_t
+Search::search_birthdays(
+	const std::vector<const Data_chunk_t *>& age_sex_data) const {
+
+	return chunk_lists(age_sex_data, &Data_chunk_t::birthdays);
 }
 
-Id_set_t
+Result_set_t
 Search::search_online(
 	const std::vector<const Data_chunk_t *>& age_sex_data) const {
 
 	assert(&age_sex_data != NULL);
 	// The set of matches
-	Id_set_t found_list;
+	Result_set_t found_list;
 	
 	// We already know the gender and age range we are interested in:
 	std::vector<const Data_chunk_t *>::const_iterator it;
-	ReadLock lock(this->data.lock);
 	for (it = age_sex_data.begin(); it != age_sex_data.end(); ++it) {
 		ReadLock lock_online((*it)->online_lock);
 		for (Id_set_t::const_iterator itLocal = (*it)->online.begin();
@@ -1034,17 +1319,16 @@ Search::search_online(
 	return found_list;
 }
 
-Id_set_t
+Result_set_t
 Search::search_new_users(
 	const std::vector<const Data_chunk_t *>& age_sex_data) const {
 
 	assert(&age_sex_data != NULL);
 	// The set of matches
-	Id_set_t found_list;
+	Result_set_t found_list;
 	
 	// We already know the gender and age range we are interested in:
 	std::vector<const Data_chunk_t *>::const_iterator it;
-	ReadLock lock(this->data.lock);
 	for (it = age_sex_data.begin(); it != age_sex_data.end(); ++it) {
 		ReadLock lock_new_users((*it)->new_users_lock);
 		for (Id_set_t::const_iterator itLocal = (*it)->new_users.begin();
@@ -1058,31 +1342,196 @@ Search::search_new_users(
 	
 }
 
-Id_set_t
+Posting_lists_t
 Search::search_active_recently(
 	const std::vector<const Data_chunk_t *>& age_sex_data) const {
 
+	return chunk_lists(age_sex_data, &Data_chunk_t::active_recently);
+}
+
+void
+Search::intersect_lists(Posting_lists_t& lists, Result_set_t& found_list) const {
+	if (lists.empty()) {
+		return;
+	}
+	// Start with the rarest, so the working set is small from the outset.
+	std::sort(lists.begin(), lists.end(), shorter_list);
+	if (lists.size() == 1) {
+		found_list.insert(lists[0]->begin(), lists[0]->end());
+		return;
+	}
+	Result_set_t intersection;
+	std::set_intersection(lists[0]->begin(), lists[0]->end(),
+		lists[1]->begin(), lists[1]->end(),
+		std::inserter(intersection, intersection.end()));
+	Posting_lists_t::const_iterator it;
+	for (it = lists.begin() + 2;
+		(it != lists.end()) && !intersection.empty();
+		++it) {
+
+		Result_set_t next;
+		std::set_intersection(intersection.begin(), intersection.end(),
+			(*it)->begin(), (*it)->end(),
+			std::inserter(next, next.end()));
+		intersection.swap(next);
+	}
+	found_list.insert(intersection.begin(), intersection.end());
+}
+
+// Orders userids by score, highest first.
+class By_score_t {
+public:
+	By_score_t(const Result_scores_t& new_scores) : scores(new_scores) {}
+
+	bool operator()(Id_t lhs, Id_t rhs) const {
+		return score(lhs) > score(rhs);
+	}
+
+private:
+	unsigned int score(Id_t userid) const {
+		Result_scores_t::const_iterator found = this->scores.find(userid);
+		return (found == this->scores.end()) ? 0 : found->second;
+	}
+
+	const Result_scores_t& scores;
+};
+
+void
+Search::rank(Result_list_t& results, const Result_scores_t& scores) const {
+	if (scores.empty()) {
+		return;
+	}
+	std::stable_sort(results.begin(), results.end(), By_score_t(scores));
+}
+
+Posting_lists_t
+Search::interest_lists(const std::vector<const Data_chunk_t *>& age_sex_data,
+	const Id_t interest) const {
+
 	assert(&age_sex_data != NULL);
-	// The set of matches
-	Id_set_t found_list;
-	
-	// We already know the gender and age range we are interested in:
+	Posting_lists_t lists;
 	std::vector<const Data_chunk_t *>::const_iterator it;
-	ReadLock lock(this->data.lock);
 	for (it = age_sex_data.begin(); it != age_sex_data.end(); ++it) {
-		for (Id_set_t::const_iterator itLocal = (*it)->active_recently.begin();
-			itLocal != (*it)->active_recently.end();
-			++itLocal) {
-				
-			found_list.insert(*itLocal);
+		Id_to_id_set_t::const_iterator itFound;
+		itFound = (*it)->interests.find(interest);
+		if (itFound != (*it)->interests.end()) {
+			lists.push_back(&itFound->second);
+		}
+	}
+	return lists;
+}
+
+Posting_lists_t
+Search::chunk_lists(const std::vector<const Data_chunk_t *>& age_sex_data,
+	Id_set_t Data_chunk_t::*list) const {
+
+	assert(&age_sex_data != NULL);
+	Posting_lists_t lists;
+	std::vector<const Data_chunk_t *>::const_iterator it;
+	for (it = age_sex_data.begin(); it != age_sex_data.end(); ++it) {
+		lists.push_back(&((*it)->*list));
+	}
+	return lists;
+}
+
+void
+Search::intersect(Result_set_t& all_results, const Posting_lists_t& lists,
+	const bool allow_copy) const {
+
+	assert(&all_results != NULL);
+	assert(&lists != NULL);
+	if (allow_copy && all_results.empty()) {
+		for (Posting_lists_t::const_iterator it = lists.begin();
+			it != lists.end();
+			++it) {
+
+			all_results.insert((*it)->begin(), (*it)->end());
+		}
+		return;
+	}
+
+	// Each user is in only one chunk, so the intersection with all the
+	// chunks' lists is the union of the intersections with each.  Where
+	// the list dwarfs our results, probing it beats walking it.
+	Result_set_t intersection;
+	for (Posting_lists_t::const_iterator it = lists.begin();
+		it != lists.end();
+		++it) {
+
+		const Id_set_t& list(**it);
+		if (all_results.size() * PROBE_RATIO < list.size()) {
+			for (Result_set_t::const_iterator itResult = all_results.begin();
+				itResult != all_results.end();
+				++itResult) {
+
+				if (list.find(*itResult) != list.end()) {
+					intersection.insert(intersection.end(), *itResult);
+				}
+			}
+		} else {
+			std::set_intersection(
+				all_results.begin(), all_results.end(),
+				list.begin(), list.end(),
+				std::inserter(intersection, intersection.end()));
+		}
+	}
+	all_results.swap(intersection);
+	if (program_options->verbose() >= 3) {
+		std::cout << "After intersect, " << all_results.size() << std::endl;
+	}
+}
+
+void
+Search::subtract(Result_set_t& all_results,
+	const Posting_lists_t& lists) const {
+
+	for (Posting_lists_t::const_iterator it = lists.begin();
+		(it != lists.end()) && !all_results.empty();
+		++it) {
+
+		subtract(all_results, **it);
+	}
+}
+
+template <typename Set>
+void
+Search::subtract(Result_set_t& all_results, const Set& list) const {
+	// Walk whichever side is shorter.
+	if (list.size() > all_results.size()) {
+		for (Result_set_t::iterator it = all_results.begin();
+			it != all_results.end();
+			/* Increment below */ ) {
+
+			if (list.find(*it) != list.end()) {
+				all_results.erase(it++);
+			} else {
+				++it;
+			}
+		}
+	} else {
+		for (typename Set::const_iterator it = list.begin();
+			it != list.end();
+			++it) {
+
+			all_results.erase(*it);
 		}
 	}
-	return found_list;
 }
 
+void
+Search::subtract(Result_set_t& all_results,
+	const std::vector<Id_t>& userids) const {
+
+	for (std::vector<Id_t>::const_iterator it = userids.begin();
+		it != userids.end();
+		++it) {
+
+		all_results.erase(*it);
+	}
+}
 
 void
-Search::intersect(Id_set_t& all_results, Id_set_t& local_results,
+Search::intersect(Result_set_t& all_results, Result_set_t& local_results,
 	const bool allow_copy) const {
 
 	assert(&all_results != NULL);
@@ -1094,7 +1543,7 @@ Search::intersect(Id_set_t& all_results, Id_set_t& local_results,
 	if (allow_copy && all_results.empty()) {
 		all_results.swap(local_results);
 	} else {
-		Id_set_t intersection;
+		Result_set_t intersection;
 		std::set_intersection(
 			all_results.begin(), all_results.end(),
 			local_results.begin(), local_results.end(),
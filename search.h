@@ -2,9 +2,21 @@
 #define _SEARCH_H_
 
 #include "data_structures.h"
+#include "search_trace.h"
+
+// Posting lists borrowed from the index, typically one per data chunk.
+// They are only good while data.lock is held.
+typedef std::vector<const Id_set_t *> Posting_lists_t;
+
+// Userid to score, for ranking results.
+typedef std::map<Id_t, unsigned int, std::less<Id_t>,
+	Arena_allocator_t<std::pair<const Id_t, unsigned int> > > Result_scores_t;
 
 class Search {
 public:
+	// The most results the server sends back for a search.
+	static const size_t MAX_RESULTS = 1000;
+
 	Search(const All_data_t &the_data);
 	virtual ~Search() {}
 
@@ -13,17 +25,55 @@ public:
 	// in user's friends list, ordered randomly, followed by matches in
 	// user's friends-of-friends list, ordered randomly, followed by
 	// school, location, and all matches, again all ordered randomly.
+	// With the fuzzy parameter (1 or 2), names within that many edits of
+	// the name searched for are also matched, and come last, closest
+	// first, unless there are MAX_RESULTS results without them.  They are
+	// only looked for among the users the other filters leave, and not in
+	// chunks where too many names share n-grams with the name (see
+	// Name_index_t::fuzzy_search).
+	// param_lists["interest"] are interests users must all have.  Users
+	// must also have at least interest_min_match (default 1) of
+	// param_lists["interest_any"], and within each group of results,
+	// those with more of them come first.
+	// Users in param_lists["exclude_ids"], or in any of the schools,
+	// locations or interests in param_lists["not_school"],
+	// ["not_location"] or ["not_interest"], are left out.
+	// If trace is not NULL, each stage of the search is marked on it.
 	std::vector<Id_t> do_search(
 		Id_t searcher_userid,
 		Id_t searcher_school,
 		Id_t searcher_location,
 		Params_t params,
-		std::vector<Id_t> interests
+		Param_lists_t param_lists,
+		Search_trace_t *trace = NULL
 	) const;
+
+	// Return up to autocomplete_limit (default 10) users whose username,
+	// first name, last name or "first last" name starts with the
+	// autocomplete parameter, in order of completion.  min_age, max_age
+	// and sex restrict the results as they do for do_search.
+	std::vector<Id_t> autocomplete(Params_t params) const;
 	
 private:
+	// Pointers to the data chunks for the sex and age range asked for.
+	std::vector<const Data_chunk_t *> select_chunks(Params_t& params) const;
+
+	// Drop the chunks which cannot have any users in school (if not 0),
+	// in location (if not 0), with all of all_interests and with at least
+	// min_match of any_interests, judging by the chunk summaries alone.
+	// Every result must come from some chunk, so this never changes the
+	// results, but it saves looking in each chunk's maps for every
+	// filter.
+	void prune_chunks(std::vector<const Data_chunk_t *>& age_sex_data,
+		Id_t school, Id_t location,
+		const std::vector<Id_t>& all_interests,
+		const std::vector<Id_t>& any_interests, size_t min_match) const;
+
+	// Helpers below which look at the index expect data.lock to be held
+	// for reading.
+
 	// Return all the users we know about.
-	Id_set_t dump_all_users(
+	Posting_lists_t dump_all_users(
 		const std::vector<const Data_chunk_t *>& age_sex_data,
 		bool full_results) const;
 	
@@ -31,72 +81,178 @@ private:
 	// Return a pair of result sets.  The first is a single result, which
 	// may be 0 (no result), indicating an exact match.  The second is a
 	// set of regular results based on our lazy substring matches.
-	std::pair<Id_t, Id_set_t> search_usernames(
+	std::pair<Id_t, Result_set_t> search_usernames(
 		const std::vector<const Data_chunk_t *>& age_sex_data,
 		Name_t username) const;
 	
 	// Perform firstname substring matches.
 	// Return a pair of result sets.  The first is a set of exact realname
 	// matches.  The second is a set of inexact realname matches.
-	std::pair<Id_set_t, Id_set_t> search_firstnames(
+	std::pair<Result_set_t, Result_set_t> search_firstnames(
 		const std::vector<const Data_chunk_t *>& age_sex_data,
 		Name_t name) const;
 	
-	// Perform firstname substring matches.
+	// Perform lastname substring matches.
 	// Return a pair of result sets.  The first is a set of exact realname
 	// matches.  The second is a set of inexact realname matches.
-	std::pair<Id_set_t, Id_set_t> search_lastnames(
+	std::pair<Result_set_t, Result_set_t> search_lastnames(
 		const std::vector<const Data_chunk_t *>& age_sex_data,
 		Name_t name) const;
+
+	// Perform substring matches against one kind of name (index) in each
+	// data chunk, adding matches to found_list and, if exact_matches is
+	// not NULL, exact matches to exact_matches.
+	void search_names(
+		const std::vector<const Data_chunk_t *>& age_sex_data,
+		Name_index_t Data_chunk_t::*index, const Name_t& name,
+		Result_set_t& found_list, Result_set_t *exact_matches) const;
+
+	// Find users whose username or real name contains name (both first
+	// and last name, if name has both), adding them to matches.  The user
+	// whose username is exactly name, if any, goes in exact_username, and
+	// the others whose real name is, in exact_realnames.
+	void search_name(const std::vector<const Data_chunk_t *>& age_sex_data,
+		const Name_t& name, Result_set_t& matches, Id_t& exact_username,
+		Result_set_t& exact_realnames) const;
+	
+	// Find users whose username or real name is within max_distance
+	// edits of name, returning the smallest distance found for each.
+	// Short names are allowed fewer edits, as otherwise nearly everything
+	// would match.  Users in known, those substring search found, are
+	// left out, as are those not in within, if it is not NULL.  The
+	// number of chunk indexes with too many candidates to search is added
+	// to capped.
+	Id_to_distance_t search_fuzzy_names(
+		const std::vector<const Data_chunk_t *>& age_sex_data,
+		const Name_t& name, unsigned int max_distance,
+		const Result_set_t& known, const Result_set_t *within,
+		size_t& capped) const;
+
+	// Perform approximate substring matches against one kind of name
+	// (index) in each data chunk, recording distances, and return the
+	// number of chunks with too many candidates to search.
+	size_t search_names_fuzzy(
+		const std::vector<const Data_chunk_t *>& age_sex_data,
+		Name_index_t Data_chunk_t::*index, const Name_t& name,
+		unsigned int max_distance, const Result_set_t& known,
+		const Result_set_t *within, Id_to_distance_t& distances) const;
 	
-	// Search for users matching ALL of the given interests.
-	Id_set_t search_interests(
+	// Search for users matching ALL of all_interests, and at least
+	// min_match of any_interests.  The number of any_interests each user
+	// has goes in scores.
+	Result_set_t search_interests(
 		const std::vector<const Data_chunk_t *>& age_sex_data,
-		const std::vector<Id_t>& interests) const;
+		const std::vector<Id_t>& all_interests,
+		const std::vector<Id_t>& any_interests, size_t min_match,
+		Result_scores_t& scores) const;
+
+	// Add the users in at least min_match of lists to found_list, with
+	// the number of lists they are in to scores.  The lists are merged
+	// through a heap, so each is read once, in order.
+	void count_lists(const Posting_lists_t& lists, size_t min_match,
+		const Result_set_t *required, Result_set_t& found_list,
+		Result_scores_t& scores) const;
+
+	// Order results by score, highest first, keeping the existing order
+	// among equal scores.
+	void rank(Result_list_t& results, const Result_scores_t& scores) const;
 	
-	// Search for users in the given location.
-	Id_set_t search_location(
+	// Search for users in the given location, or any of its children.
+	Result_set_t search_location(
 		const std::vector<const Data_chunk_t *>& age_sex_data,
 		const Id_t location) const;
 	
+	// Add the users in column within range to found_list.
+	void scan_location_column(const Location_column_t& column,
+		const Location_range_t& range, Result_set_t& found_list) const;
+
 	// Search for users in the given school
-	Id_set_t search_school(
+	Posting_lists_t search_school(
 		const std::vector<const Data_chunk_t *>& age_sex_data,
 		const Id_t school) const;
+
+	// The composite index covering the most of the yes/no filters in
+	// flags, school (if not 0) and location (if not 0), or -1 if there is
+	// none.
+	int choose_composite(
+		const std::vector<const Data_chunk_t *>& age_sex_data,
+		unsigned int flags, Id_t school, Id_t location) const;
+
+	// Users matching a composite index without a key, or with a school
+	// key, at the given school.
+	Posting_lists_t composite_lists(
+		const std::vector<const Data_chunk_t *>& age_sex_data,
+		size_t composite, Id_t school) const;
+
+	// Users matching a composite index with a location key, in the given
+	// location or any of its children.
+	Result_set_t search_composite_location(
+		const std::vector<const Data_chunk_t *>& age_sex_data,
+		size_t composite, Id_t location) const;
 	
 	// Search for users with given sexuality
-	Id_set_t search_sexuality(
+	Posting_lists_t search_sexuality(
 		const std::vector<const Data_chunk_t *>& age_sex_data,
 		const unsigned short sexuality) const;
 	
 	// Search for users with picture(s)
-	Id_set_t search_with_picture(
+	Posting_lists_t search_with_picture(
 		const std::vector<const Data_chunk_t *>& age_sex_data) const;
 	
 	// Search for single users (single, single-and-looking)
-	Id_set_t search_single_users(
+	Posting_lists_t search_single_users(
 		const std::vector<const Data_chunk_t *>& age_sex_data) const;
 	
 	// Search for users whose birthday it is today
-	Id_set_t search_birthdays(
+	Posting_lists_t search_birthdays(
 		const std::vector<const Data_chunk_t *>& age_sex_data) const;
 	
 	// Search for users who are currently online
-	Id_set_t search_online(
+	Result_set_t search_online(
 		const std::vector<const Data_chunk_t *>& age_sex_data) const;
 	
 	// Search for new users only
-	Id_set_t search_new_users(
+	Result_set_t search_new_users(
 		const std::vector<const Data_chunk_t *>& age_sex_data) const;
 	
 	// Search for users active recently
-	Id_set_t search_active_recently(
+	Posting_lists_t search_active_recently(
 		const std::vector<const Data_chunk_t *>& age_sex_data) const;
 	
+	// Users with the given interest, in each data chunk.
+	Posting_lists_t interest_lists(
+		const std::vector<const Data_chunk_t *>& age_sex_data,
+		const Id_t interest) const;
+
+	// The list member of each data chunk.
+	Posting_lists_t chunk_lists(
+		const std::vector<const Data_chunk_t *>& age_sex_data,
+		Id_set_t Data_chunk_t::*list) const;
+
+	// Add the users in every one of lists to found_list.  lists is
+	// reordered.
+	void intersect_lists(Posting_lists_t& lists,
+		Result_set_t& found_list) const;
+
+	// AND together results and the union of posting lists, without
+	// copying the lists.  If allow_copy is true and all_results is
+	// empty, all_results becomes the union of the lists.
+	void intersect(Result_set_t& all_results, const Posting_lists_t& lists,
+		const bool allow_copy) const;
+
+	// Remove users in any of lists, in list, or in userids from
+	// all_results (AND NOT).
+	void subtract(Result_set_t& all_results,
+		const Posting_lists_t& lists) const;
+	template <typename Set>
+	void subtract(Result_set_t& all_results, const Set& list) const;
+	void subtract(Result_set_t& all_results,
+		const std::vector<Id_t>& userids) const;
+
 	// This is used so that we can AND together two sets of results.
 	// If allow_copy is true, we will simply copy (actually, swap) from
 	// local_results to all_results if all_results is empty.
-	void intersect(Id_set_t& all_results, Id_set_t& local_results,
+	void intersect(Result_set_t& all_results, Result_set_t& local_results,
 		const bool allow_copy) const;
 	
 private:
@@ -0,0 +1,125 @@
+#include "search_trace.h"
+
+#include <iomanip>
+#include <sstream>
+
+#include "query_arena.h"
+
+// Microseconds from from to to.
+static unsigned long micros_between(const struct timeval& from,
+	const struct timeval& to) {
+
+	return (to.tv_sec - from.tv_sec) * 1000000 + (to.tv_usec - from.tv_usec);
+}
+
+Search_trace_t::Step_t::Step_t() :
+	matches(-1), estimate(-1), results(0), chunks(0), bytes(0), micros(0)
+{ }
+
+Search_trace_t::Search_trace_t() :
+	last_bytes(Query_arena_t::bytes_used()), population(0), filtered(false) {
+
+	gettimeofday(&this->start, NULL);
+	this->last = this->start;
+}
+
+void
+Search_trace_t::mark(const std::string& name, size_t results, size_t chunks,
+	const std::string& note) {
+
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	// The arena starts again from nothing after each search.
+	size_t bytes = Query_arena_t::bytes_used();
+	Step_t step;
+	step.name = name;
+	step.results = results;
+	step.chunks = chunks;
+	step.bytes = (bytes > this->last_bytes) ? bytes - this->last_bytes : 0;
+	step.micros = micros_between(this->last, now);
+	step.note = note;
+	this->steps.push_back(step);
+	this->last = now;
+	this->last_bytes = bytes;
+}
+
+void
+Search_trace_t::mark_filter(const std::string& name, size_t matches,
+	size_t results, size_t chunks, const std::string& note) {
+
+	double estimate = matches;
+	if (this->filtered && !this->steps.empty()) {
+		estimate = (this->population == 0) ? 0.0 :
+			static_cast<double>(this->steps.back().results) * matches /
+			this->population;
+	}
+	mark(name, results, chunks, note);
+	this->steps.back().matches = matches;
+	this->steps.back().estimate = static_cast<long>(estimate + 0.5);
+	this->filtered = true;
+}
+
+void
+Search_trace_t::set_population(size_t users) {
+	this->population = users;
+}
+
+unsigned long
+Search_trace_t::total_micros() const {
+	return micros_between(this->start, this->last);
+}
+
+std::string
+Search_trace_t::str() const {
+	std::stringstream out;
+	for (std::vector<Step_t>::const_iterator it = this->steps.begin();
+		it != this->steps.end();
+		++it) {
+
+		if (it != this->steps.begin()) {
+			out << " ";
+		}
+		out << it->name << "=" << it->micros << "us:" << it->results;
+	}
+	return out.str();
+}
+
+// A count for the plan, or "-" if there is none.
+static std::string count_or_dash(long count) {
+	if (count < 0) {
+		return "-";
+	}
+	std::stringstream out;
+	out << count;
+	return out.str();
+}
+
+std::string
+Search_trace_t::plan() const {
+	std::stringstream out;
+	out << std::left << std::setw(16) << "step" << std::right <<
+		std::setw(10) << "matches" << std::setw(10) << "estimate" <<
+		std::setw(10) << "actual" << std::setw(7) << "chunks" <<
+		std::setw(11) << "bytes" << std::setw(10) << "us" << "  note\n";
+	size_t bytes = 0;
+	for (std::vector<Step_t>::const_iterator it = this->steps.begin();
+		it != this->steps.end();
+		++it) {
+
+		out << std::left << std::setw(16) << it->name << std::right <<
+			std::setw(10) << count_or_dash(it->matches) <<
+			std::setw(10) << count_or_dash(it->estimate) <<
+			std::setw(10) << it->results << std::setw(7) << it->chunks <<
+			std::setw(11) << it->bytes << std::setw(10) << it->micros;
+		if (!it->note.empty()) {
+			out << "  " << it->note;
+		}
+		out << "\n";
+		bytes += it->bytes;
+	}
+	size_t results = this->steps.empty() ? 0 : this->steps.back().results;
+	out << std::left << std::setw(16) << "total" << std::right <<
+		std::setw(30) << results << std::setw(18) << bytes <<
+		std::setw(10) << total_micros() << "\n";
+	return out.str();
+}
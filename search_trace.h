@@ -0,0 +1,73 @@
+#ifndef _SEARCH_TRACE_H_
+#define _SEARCH_TRACE_H_
+
+#include <string>
+#include <sys/time.h>
+#include <vector>
+
+// What each stage of one search did: how long it took, how many results
+// were left after it, and for filters, how many users matched and how
+// many results we would have expected.  The clock starts when the trace
+// is made, and each call to mark() or mark_filter() ends a stage.
+class Search_trace_t {
+public:
+	class Step_t {
+	public:
+		std::string name;
+		// Users in the chunks searched matching the filter by itself, or
+		// -1 if the step is not a filter.
+		long matches;
+		// Results expected after a filter, if it were independent of the
+		// filters before it, or -1 if the step is not a filter.
+		long estimate;
+		// Results left after the step.
+		size_t results;
+		// Data chunks the step looked in.
+		size_t chunks;
+		// Bytes of temporaries allocated during the step (see
+		// Query_arena_t).
+		size_t bytes;
+		unsigned long micros;
+		// Anything else worth knowing, e.g. which composite index was used.
+		std::string note;
+
+		Step_t();
+	};
+
+	Search_trace_t();
+
+	// The stage called name is over, leaving results, having looked in
+	// chunks data chunks.
+	void mark(const std::string& name, size_t results, size_t chunks = 0,
+		const std::string& note = "");
+
+	// The filter called name is over.  matches users matched it alone,
+	// and results were left after intersecting with it.
+	void mark_filter(const std::string& name, size_t matches,
+		size_t results, size_t chunks, const std::string& note = "");
+
+	// Users in the chunks being searched, for estimating.
+	void set_population(size_t users);
+
+	// Microseconds since the trace was made, up to the last mark().
+	unsigned long total_micros() const;
+
+	// The steps as "name=123us:45" (time taken and results left),
+	// space separated.
+	std::string str() const;
+
+	// The steps as a table, one per line, with a total.
+	std::string plan() const;
+
+	std::vector<Step_t> steps;
+
+private:
+	struct timeval start;
+	struct timeval last;
+	size_t last_bytes;
+	size_t population;
+	// Has a filter narrowed down the results yet?
+	bool filtered;
+};
+
+#endif
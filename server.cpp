@@ -1,6 +1,5 @@
 #include "server.h"
 
-#include <boost/algorithm/string/trim.hpp>
 #include <cstdlib>
 #include <iostream>
 #include <netinet/in.h>
@@ -10,7 +9,10 @@
 #include <sys/socket.h>
 
 #include "load.h"
+#include "memory_use.h"
 #include "program_options.h"
+#include "query_arena.h"
+#include "request.h"
 #include "stats.h"
 #include "thread.h"
 #include "utility.h"
@@ -22,9 +24,17 @@ public:
 };
 
 Server::Server(All_data_t& the_data) :
-	data(the_data), search(the_data), sock(-1) {
+	data(the_data), search(the_data),
+	capture(new Query_capture_t(program_options->query_capture_file(),
+		program_options->query_capture_sample())),
+	slow_log(new Slow_query_log_t(program_options->slow_query_file(),
+		program_options->slow_query_ms())),
+	sock(-1) {
 		
 	create_server();
+	// After create_server, which has told the old child to let go of the
+	// metrics port too.
+	this->metrics.reset(new Metrics_server_t(program_options->metrics_port()));
 }
 
 Server::~Server() {
@@ -116,16 +126,10 @@ Server::handle_request(int incoming_socket) const {
 	char buf[10240];
 	
 	// Get the arguments
-	Id_t searcher_userid = 0;
-	Id_t searcher_school = 0;
-	Id_t searcher_location = 0;
-	Params_t params; // General search parameters
-	std::vector<Id_t> interests;
-	bool perform_search = false;
+	Request_t request;
 	while (fgets(buf, sizeof(buf), conn)) {
 		std::stringstream sbuf(buf);
 		std::string key;
-		std::string value;
 		
 		sbuf >> key;
 		key = Utility::downcase(key);
@@ -134,7 +138,16 @@ Server::handle_request(int incoming_socket) const {
 		} else if (key == "help") {
 			help(conn);
 		} else if (key == "stats") {
-			stats(conn);
+			std::string which;
+			sbuf >> which;
+			which = Utility::downcase(which);
+			if (which == "memory") {
+				memory_stats(conn);
+			} else if (which == "load") {
+				load_stats(conn);
+			} else {
+				stats(conn);
+			}
 			fclose(conn);
 			return;
 		} else if (key == "terminate") {
@@ -143,135 +156,67 @@ Server::handle_request(int incoming_socket) const {
 			fclose(conn);
 			Load::reload_online_and_new(data);
 			return;
-		} else if (key == "searcher_userid") {
-			sbuf >> searcher_userid;
-			global_stats->incrSearchReq(key);
-			perform_search = true;
-		} else if (key == "searcher_school") {
-			sbuf >> searcher_school;
-			global_stats->incrSearchReq(key);
-			perform_search = true;
-		} else if (key == "searcher_location") {
-			sbuf >> searcher_location;
-			global_stats->incrSearchReq(key);
-			perform_search = true;
-		} else if (key == "min_age") {
-			sbuf >> value;
-			params["min_age"] = value;
-			global_stats->incrSearchReq(key);
-			perform_search = true;
-		} else if (key == "max_age") {
-			sbuf >> value;
-			params["max_age"] = value;
-			global_stats->incrSearchReq(key);
-			perform_search = true;
-		} else if (key == "sex") {
-			sbuf >> value;
-			params["sex"] = value;
-			global_stats->incrSearchReq(key);
-			perform_search = true;
-		} else if (key == "name") {
-			std::getline(sbuf, value);
-			boost::algorithm::trim(value);
-			params["name"] = value;
-			global_stats->incrSearchReq(key);
-			perform_search = true;
-		} else if (key == "interest") {
-			sbuf >> value;
-			char *end_ptr;
-			interests.push_back(::strtol(value.c_str(), &end_ptr, 10));
-			if (interests.size() == 1) {
-				global_stats->incrSearchReq(key);
-			}
-			perform_search = true;
-		} else if (key == "location") {
-			sbuf >> value;
-			params["location"] = value;
-			global_stats->incrSearchReq(key);
-			perform_search = true;
-		} else if (key == "school") {
-			sbuf >> value;
-			params["school"] = value;
-			global_stats->incrSearchReq(key);
-			perform_search = true;
-		} else if (key == "sexuality") {
-			sbuf >> value;
-			params["sexuality"] = value;
-			global_stats->incrSearchReq(key);
-			perform_search = true;
-		} else if (key == "with_picture") {
-			sbuf >> value;
-			params["with_picture"] = value;
-			global_stats->incrSearchReq(key);
-			perform_search = true;
-		} else if (key == "single") {
-			sbuf >> value;
-			params["single"] = value;
-			global_stats->incrSearchReq(key);
-			perform_search = true;
-		} else if (key == "birthday") {
-			sbuf >> value;
-			params["birthday"] = value;
-			global_stats->incrSearchReq(key);
-			perform_search = true;
-		} else if (key == "online") {
-			sbuf >> value;
-			params["online"] = value;
-			global_stats->incrSearchReq(key);
-			perform_search = true;
-		} else if (key == "new_users") {
-			sbuf >> value;
-			params["new_users"] = value;
-			global_stats->incrSearchReq(key);
-			perform_search = true;
-		} else if (key == "active_recently") {
-			sbuf >> value;
-			params["active_recently"] = value;
-			global_stats->incrSearchReq(key);
-			perform_search = true;
-		} else if (key == "might_know") {
-			sbuf >> value;
-			params["might_know"] = value;
-			global_stats->incrSearchReq(key);
-			perform_search = true;
-		} else if (key == "no_friends") {
-			sbuf >> value;
-			params["no_friends"] = value;
 		} else {
-			fprintf(conn, "Unknown command.\n\n");
-			help(conn);
+			Stats::Counter_t counter;
+			Request_t::Line_t line = request.parse(key, sbuf, &counter);
+			if (line == Request_t::COUNTED_PARAMETER) {
+				global_stats->incrSearchReq(counter);
+			} else if (line == Request_t::NOT_PARAMETER) {
+				fprintf(conn, "Unknown command.\n\n");
+				help(conn);
+			}
 		}
 	}
 	std::vector<Id_t> results;
+	// Only trace searches if we may log or explain them.
+	Search_trace_t trace;
+	Search_trace_t *tracing = NULL;
+	if (request.explain || this->slow_log->enabled()) {
+		tracing = &trace;
+	}
 	struct timeval tv_start_search, tv_end_search;
-	if (perform_search) {
+	bool perform_search = request.perform_search;
+	if (request.perform_autocomplete) {
+		// Autocompletion is cheap, and is not counted as a search.
+		perform_search = false;
+		results = request.run(this->search);
+		this->capture->record(request);
+	} else if (perform_search) {
 		// Increase overall searches, because an individual search can have
 		// multiple parameters.
-		global_stats->incrSearchReq("search_reqs");
+		global_stats->incrSearchReq(Stats::SEARCH_REQS);
 		global_stats->incrInFlight();	
 	
 		// Do the search
 		gettimeofday(&tv_start_search, NULL);
-		results = this->search.do_search(
-			searcher_userid, searcher_school, searcher_location,
-			params, interests);
-		if (results.size() > 1000) {
-			results.resize(1000);
+		results = request.run(this->search, tracing);
+		if (results.size() > Search::MAX_RESULTS) {
+			results.resize(Search::MAX_RESULTS);
 		}
 		gettimeofday(&tv_end_search, NULL);
+		this->capture->record(request);
 	}
 
 	// Output the results
 	if (program_options->verbose() >= 2) {
 		std::cout << "Found " << results.size() << " matches" << std::endl;
 	}
-	for (std::vector<Id_t>::const_iterator it = results.begin();
-		it != results.end();
-		++it) {
-			
-		fprintf(conn, "%d\n", *it);
+	if (perform_search && request.explain) {
+		// How we got the results, rather than the results themselves.
+		fprintf(conn, "%s", trace.plan().c_str());
+	} else {
+		for (std::vector<Id_t>::const_iterator it = results.begin();
+			it != results.end();
+			++it) {
+				
+			fprintf(conn, "%d\n", *it);
+		}
 	}
 	fclose(conn);
+	if (perform_search && (tracing != NULL)) {
+		trace.mark("output", results.size());
+		this->slow_log->record(request, results.size(), trace);
+	}
 	
 	// Update the time spent
 	struct timeval tv_end_network;
@@ -286,6 +231,15 @@ Server::handle_request(int incoming_socket) const {
 		time_spent += (tv_end_search.tv_usec - tv_start_search.tv_usec) / 1000;
 		global_stats->incrSearchTime(time_spent);
 		global_stats->decrInFlight();
+
+		// And the distribution, in microseconds
+		unsigned long search_micros, network_micros;
+		search_micros = (tv_end_search.tv_sec - tv_start_search.tv_sec) *
+			1000000 + (tv_end_search.tv_usec - tv_start_search.tv_usec);
+		network_micros = (tv_end_network.tv_sec - tv_start_network.tv_sec) *
+			1000000 + (tv_end_network.tv_usec - tv_start_network.tv_usec);
+		global_stats->recordLatency(request.shape(), search_micros,
+			network_micros);
 	}
 }
 
@@ -293,6 +247,7 @@ void
 Server::threaded_accept() {
 	this->thread = Thread::create(server_accept_connections,
 		static_cast<void *>(this));
+	this->metrics->threaded_accept();
 }
 
 void
@@ -307,6 +262,10 @@ Server::help(FILE *conn) const {
 	}
 	fprintf(conn, "help                      display this info\n");
 	fprintf(conn, "stats                     display statistics\n");
+	fprintf(conn, "stats memory              display memory used by each part of\n");
+	fprintf(conn, "                          the data, in bytes\n");
+	fprintf(conn, "stats load                display what each phase of the last\n");
+	fprintf(conn, "                          full load and reload did\n");
 	fprintf(conn, "\n");
 	fprintf(conn, "searcher_userid    <uid>  searcher's userid\n");
 	fprintf(conn, "searcher_school    <id>   searcher's school id\n");
@@ -315,8 +274,12 @@ Server::help(FILE *conn) const {
 	fprintf(conn, "max_age            <age>  maximum age in result set\n");
 	fprintf(conn, "sex                {m,f}  search only for this gender\n");
 	fprintf(conn, "name               <str>  username/realname substring search\n");
+	fprintf(conn, "fuzzy              {1,2}  also match names this many edits away\n");
 	fprintf(conn, "interest           <id>   user interest\n");
 	fprintf(conn, "                          line can be included multiple times\n");
+	fprintf(conn, "interest_any       <id>   any of these interests; users with\n");
+	fprintf(conn, "                          more of them are ranked first\n");
+	fprintf(conn, "interest_min_match <n>    need at least n interest_any (default 1)\n");
 	fprintf(conn, "location           <id>   only in this location (or children)\n");
 	fprintf(conn, "school             <id>   only in this school\n");
 	fprintf(conn, "sexuality          <x>    1 - heterosexual only\n");
@@ -329,7 +292,19 @@ Server::help(FILE *conn) const {
 	fprintf(conn, "new_users          true   only new users\n");
 	fprintf(conn, "active_recently    true   only users active in past 30 days\n");
 	fprintf(conn, "might_know         true   prioritise users the searcher may know\n");
+	fprintf(conn, "exclude_ids        <uid>* leave out these users\n");
+	fprintf(conn, "not_school         <id>   leave out users in this school\n");
+	fprintf(conn, "not_location       <id>   leave out users in this location\n");
+	fprintf(conn, "not_interest       <id>   leave out users with this interest\n");
+	fprintf(conn, "                          these can all be given multiple times\n");
+	fprintf(conn, "explain                   show how the search is done, step by\n");
+	fprintf(conn, "                          step, instead of the results\n");
 	fprintf(conn, "end                       perform search\n");
+	fprintf(conn, "\n");
+	fprintf(conn, "autocomplete       <str>  users whose name starts with <str>\n");
+	fprintf(conn, "                          instead of searching; min_age, max_age\n");
+	fprintf(conn, "                          and sex still apply\n");
+	fprintf(conn, "autocomplete_limit <n>    maximum completions (default 10)\n");
 	fprintf(conn, "\nInternal commands:\n");
 	fprintf(conn, "terminate                 shut down the server\n");
 	fprintf(conn, "reload                    reload online and new users\n");
@@ -349,6 +324,16 @@ Server::stats(FILE *conn) const {
 	 	global_stats->getSearchTimeNetwork());
 	fprintf(conn, "data_reloads_full %u\n", global_stats->getDataReloadFull());
 	fprintf(conn, "data_reloads_fast %u\n", global_stats->getDataReloadFast());
+	fprintf(conn, "load_time_full %lu\n", global_stats->getLoadTimeFull());
+	fprintf(conn, "load_time_fast %lu\n", global_stats->getLoadTimeFast());
+	fprintf(conn, "users %lu\n",
+		static_cast<long unsigned>(global_stats->getUsers()));
+	fprintf(conn, "friend_lists %lu\n",
+		static_cast<long unsigned>(global_stats->getFriendLists()));
+	fprintf(conn, "usernames %lu\n",
+		static_cast<long unsigned>(global_stats->getUsernames()));
+	fprintf(conn, "data_chunks %lu\n",
+		static_cast<long unsigned>(global_stats->getDataChunks()));
 	std::map<std::string, unsigned int> search_reqs;
 	search_reqs = global_stats->getSearchReqs();
 	for (std::map<std::string, unsigned int>::const_iterator it = search_reqs.begin();
@@ -357,6 +342,96 @@ Server::stats(FILE *conn) const {
 
 		fprintf(conn, "%s %u\n", it->first.c_str(), it->second);
 	}
+	// Latency percentiles, in microseconds, by shape of search
+	static const double percentiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	static const char *percentile_names[] = { "p50", "p90", "p99", "p999" };
+	std::vector<std::string> shapes = global_stats->getShapes();
+	for (std::vector<std::string>::const_iterator it = shapes.begin();
+		it != shapes.end();
+		++it) {
+
+		const Latency_histogram_t latencies[] = {
+			global_stats->getSearchLatency(*it),
+			global_stats->getNetworkLatency(*it)
+		};
+		const char *kinds[] = { "search", "network" };
+		for (size_t i = 0; i < 2; ++i) {
+			fprintf(conn, "latency_%s_%s_count %lu\n", kinds[i], it->c_str(),
+				latencies[i].count());
+			for (size_t j = 0; j < 4; ++j) {
+				fprintf(conn, "latency_%s_%s_%s %lu\n", kinds[i], it->c_str(),
+					percentile_names[j],
+					latencies[i].percentile(percentiles[j]));
+			}
+		}
+	}
+}
+
+void
+Server::memory_stats(FILE *conn) const {
+	if (conn == NULL) {
+		throw "Unable to handle incoming connection";
+	}
+	Memory_use_t use = global_stats->getStructureMemory();
+	fprintf(conn, "memory_rss %lu\n",
+		static_cast<long unsigned>(global_stats->getMemoryUse()) * 1024);
+	fprintf(conn, "memory_total %lu\n",
+		static_cast<long unsigned>(use.total()));
+	fprintf(conn, "memory_query_arenas %lu\n",
+		static_cast<long unsigned>(Query_arena_t::bytes_held()));
+	for (Memory_use_t::Parts_t::const_iterator it = use.structures.begin();
+		it != use.structures.end();
+		++it) {
+
+		fprintf(conn, "memory_%s %lu\n", it->first.c_str(),
+			static_cast<long unsigned>(it->second));
+	}
+	for (Memory_use_t::Parts_t::const_iterator it = use.chunks.begin();
+		it != use.chunks.end();
+		++it) {
+
+		fprintf(conn, "memory_chunk_%s %lu\n", it->first.c_str(),
+			static_cast<long unsigned>(it->second));
+	}
+}
+
+void
+Server::load_stats(FILE *conn) const {
+	if (conn == NULL) {
+		throw "Unable to handle incoming connection";
+	}
+	const char *kinds[] = { "full", "fast" };
+	for (size_t i = 0; i < 2; ++i) {
+		std::vector<Load_phase_t> phases = global_stats->getLoadPhases(i == 0);
+		for (std::vector<Load_phase_t>::const_iterator it = phases.begin();
+			it != phases.end();
+			++it) {
+
+			const char *name = it->name.c_str();
+			fprintf(conn, "load_%s_%s_ms %lu\n", kinds[i], name,
+				it->wall_micros / 1000);
+			if (it->requests != 0) {
+				fprintf(conn, "load_%s_%s_requests %lu\n", kinds[i], name,
+					it->requests);
+				fprintf(conn, "load_%s_%s_retries %lu\n", kinds[i], name,
+					it->retries);
+				fprintf(conn, "load_%s_%s_bytes %lu\n", kinds[i], name,
+					it->bytes);
+				fprintf(conn, "load_%s_%s_fetch_ms %lu\n", kinds[i], name,
+					it->fetch_micros / 1000);
+				fprintf(conn, "load_%s_%s_parse_ms %lu\n", kinds[i], name,
+					it->parse_micros / 1000);
+				fprintf(conn, "load_%s_%s_rows %lu\n", kinds[i], name,
+					it->rows);
+				fprintf(conn, "load_%s_%s_rows_per_sec %lu\n", kinds[i], name,
+					it->rows_per_second());
+			}
+			fprintf(conn, "load_%s_%s_lock_wait_ms %lu\n", kinds[i], name,
+				it->lock_micros / 1000);
+			fprintf(conn, "load_%s_%s_insert_ms %lu\n", kinds[i], name,
+				it->insert_micros / 1000);
+		}
+	}
 }
 
 void* server_accept_connections(void *arg) {
@@ -1,7 +1,12 @@
 #ifndef _SERVER_H_
 #define _SERVER_H_
 
+#include <boost/shared_ptr.hpp>
+
+#include "metrics_server.h"
+#include "query_capture.h"
 #include "search.h"
+#include "slow_query_log.h"
 
 class Server {
 public:
@@ -13,6 +18,7 @@ public:
 	
 	// Spawn a new thread to handle incoming connections.
 	// Those incoming connections are each handled in their own thread.
+	// The metrics server, if any, gets a thread of its own.
 	void threaded_accept();
 	
 	// Do not return until the connection handling thread is finished.
@@ -33,6 +39,12 @@ private:
 
 	// Output server stats to the socket
 	void stats(FILE *conn) const;
+
+	// Output the memory taken by each part of the data to the socket
+	void memory_stats(FILE *conn) const;
+
+	// Output what each phase of the last loads did to the socket
+	void load_stats(FILE *conn) const;
 	
 	// Output help info to the socket
 	void help(FILE *conn) const;
@@ -45,6 +57,11 @@ private:
 private:
 	All_data_t &data;
 	Search search;
+	// Sample of the requests we answer, for warming up our successor.
+	boost::shared_ptr<Query_capture_t> capture;
+	boost::shared_ptr<Slow_query_log_t> slow_log;
+	// Serves metrics on metrics_port, if set.
+	boost::shared_ptr<Metrics_server_t> metrics;
 	int sock;
 	pthread_t thread;
 };
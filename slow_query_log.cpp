@@ -0,0 +1,50 @@
+#include "slow_query_log.h"
+
+#include <ctime>
+
+Slow_query_log_t::Slow_query_log_t(const std::string& path,
+	unsigned long threshold_ms) :
+	threshold_micros(threshold_ms * 1000), file(stdout), lock(new RWLock) {
+
+	if (enabled() && !path.empty()) {
+		this->file = fopen(path.c_str(), "a");
+		if (this->file == NULL) {
+			throw "Unable to open slow query log";
+		}
+	}
+}
+
+Slow_query_log_t::~Slow_query_log_t() {
+	if (this->file != stdout) {
+		fclose(this->file);
+	}
+}
+
+bool
+Slow_query_log_t::enabled() const {
+	return this->threshold_micros > 0;
+}
+
+void
+Slow_query_log_t::record(const Request_t& request, size_t results,
+	const Search_trace_t& trace) {
+
+	if (!enabled() || (trace.total_micros() < this->threshold_micros)) {
+		return;
+	}
+
+	time_t now = time(NULL);
+	struct tm local;
+	localtime_r(&now, &local);
+	char date[32];
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &local);
+
+	std::string steps = trace.str();
+	std::string query = request.normalized();
+	WriteLock lock(this->lock);
+	fprintf(this->file, "%s\t%lu\t%lu\t%lu\t%s\t%s\n", date,
+		trace.total_micros(), static_cast<unsigned long>(results),
+		static_cast<unsigned long>(request.searcher_userid), steps.c_str(),
+		query.c_str());
+	fflush(this->file);
+}
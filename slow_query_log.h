@@ -0,0 +1,42 @@
+#ifndef _SLOW_QUERY_LOG_H_
+#define _SLOW_QUERY_LOG_H_
+
+#include <boost/shared_ptr.hpp>
+#include <cstdio>
+#include <string>
+
+#include "lock.h"
+#include "request.h"
+#include "search_trace.h"
+
+// Logs searches which take at least a given time, with the time taken by
+// each stage, so we can see what dominates real world latency.  Each is
+// one tab separated line:
+// date, total microseconds, results, searcher's userid, stages (see
+// Search_trace_t::str), and the normalized request (see
+// Request_t::normalized).
+class Slow_query_log_t {
+public:
+	// Log searches taking threshold_ms or more to path, or to standard
+	// output if path is empty.  A threshold of 0 logs nothing.
+	Slow_query_log_t(const std::string& path, unsigned long threshold_ms);
+	~Slow_query_log_t();
+
+	// Should searches be traced for us?
+	bool enabled() const;
+
+	// Log request if trace shows it was slow.
+	void record(const Request_t& request, size_t results,
+		const Search_trace_t& trace);
+
+private:
+	Slow_query_log_t(const Slow_query_log_t& other);
+	Slow_query_log_t& operator=(const Slow_query_log_t& rhs);
+
+private:
+	unsigned long threshold_micros;
+	FILE *file;
+	boost::shared_ptr<RWLock> lock;
+};
+
+#endif
@@ -1,5 +1,6 @@
 #include "stats.h"
 
+#include <assert.h>
 #include <boost/interprocess/managed_shared_memory.hpp>
 #include <boost/interprocess/sync/named_mutex.hpp>
 #include <boost/interprocess/sync/scoped_lock.hpp>
@@ -9,14 +10,69 @@ boost::shared_ptr<Stats> global_stats;
 
 using namespace boost::interprocess;
 
+// Copy histogram into the array called name in segment.
+static void save_histogram(managed_shared_memory& segment,
+	const std::string& name, const Latency_histogram_t& histogram) {
+
+	std::pair<unsigned int *, size_t> res =
+		segment.find<unsigned int>(name.c_str());
+	if (res.second == Latency_histogram_t::BUCKETS) {
+		std::copy(histogram.counts.begin(), histogram.counts.end(), res.first);
+	}
+}
+
+// Copy the array called name in segment into histogram.
+static void load_histogram(managed_shared_memory& segment,
+	const std::string& name, Latency_histogram_t& histogram) {
+
+	std::pair<unsigned int *, size_t> res =
+		segment.find<unsigned int>(name.c_str());
+	if (res.second == Latency_histogram_t::BUCKETS) {
+		std::copy(res.first, res.first + res.second, histogram.counts.begin());
+	}
+}
+
+// The keys of search requests we count, see server.cpp, in the order of
+// their counters from SEARCH_REQS on.
+static std::vector<std::string> search_req_keys() {
+	std::vector<std::string> keys;
+	keys.push_back("search_reqs");
+	keys.push_back("searcher_userid");
+	keys.push_back("searcher_school");
+	keys.push_back("searcher_location");
+	keys.push_back("min_age");
+	keys.push_back("max_age");
+	keys.push_back("sex");
+	keys.push_back("name");
+	keys.push_back("fuzzy");
+	keys.push_back("interest");
+	keys.push_back("interest_any");
+	keys.push_back("interest_min_match");
+	keys.push_back("location");
+	keys.push_back("school");
+	keys.push_back("sexuality");
+	keys.push_back("with_picture");
+	keys.push_back("single");
+	keys.push_back("birthday");
+	keys.push_back("online");
+	keys.push_back("new_users");
+	keys.push_back("active_recently");
+	keys.push_back("might_know");
+	keys.push_back("exclude_ids");
+	keys.push_back("not_school");
+	keys.push_back("not_location");
+	keys.push_back("not_interest");
+	keys.push_back("autocomplete");
+	return keys;
+}
+
 Stats::Stats(const All_data_t& new_data, pid_t parent_pid) :
-	data(new_data), search_time(0), search_time_network(0),
-	data_reloads_full(0), data_reloads_fast(0), in_flight(0) {
+	data(new_data), keys(search_req_keys()),
+	counters(COUNTERS),
+	after_load_lock(new RWLock) {
+
+	assert(SEARCH_REQS + this->keys.size() == COUNTERS);
 		
-	boost::shared_ptr<RWLock> new_lock(new RWLock);
-	this->rwlock.swap(new_lock);
-	WriteLock lock(this->rwlock);
-	
 	std::stringstream shared_memory_name_s;
 	shared_memory_name_s << "vor_shared_memory-" << parent_pid;
 	this->shared_memory_name = shared_memory_name_s.str();
@@ -29,12 +85,29 @@ Stats::Stats(const All_data_t& new_data, pid_t parent_pid) :
 	gettimeofday(&tv, NULL);
 	this->start_time = tv.tv_sec;
 	
+	for (size_t i = 0; i < this->keys.size(); ++i) {
+		this->key_counters[this->keys[i]] = SEARCH_REQS + i;
+	}
+	// Latencies are kept even if we can't share them with the next child.
+	this->shapes.push_back("name");
+	this->shapes.push_back("interest");
+	this->shapes.push_back("location");
+	this->shapes.push_back("might_know");
+	this->shapes.push_back("browse");
+	for (std::vector<std::string>::const_iterator it = this->shapes.begin();
+		it != this->shapes.end();
+		++it) {
+
+		this->search_latency[*it] = Latency_histogram_t();
+		this->network_latency[*it] = Latency_histogram_t();
+	}
+
 	try {
 		named_mutex mutex(open_or_create, this->mutex_name.c_str());
 		scoped_lock<named_mutex> lock(mutex);
 		
 		managed_shared_memory segment(create_only,
-		 	this->shared_memory_name.c_str(), 65536);
+		 	this->shared_memory_name.c_str(), 131072);
 	
 		// If there's no data in the shared memory area, let's create some.
 		if (segment.find<time_t>("start_time").second != 1)
@@ -49,35 +122,29 @@ Stats::Stats(const All_data_t& new_data, pid_t parent_pid) :
 			segment.construct<unsigned int>("data_reloads_fast")(0);
 		if (segment.find<unsigned int>("in_flight").second != 1)
 			segment.construct<unsigned int>("in_flight")(0);
-		this->keys.push_back("searcher_userid");
-		this->keys.push_back("searcher_school");
-		this->keys.push_back("searcher_location");
-		this->keys.push_back("min_age");
-		this->keys.push_back("max_age");
-		this->keys.push_back("sex");
-		this->keys.push_back("username");
-		this->keys.push_back("firstname");
-		this->keys.push_back("lastname");
-		this->keys.push_back("interest");
-		this->keys.push_back("location");
-		this->keys.push_back("school");
-		this->keys.push_back("sexuality");
-		this->keys.push_back("with_picture");
-		this->keys.push_back("single");
-		this->keys.push_back("birthday");
-		this->keys.push_back("online");
-		this->keys.push_back("new_users");
-		this->keys.push_back("active_recently");
-		this->keys.push_back("might_know");
-		this->keys.push_back("search_reqs");
 		for (std::vector<std::string>::const_iterator it = this->keys.begin();
 			it != this->keys.end();
 			++it) {
 
-			this->search_reqs[*it] = 0;
 			if (segment.find<unsigned int>(it->c_str()).second != 1)
 				segment.construct<unsigned int>(it->c_str())(0);
 		}
+		for (std::vector<std::string>::const_iterator it = this->shapes.begin();
+			it != this->shapes.end();
+			++it) {
+
+			const std::string names[] = {
+				"latency_search_" + *it, "latency_network_" + *it
+			};
+			for (size_t i = 0; i < 2; ++i) {
+				if (segment.find<unsigned int>(names[i].c_str()).second !=
+					Latency_histogram_t::BUCKETS) {
+
+					segment.construct<unsigned int>(names[i].c_str())
+						[Latency_histogram_t::BUCKETS](0);
+				}
+			}
+		}
 	} catch (...) {
 		// Ignore error
 	}
@@ -104,22 +171,22 @@ Stats::save_stats() const {
 		{
 			std::pair<unsigned long * const, size_t> res =
 				segment.find<unsigned long>("search_time");
-			if (res.second == 1) (*res.first) = this->search_time;
+			if (res.second == 1) (*res.first) = getSearchTime();
 		}
 		{
 			std::pair<unsigned long * const, size_t> res =
 				segment.find<unsigned long>("search_time_network");
-			if (res.second == 1) (*res.first) = this->search_time_network;
+			if (res.second == 1) (*res.first) = getSearchTimeNetwork();
 		}
 		{
 			std::pair<unsigned int * const, size_t> res =
 				segment.find<unsigned int>("data_reloads_full");
-			if (res.second == 1) (*res.first) = this->data_reloads_full;
+			if (res.second == 1) (*res.first) = getDataReloadFull();
 		}
 		{
 			std::pair<unsigned int * const, size_t> res =
 				segment.find<unsigned int>("data_reloads_fast");
-			if (res.second == 1) (*res.first) = this->data_reloads_fast;
+			if (res.second == 1) (*res.first) = getDataReloadFast();
 		}
 		for (std::vector<std::string>::const_iterator it = this->keys.begin();
 			it != this->keys.end();
@@ -128,13 +195,18 @@ Stats::save_stats() const {
 			std::pair<unsigned int * const, size_t> res =
 				segment.find<unsigned int>(it->c_str());
 			if (res.second == 1) {
-				std::map<std::string, unsigned int>::const_iterator found;
-				found = this->search_reqs.find(*it);
-				if (found != this->search_reqs.end()) {
-					(*res.first) = found->second;
-				}
+				(*res.first) = getSearchReq(*it);
 			}
 		}
+		for (std::vector<std::string>::const_iterator it = this->shapes.begin();
+			it != this->shapes.end();
+			++it) {
+
+			save_histogram(segment, "latency_search_" + *it,
+				this->search_latency.find(*it)->second);
+			save_histogram(segment, "latency_network_" + *it,
+				this->network_latency.find(*it)->second);
+		}
 	} catch (...) {
 		// Ignore
 	}
@@ -161,22 +233,24 @@ Stats::load_stats() {
 		{
 			std::pair<unsigned long * const, size_t> res =
 				segment.find<unsigned long>("search_time");
-			if (res.second == 1) this->search_time = (*res.first);
+			if (res.second == 1) this->counters.set(SEARCH_TIME, *res.first);
 		}
 		{
 			std::pair<unsigned long * const, size_t> res =
 				segment.find<unsigned long>("search_time_network");
-			if (res.second == 1) this->search_time_network = (*res.first);
+			if (res.second == 1) {
+				this->counters.set(SEARCH_TIME_NETWORK, *res.first);
+			}
 		}
 		{
 			std::pair<unsigned int * const, size_t> res =
 				segment.find<unsigned int>("data_reloads_full");
-			if (res.second == 1) this->data_reloads_full = (*res.first);
+			if (res.second == 1) this->counters.set(DATA_RELOADS_FULL, *res.first);
 		}
 		{
 			std::pair<unsigned int * const, size_t> res =
 				segment.find<unsigned int>("data_reloads_fast");
-			if (res.second == 1) this->data_reloads_fast = (*res.first);
+			if (res.second == 1) this->counters.set(DATA_RELOADS_FAST, *res.first);
 		}
 		for (std::vector<std::string>::const_iterator it = this->keys.begin();
 			it != this->keys.end();
@@ -185,9 +259,18 @@ Stats::load_stats() {
 			std::pair<unsigned int * const, size_t> res =
 				segment.find<unsigned int>(it->c_str());
 			if (res.second == 1) {
-				this->search_reqs[*it] = (*res.first);
+				this->counters.set(this->key_counters[*it], *res.first);
 			}
 		}
+		for (std::vector<std::string>::const_iterator it = this->shapes.begin();
+			it != this->shapes.end();
+			++it) {
+
+			load_histogram(segment, "latency_search_" + *it,
+				this->search_latency[*it]);
+			load_histogram(segment, "latency_network_" + *it,
+				this->network_latency[*it]);
+		}
 	} catch (...) {
 		// Ignore
 	}
@@ -227,92 +310,197 @@ Stats::getMemoryUse() const {
 
 unsigned long
 Stats::getSearchTime() const {
-	ReadLock lock(this->rwlock);
-	return this->search_time;
+	return this->counters.get(SEARCH_TIME);
 }
 
-unsigned long
+void
 Stats::incrSearchTime(const unsigned long taken) {
-	WriteLock lock(this->rwlock);
-	this->search_time += taken;
-	return this->search_time;
+	this->counters.add(SEARCH_TIME, taken);
 }
 
 unsigned long
 Stats::getSearchTimeNetwork() const {
-	ReadLock lock(this->rwlock);
-	return this->search_time_network;
+	return this->counters.get(SEARCH_TIME_NETWORK);
 }
 
-unsigned long
+void
 Stats::incrSearchTimeNetwork(const unsigned long taken) {
-	WriteLock lock(this->rwlock);
-	this->search_time_network += taken;
-	return this->search_time;
+	this->counters.add(SEARCH_TIME_NETWORK, taken);
 }
 
 unsigned int
 Stats::getDataReloadFull() const {
-	ReadLock lock(this->rwlock);
-	return this->data_reloads_full;
+	return this->counters.get(DATA_RELOADS_FULL);
 }
 
-unsigned int
+void
 Stats::incrDataReloadFull() {
-	WriteLock lock(this->rwlock);
-	return ++this->data_reloads_full;
+	this->counters.add(DATA_RELOADS_FULL, 1);
 }
 
 unsigned int
 Stats::getDataReloadFast() const {
-	ReadLock lock(this->rwlock);
-	return this->data_reloads_fast;
+	return this->counters.get(DATA_RELOADS_FAST);
 }
 
-unsigned int
+void
 Stats::incrDataReloadFast() {
-	WriteLock lock(this->rwlock);
-	return ++this->data_reloads_fast;
+	this->counters.add(DATA_RELOADS_FAST, 1);
 }
 
 unsigned int
 Stats::getInFlight() const {
-	ReadLock lock(this->rwlock);
-	return this->in_flight;
+	return this->counters.get(IN_FLIGHT);
 }
 
-unsigned int
+void
 Stats::incrInFlight() {
-	WriteLock lock(this->rwlock);
-	return ++this->in_flight;
+	this->counters.add(IN_FLIGHT, 1);
 }
 
-unsigned int
+void
 Stats::decrInFlight() {
-	WriteLock lock(this->rwlock);
-	return --this->in_flight;
+	this->counters.add(IN_FLIGHT, static_cast<unsigned long>(-1));
+}
+
+unsigned long
+Stats::getLoadTimeFull() const {
+	return this->counters.get(LOAD_TIME_FULL);
+}
+
+unsigned long
+Stats::getLoadTimeFast() const {
+	return this->counters.get(LOAD_TIME_FAST);
+}
+
+void
+Stats::setLoadTime(const bool full, const unsigned long taken) {
+	this->counters.set(full ? LOAD_TIME_FULL : LOAD_TIME_FAST, taken);
+}
+
+size_t
+Stats::getUsers() const {
+	return this->counters.get(USERS);
+}
+
+size_t
+Stats::getFriendLists() const {
+	return this->counters.get(FRIEND_LISTS);
+}
+
+size_t
+Stats::getUsernames() const {
+	return this->counters.get(USERNAMES);
+}
+
+size_t
+Stats::getDataChunks() const {
+	return this->counters.get(DATA_CHUNKS);
+}
+
+void
+Stats::setDataSizes(const size_t users, const size_t friend_lists,
+	const size_t usernames, const size_t data_chunks) {
+
+	this->counters.set(USERS, users);
+	this->counters.set(FRIEND_LISTS, friend_lists);
+	this->counters.set(USERNAMES, usernames);
+	this->counters.set(DATA_CHUNKS, data_chunks);
+}
+
+Memory_use_t
+Stats::getStructureMemory() const {
+	ReadLock lock(this->after_load_lock);
+	return this->structure_memory;  // Return a copy
+}
+
+void
+Stats::setStructureMemory(const Memory_use_t& use) {
+	WriteLock lock(this->after_load_lock);
+	this->structure_memory = use;
+}
+
+std::vector<Load_phase_t>
+Stats::getLoadPhases(const bool full) const {
+	ReadLock lock(this->after_load_lock);
+	return full ? this->load_phases_full : this->load_phases_fast;
+}
+
+void
+Stats::setLoadPhases(const bool full,
+	const std::vector<Load_phase_t>& phases) {
+
+	WriteLock lock(this->after_load_lock);
+	if (full) {
+		this->load_phases_full = phases;
+	} else {
+		this->load_phases_fast = phases;
+	}
 }
 
 std::map<std::string, unsigned int>
 Stats::getSearchReqs() const {
-	ReadLock lock(this->rwlock);
-	return this->search_reqs;  // Return a copy
+	std::map<std::string, unsigned int> search_reqs;
+	for (size_t i = 0; i < this->keys.size(); ++i) {
+		search_reqs[this->keys[i]] = this->counters.get(SEARCH_REQS + i);
+	}
+	return search_reqs;
 }
 
 unsigned int
 Stats::getSearchReq(const std::string& which) const {
-	ReadLock lock(this->rwlock);
-	std::map<std::string, unsigned int>::const_iterator found;
-	found = this->search_reqs.find(which);
-	if (found == this->search_reqs.end()) {
+	std::map<std::string, size_t>::const_iterator found;
+	found = this->key_counters.find(which);
+	if (found == this->key_counters.end()) {
 		return 0;
 	} else {
-		return found->second;
+		return this->counters.get(found->second);
 	}
 }
 
-unsigned int
-Stats::incrSearchReq(const std::string& which) {
-	WriteLock lock(this->rwlock);
-	return ++this->search_reqs[which];
+void
+Stats::incrSearchReq(Counter_t which) {
+	this->counters.add(which, 1);
+}
+
+std::vector<std::string>
+Stats::getShapes() const {
+	return this->shapes;
+}
+
+void
+Stats::recordLatency(const std::string& shape,
+	const unsigned long search_micros, const unsigned long network_micros) {
+
+	// The maps don't change once we're made, and each count is added to
+	// atomically, so this needs no lock.
+	std::map<std::string, Latency_histogram_t>::iterator found;
+	found = this->search_latency.find(shape);
+	if (found != this->search_latency.end()) {
+		found->second.record(search_micros);
+	}
+	found = this->network_latency.find(shape);
+	if (found != this->network_latency.end()) {
+		found->second.record(network_micros);
+	}
+}
+
+Latency_histogram_t
+Stats::getSearchLatency(const std::string& shape) const {
+	std::map<std::string, Latency_histogram_t>::const_iterator found;
+	found = this->search_latency.find(shape);
+	if (found == this->search_latency.end()) {
+		return Latency_histogram_t();
+	}
+	return found->second;  // Return a copy
+}
+
+Latency_histogram_t
+Stats::getNetworkLatency(const std::string& shape) const {
+	std::map<std::string, Latency_histogram_t>::const_iterator found;
+	found = this->network_latency.find(shape);
+	if (found == this->network_latency.end()) {
+		return Latency_histogram_t();
+	}
+	return found->second;  // Return a copy
 }
@@ -1,16 +1,78 @@
 #ifndef _STATS_H_
 #define _STATS_H_
 
+#include <boost/shared_ptr.hpp>
 #include <map>
 #include <string>
 #include <sys/time.h>
+#include <vector>
 
 #include "data_structures.h"
+#include "latency_histogram.h"
+#include "load_phase.h"
 #include "lock.h"
+#include "memory_use.h"
+#include "striped_counters.h"
 
 // Keep track of vor statistics.
 class Stats {
 public:
+	// Each of our counters.  The counts of searches and of each search
+	// key (see keys) follow the others, in the same order as keys.
+	// Request_t::parse gives the counter for each key it counts.
+	enum Counter_t {
+		// Total time spent running all searches, in milliseconds.
+		// This is just the time spent performing the search itself.
+		SEARCH_TIME,
+		// Total time spent running all searches, in milliseconds.
+		// This includes time spent communicating over the network.
+		SEARCH_TIME_NETWORK,
+		// Full data loads
+		DATA_RELOADS_FULL,
+		// New user, online data reloads.
+		DATA_RELOADS_FAST,
+		// How many searches in flight?
+		IN_FLIGHT,
+		// How long the last loads took, in milliseconds.  These and the
+		// sizes of the data are not saved for the next child, which will
+		// load its own.
+		LOAD_TIME_FULL,
+		LOAD_TIME_FAST,
+		USERS,
+		FRIEND_LISTS,
+		USERNAMES,
+		DATA_CHUNKS,
+		// Searches, then searches using each key.
+		SEARCH_REQS,
+		SEARCHER_USERID_REQS,
+		SEARCHER_SCHOOL_REQS,
+		SEARCHER_LOCATION_REQS,
+		MIN_AGE_REQS,
+		MAX_AGE_REQS,
+		SEX_REQS,
+		NAME_REQS,
+		FUZZY_REQS,
+		INTEREST_REQS,
+		INTEREST_ANY_REQS,
+		INTEREST_MIN_MATCH_REQS,
+		LOCATION_REQS,
+		SCHOOL_REQS,
+		SEXUALITY_REQS,
+		WITH_PICTURE_REQS,
+		SINGLE_REQS,
+		BIRTHDAY_REQS,
+		ONLINE_REQS,
+		NEW_USERS_REQS,
+		ACTIVE_RECENTLY_REQS,
+		MIGHT_KNOW_REQS,
+		EXCLUDE_IDS_REQS,
+		NOT_SCHOOL_REQS,
+		NOT_LOCATION_REQS,
+		NOT_INTEREST_REQS,
+		AUTOCOMPLETE_REQS,
+		COUNTERS
+	};
+
 	Stats(const All_data_t& new_data, pid_t parent_pid);
 	~Stats();
 	
@@ -34,28 +96,54 @@ public:
 	// This is in milliseconds.
 	unsigned long getSearchTime() const; 
 	// Increase time spent performing searches.
-	unsigned long incrSearchTime(const unsigned long taken);
+	void incrSearchTime(const unsigned long taken);
 	// Get the total time spent running all the searches, including
 	// network time.
 	// This is in milliseconds.
 	unsigned long getSearchTimeNetwork() const; 
 	// Increase time spent performing searches, including
 	// network time.
-	unsigned long incrSearchTimeNetwork(const unsigned long taken);
+	void incrSearchTimeNetwork(const unsigned long taken);
 	// How many times have we fully reloaded data?
 	unsigned int getDataReloadFull() const;
 	// Increase the number of times we've fully reloaded data.
-	unsigned int incrDataReloadFull();
+	void incrDataReloadFull();
 	// How many times have we reloaded new user, online data?
 	unsigned int getDataReloadFast() const;
 	// Increase the number of times we've reloaded new user, online data.
-	unsigned int incrDataReloadFast();
+	void incrDataReloadFast();
 	// How many searches are currently in flight?
 	unsigned int getInFlight() const;
 	// Increase searches in flight by one.
-	unsigned int incrInFlight();
+	void incrInFlight();
 	// Decrease searches in flight by one.
-	unsigned int decrInFlight();
+	void decrInFlight();
+	// How long did the last full load of data take, in milliseconds?
+	unsigned long getLoadTimeFull() const;
+	// How long did the last reload of new user, online data take, in
+	// milliseconds?
+	unsigned long getLoadTimeFast() const;
+	// Record how long a full load or a reload took, in milliseconds.
+	void setLoadTime(const bool full, const unsigned long taken);
+	// Sizes of the data as of the last load: users, users with friends,
+	// usernames, and data chunks (one per gender and age).
+	size_t getUsers() const;
+	size_t getFriendLists() const;
+	size_t getUsernames() const;
+	size_t getDataChunks() const;
+	// Record the sizes of the data after a load.
+	void setDataSizes(const size_t users, const size_t friend_lists,
+		const size_t usernames, const size_t data_chunks);
+	// Memory taken by each part of the data, as of the last load.
+	Memory_use_t getStructureMemory() const;
+	// Record the memory taken by each part of the data after a load.
+	void setStructureMemory(const Memory_use_t& use);
+	// What each phase of the last full load, or of the last reload of new
+	// user, online data, did.
+	std::vector<Load_phase_t> getLoadPhases(const bool full) const;
+	// Record the phases of a full load or a reload.
+	void setLoadPhases(const bool full,
+		const std::vector<Load_phase_t>& phases);
 	
 	// Get all the statistics on the number of searches executed.
 	// See server.cpp for more information.
@@ -63,35 +151,44 @@ public:
 	// Get one statistic on the number of searches executed.
 	// See server.cpp for more information.
 	unsigned int getSearchReq(const std::string& which) const;
-	// Increment the count of search requests.
+	// Increment the count of searches (SEARCH_REQS), or of searches
+	// using a key (see Request_t::parse).
 	// See server.cpp for more information.
-	unsigned int incrSearchReq(const std::string& which);
+	void incrSearchReq(Counter_t which);
+
+	// The shapes of search we keep latencies for (see Request_t::shape).
+	std::vector<std::string> getShapes() const;
+	// Record how long a search of the given shape took, by itself and
+	// including network time, in microseconds.
+	void recordLatency(const std::string& shape,
+		const unsigned long search_micros, const unsigned long network_micros);
+	// Latencies of searches of the given shape, by themselves.
+	Latency_histogram_t getSearchLatency(const std::string& shape) const;
+	// Latencies of searches of the given shape, including network time.
+	Latency_histogram_t getNetworkLatency(const std::string& shape) const;
 
 private:
 	const All_data_t &data;
-	boost::shared_ptr<RWLock> rwlock;
 	std::string shared_memory_name; // Used to identify shared memory
 	std::string mutex_name; // Used to identify shared mutex name
 	std::vector<std::string> keys; // Search query keys
+	std::map<std::string, size_t> key_counters; // Counter for each key
+	std::vector<std::string> shapes; // Search shapes
 	
 private:
 	// When did the server start up?
 	time_t start_time;
-	// Total time spent running all searches, in milliseconds.
-	// This is just the time spent performing the search itself.
-	unsigned long search_time;
-	// Total time spent running all searches, in milliseconds.
-	// This includes time spent communicating over the network.
-	unsigned long search_time_network;
-	// Full data loads
-	unsigned int data_reloads_full;
-	// New user, online data reloads.
-	unsigned int data_reloads_fast;
-	// How many searches in flight?
-	unsigned int in_flight;
-	// How many searches, and of what types, have been run?
-	// See server.cpp for more information.
-	std::map<std::string, unsigned int> search_reqs;
+	// Updated by every search, so they take no lock.
+	Striped_counters_t counters;
+	// Latencies of each shape of search, by themselves and including
+	// network time.  Only the counts in them change after we start.
+	std::map<std::string, Latency_histogram_t> search_latency;
+	std::map<std::string, Latency_histogram_t> network_latency;
+	// Only changed after a load, but too big to change atomically.
+	Memory_use_t structure_memory;
+	std::vector<Load_phase_t> load_phases_full;
+	std::vector<Load_phase_t> load_phases_fast;
+	boost::shared_ptr<RWLock> after_load_lock;
 
 private:
 	Stats(const Stats& other);
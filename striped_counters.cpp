@@ -0,0 +1,51 @@
+#include "striped_counters.h"
+
+Striped_counters_t::Striped_counters_t(size_t counters) :
+	counters(counters), next_stripe(0) {
+
+	static const size_t PER_LINE = CACHE_LINE / sizeof(unsigned long);
+	this->stride = (counters + PER_LINE - 1) / PER_LINE * PER_LINE;
+	// One line spare so the first stripe can start on a line boundary.
+	this->storage.resize(STRIPES * this->stride + PER_LINE, 0);
+	size_t address = reinterpret_cast<size_t>(&this->storage[0]);
+	size_t offset = (CACHE_LINE - address % CACHE_LINE) % CACHE_LINE;
+	this->stripes = &this->storage[offset / sizeof(unsigned long)];
+	if (pthread_key_create(&this->key, NULL) != 0) {
+		throw "Unable to create key for counter stripes";
+	}
+}
+
+Striped_counters_t::~Striped_counters_t() {
+	pthread_key_delete(this->key);
+}
+
+void
+Striped_counters_t::add(size_t counter, unsigned long amount) {
+	__sync_fetch_and_add(&this->stripes[stripe() * this->stride + counter],
+		amount);
+}
+
+unsigned long
+Striped_counters_t::get(size_t counter) const {
+	unsigned long total = 0;
+	for (size_t stripe = 0; stripe < STRIPES; ++stripe) {
+		total += this->stripes[stripe * this->stride + counter];
+	}
+	return total;
+}
+
+void
+Striped_counters_t::set(size_t counter, unsigned long value) {
+	add(counter, value - get(counter));
+}
+
+size_t
+Striped_counters_t::stripe() {
+	void *value = pthread_getspecific(this->key);
+	if (value != NULL) {
+		return reinterpret_cast<size_t>(value) - 1;
+	}
+	size_t stripe = __sync_fetch_and_add(&this->next_stripe, 1) % STRIPES;
+	pthread_setspecific(this->key, reinterpret_cast<void *>(stripe + 1));
+	return stripe;
+}
@@ -0,0 +1,54 @@
+#ifndef _STRIPED_COUNTERS_H_
+#define _STRIPED_COUNTERS_H_
+
+#include <cstddef>
+#include <pthread.h>
+#include <vector>
+
+// Counters which any number of threads can add to at once without taking
+// a lock.  Each thread adds to its own stripe of the counters, which is
+// padded out to whole cache lines so that threads on different processors
+// don't fight over it, and the stripes are only summed when a counter is
+// read.  If there are more threads than stripes some of them share one,
+// which is still correct, as every add is atomic.
+class Striped_counters_t {
+public:
+	static const size_t STRIPES = 16;
+	static const size_t CACHE_LINE = 64;
+
+	// Make counters counters, all 0.
+	Striped_counters_t(size_t counters);
+	~Striped_counters_t();
+
+	// Add amount to counter.  Adding static_cast<unsigned long>(-1)
+	// takes one away.
+	void add(size_t counter, unsigned long amount);
+
+	// The total of counter, over all the stripes.
+	unsigned long get(size_t counter) const;
+
+	// Make the total of counter value.  Adds made at the same time may be
+	// lost, so this is for restoring counters before they are used.
+	void set(size_t counter, unsigned long value);
+
+private:
+	Striped_counters_t(const Striped_counters_t& other);
+	Striped_counters_t& operator=(const Striped_counters_t& rhs);
+
+	// The stripe the calling thread adds to.
+	size_t stripe();
+
+private:
+	size_t counters;
+	// Counters in each stripe, rounded up to whole cache lines.
+	size_t stride;
+	std::vector<unsigned long> storage;
+	// The first stripe, at the start of a cache line within storage.
+	unsigned long *stripes;
+	// Each thread's stripe, plus one so that 0 means it has none yet.
+	pthread_key_t key;
+	// The stripe the next thread to add will get.
+	unsigned long next_stripe;
+};
+
+#endif
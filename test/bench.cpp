@@ -0,0 +1,263 @@
+// Time searches against made-up data, in process, so that changes to the
+// search engine can be measured without the site or the network.  See
+// "Benchmarking" in the README.
+
+#include <boost/program_options.hpp>
+#include <boost/shared_ptr.hpp>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <sys/time.h>
+#include <vector>
+
+#include "data_structures.h"
+#include "latency_histogram.h"
+#include "lock.h"
+#include "memory_use.h"
+#include "program_options.h"
+#include "request.h"
+#include "search.h"
+#include "synthetic_data.h"
+#include "utility.h"
+
+namespace po = boost::program_options;
+
+// Microseconds from start until now.
+static unsigned long micros_since(const struct timeval& start) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start.tv_sec) * 1000000 +
+		(now.tv_usec - start.tv_usec);
+}
+
+// Feed the server protocol's "key value" lines in in to request, up to
+// the end or an "end" line.
+static void parse_lines(std::istream& in, Request_t& request) {
+	std::string line;
+	while (std::getline(in, line)) {
+		std::stringstream sbuf(line);
+		std::string key;
+		sbuf >> key;
+		key = Utility::downcase(key);
+		if (key.empty()) {
+			continue;
+		} else if ((key == "end") || (key == "quit") || (key == "exit")) {
+			break;
+		} else if (request.parse(key, sbuf) == Request_t::NOT_PARAMETER) {
+			std::cerr << "Ignoring " << key << std::endl;
+		}
+	}
+}
+
+// Read the search in a query file, such as test/test_school.txt, made by
+// the given searcher, as test/benchmark.rb sends it.
+static Request_t read_request(const std::string& path, Id_t searcher_userid,
+	Id_t searcher_school, Id_t searcher_location) {
+
+	std::ifstream in(path.c_str());
+	if (!in) {
+		throw "Unable to read query file";
+	}
+	Request_t request;
+	std::stringstream searcher;
+	searcher << "searcher_userid " << searcher_userid << "\n" <<
+		"searcher_school " << searcher_school << "\n" <<
+		"searcher_location " << searcher_location << "\n";
+	parse_lines(searcher, request);
+	parse_lines(in, request);
+	return request;
+}
+
+// One line of the report.
+static void report(const std::string& name, const std::string& shape,
+	size_t results, unsigned long total_micros,
+	const Latency_histogram_t& latencies) {
+
+	unsigned long count = latencies.count();
+	printf("%-28s %-10s %8lu %9lu %8lu %8lu %8lu %8lu\n", name.c_str(),
+		shape.c_str(), static_cast<unsigned long>(results),
+		count == 0 ? 0 : total_micros / count, latencies.percentile(0.5),
+		latencies.percentile(0.9), latencies.percentile(0.99),
+		latencies.percentile(0.999));
+}
+
+int main(int argc, char *argv[]) {
+	Synthetic_spec_t spec;
+	int iterations, warmup, verbose;
+	Id_t searcher_userid, searcher_school, searcher_location;
+	bool name_trigrams;
+	po::options_description desc("Options");
+	desc.add_options()
+		("help", "Display this information")
+		("users", po::value<unsigned int>(&spec.users)->default_value(spec.users),
+		 "Users to make up")
+		("seed", po::value<unsigned int>(&spec.seed)->default_value(spec.seed),
+		 "Seed for making them up")
+		("firstnames",
+		 po::value<unsigned int>(&spec.firstnames)->default_value(spec.firstnames),
+		 "First names to choose from")
+		("lastnames",
+		 po::value<unsigned int>(&spec.lastnames)->default_value(spec.lastnames),
+		 "Last names to choose from")
+		("name_skew",
+		 po::value<double>(&spec.name_skew)->default_value(spec.name_skew),
+		 "Zipf exponent of the popularity of names")
+		("friends_mean",
+		 po::value<unsigned int>(&spec.friends_mean)->default_value(spec.friends_mean),
+		 "Friends each user makes, on average")
+		("friends_max",
+		 po::value<unsigned int>(&spec.friends_max)->default_value(spec.friends_max),
+		 "Friends each user makes, at most")
+		("interests",
+		 po::value<unsigned int>(&spec.interests)->default_value(spec.interests),
+		 "Interests to choose from")
+		("interests_mean",
+		 po::value<unsigned int>(&spec.interests_mean)->default_value(spec.interests_mean),
+		 "Interests each user has, on average")
+		("interest_skew",
+		 po::value<double>(&spec.interest_skew)->default_value(spec.interest_skew),
+		 "Zipf exponent of the popularity of interests")
+		("schools",
+		 po::value<unsigned int>(&spec.schools)->default_value(spec.schools),
+		 "Schools to choose from")
+		("location_depth",
+		 po::value<unsigned int>(&spec.location_depth)->default_value(spec.location_depth),
+		 "Levels of locations below the root")
+		("location_fanout",
+		 po::value<unsigned int>(&spec.location_fanout)->default_value(spec.location_fanout),
+		 "Children of each location above the lowest level")
+		("name_trigrams",
+		 po::value<bool>(&name_trigrams)->default_value(true),
+		 "Index names by trigram as well as bigram")
+		("composite_index",
+		 po::value<std::vector<std::string> >()->composing(),
+		 "Keep one list for a combination of filters, as vor does")
+		("searcher_userid",
+		 po::value<Id_t>(&searcher_userid)->default_value(1),
+		 "Who is searching")
+		("searcher_school",
+		 po::value<Id_t>(&searcher_school)->default_value(0),
+		 "The searcher's school")
+		("searcher_location",
+		 po::value<Id_t>(&searcher_location)->default_value(0),
+		 "The searcher's location")
+		("warmup", po::value<int>(&warmup)->default_value(10),
+		 "Untimed runs of each query first")
+		("iterations", po::value<int>(&iterations)->default_value(100),
+		 "Timed runs of each query")
+		("verbose,v", po::value<int>(&verbose)->default_value(0),
+		 "Verbosity level of the search engine, 0-3")
+		("query_file",
+		 po::value<std::vector<std::string> >()->composing(),
+		 "Query file, such as test/test_school.txt (may be given more than"
+		 " once, or without --query_file)")
+	;
+	po::positional_options_description positional;
+	positional.add("query_file", -1);
+	po::variables_map vm;
+	try {
+		po::store(po::command_line_parser(argc, argv).
+			options(desc).positional(positional).run(), vm);
+		po::notify(vm);
+	} catch (...) {
+		std::cerr << "Unable to parse options" << std::endl;
+		std::cerr << desc << std::endl;
+		return 1;
+	}
+	if (vm.count("help") || !vm.count("query_file")) {
+		std::cout << "Usage: " << argv[0] << " [options] query_file..." <<
+			std::endl << desc << std::endl;
+		return vm.count("help") ? 0 : 1;
+	}
+
+	// The search engine and loader take their settings from here.
+	std::stringstream verbose_s;
+	verbose_s << verbose;
+	std::vector<std::string> engine_args;
+	engine_args.push_back(argv[0]);
+	engine_args.push_back("--config");
+	engine_args.push_back("/dev/null");
+	engine_args.push_back("--verbose");
+	engine_args.push_back(verbose_s.str());
+	engine_args.push_back("--name_trigrams");
+	engine_args.push_back(name_trigrams ? "true" : "false");
+	if (vm.count("composite_index")) {
+		std::vector<std::string> composites =
+			vm["composite_index"].as<std::vector<std::string> >();
+		for (std::vector<std::string>::const_iterator it = composites.begin();
+			it != composites.end();
+			++it) {
+
+			engine_args.push_back("--composite_index");
+			engine_args.push_back(*it);
+		}
+	}
+	std::vector<char *> engine_argv;
+	for (std::vector<std::string>::iterator it = engine_args.begin();
+		it != engine_args.end();
+		++it) {
+
+		engine_argv.push_back(const_cast<char *>(it->c_str()));
+	}
+	program_options.reset(new ProgramOptions(engine_argv.size(),
+		&engine_argv[0]));
+
+	struct timeval started;
+	gettimeofday(&started, NULL);
+	Synthetic_data::generate(spec, data);
+	unsigned long generate_micros = micros_since(started);
+	size_t data_bytes;
+	{
+		ReadLock lock(data.lock);
+		data_bytes = Memory_use_t::of(data).total();
+	}
+	printf("%u users made up in %lums, taking %lu bytes\n\n", spec.users,
+		generate_micros / 1000, static_cast<unsigned long>(data_bytes));
+
+	Search search(data);
+	std::vector<std::string> files =
+		vm["query_file"].as<std::vector<std::string> >();
+	printf("%-28s %-10s %8s %9s %8s %8s %8s %8s\n", "query", "shape",
+		"results", "mean_us", "p50_us", "p90_us", "p99_us", "p999_us");
+	Latency_histogram_t all_latencies;
+	unsigned long all_micros = 0;
+	size_t all_results = 0;
+	for (std::vector<std::string>::const_iterator itFile = files.begin();
+		itFile != files.end();
+		++itFile) {
+
+		Request_t request;
+		try {
+			request = read_request(*itFile, searcher_userid,
+				searcher_school, searcher_location);
+		} catch (const char *error) {
+			std::cerr << *itFile << ": " << error << std::endl;
+			return 1;
+		}
+		for (int i = 0; i < warmup; ++i) {
+			request.run(search);
+		}
+		Latency_histogram_t latencies;
+		unsigned long total_micros = 0;
+		size_t results = 0;
+		for (int i = 0; i < iterations; ++i) {
+			struct timeval start;
+			gettimeofday(&start, NULL);
+			results = request.run(search).size();
+			unsigned long micros = micros_since(start);
+			latencies.record(micros);
+			all_latencies.record(micros);
+			total_micros += micros;
+		}
+		all_micros += total_micros;
+		all_results += results;
+
+		std::string name(*itFile);
+		name = name.substr(name.rfind('/') + 1);
+		report(name, request.shape(), results, total_micros, latencies);
+	}
+	report("all", "", all_results, all_micros, all_latencies);
+	return 0;
+}
@@ -0,0 +1,380 @@
+// Drive a running server with many searches at once, to find how many it
+// can answer a second and how long they take under load.  See "Load
+// testing" in the README.
+
+#include <boost/program_options.hpp>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sstream>
+#include <string>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <vector>
+
+#include "latency_histogram.h"
+#include "thread.h"
+
+namespace po = boost::program_options;
+
+// What all the connections share: what to send, where, when to stop, and
+// what happened.
+class Load_run_t {
+public:
+	struct sockaddr_in address;
+	// Each request, ready to send, lines and all.
+	std::vector<std::string> requests;
+	// Requests a second, all connections together, or 0 to send each
+	// request as soon as the last one on its connection is answered.
+	double rate;
+	// Stop after this many requests, if not 0, or at deadline.
+	unsigned long max_requests;
+	struct timeval started;
+	struct timeval deadline;
+
+	// Requests taken so far; the next is numbered this.
+	unsigned long next;
+	unsigned long completed;
+	unsigned long errors;
+	// Requests sent a millisecond or more after they were due, because
+	// every connection was busy.
+	unsigned long late;
+	unsigned long total_micros;
+	unsigned long result_lines;
+	Latency_histogram_t latencies;
+
+	Load_run_t() :
+		rate(0), max_requests(0), next(0), completed(0), errors(0), late(0),
+		total_micros(0), result_lines(0) { }
+};
+
+// What one connection needs.
+class Connection_args_t {
+public:
+	Load_run_t *run;
+	// For rand_r, to choose requests.
+	unsigned int seed;
+};
+
+// Microseconds from from to to, which may be negative.
+static long micros_between(const struct timeval& from,
+	const struct timeval& to) {
+
+	return (to.tv_sec - from.tv_sec) * 1000000L + (to.tv_usec - from.tv_usec);
+}
+
+// micros after from.
+static struct timeval add_micros(const struct timeval& from,
+	unsigned long micros) {
+
+	struct timeval result;
+	unsigned long usec = from.tv_usec + micros;
+	result.tv_sec = from.tv_sec + usec / 1000000;
+	result.tv_usec = usec % 1000000;
+	return result;
+}
+
+// Send request to address and read the reply to the end, returning the
+// number of lines in it, or -1 on failure.
+static long send_request(const struct sockaddr_in& address,
+	const std::string& request) {
+
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock == -1) {
+		return -1;
+	}
+	if (connect(sock, (const struct sockaddr *)&address,
+		sizeof(address)) == -1) {
+
+		close(sock);
+		return -1;
+	}
+	size_t written = 0;
+	while (written < request.size()) {
+		ssize_t res = write(sock, request.data() + written,
+			request.size() - written);
+		if (res <= 0) {
+			close(sock);
+			return -1;
+		}
+		written += res;
+	}
+
+	long lines = 0;
+	std::string reply;
+	char buf[65536];
+	ssize_t res;
+	while ((res = read(sock, buf, sizeof(buf))) > 0) {
+		for (ssize_t i = 0; i < res; ++i) {
+			if (buf[i] == '\n') {
+				++lines;
+			}
+		}
+		// Only the start matters, for spotting complaints.
+		if (reply.size() < 64) {
+			reply.append(buf, res);
+		}
+	}
+	close(sock);
+	if ((res < 0) || (reply.compare(0, 15, "Unknown command") == 0)) {
+		return -1;
+	}
+	return lines;
+}
+
+// Take requests from run and send them, one at a time, until it is time
+// to stop.  With a rate, each request is due at a fixed time from the
+// start, and its latency is counted from then, not from when we got
+// round to sending it; otherwise a slow server would make us send less,
+// and hide how slow it was (coordinated omission).
+static void *connection(void *arg) {
+	Connection_args_t *args = static_cast<Connection_args_t *>(arg);
+	Load_run_t& run(*args->run);
+	while (true) {
+		unsigned long n = __sync_fetch_and_add(&run.next, 1);
+		if ((run.max_requests != 0) && (n >= run.max_requests)) {
+			break;
+		}
+		struct timeval due, now;
+		gettimeofday(&now, NULL);
+		if (run.rate > 0) {
+			due = add_micros(run.started,
+				static_cast<unsigned long>(n * 1e6 / run.rate));
+		} else {
+			due = now;
+		}
+		if (micros_between(due, run.deadline) <= 0) {
+			break;
+		}
+		long wait = micros_between(now, due);
+		if (wait > 0) {
+			usleep(wait);
+		} else if (wait <= -1000) {
+			__sync_fetch_and_add(&run.late, 1);
+		}
+
+		const std::string& request(
+			run.requests[rand_r(&args->seed) % run.requests.size()]);
+		long lines = send_request(run.address, request);
+		gettimeofday(&now, NULL);
+		if (lines < 0) {
+			__sync_fetch_and_add(&run.errors, 1);
+			continue;
+		}
+		unsigned long micros = micros_between(due, now);
+		run.latencies.record(micros);
+		__sync_fetch_and_add(&run.total_micros, micros);
+		__sync_fetch_and_add(&run.result_lines, lines);
+		__sync_fetch_and_add(&run.completed, 1);
+	}
+	return NULL;
+}
+
+// The lines saying who is searching, which every request starts with.
+static std::string searcher_lines(unsigned int userid, unsigned int school,
+	unsigned int location) {
+
+	std::stringstream lines;
+	lines << "searcher_userid " << userid << "\n" <<
+		"searcher_school " << school << "\n" <<
+		"searcher_location " << location << "\n";
+	return lines.str();
+}
+
+// A query file, such as test/test_school.txt, as one request.
+static std::string read_query_file(const std::string& path,
+	const std::string& searcher) {
+
+	std::ifstream in(path.c_str());
+	if (!in) {
+		throw "Unable to read query file";
+	}
+	std::string request(searcher), line;
+	while (std::getline(in, line)) {
+		request += line + "\n";
+	}
+	return request + "end\n";
+}
+
+// A query capture file (see query_capture_file), one request a line, so
+// that the mix is as the server saw it.
+static void read_capture_file(const std::string& path,
+	const std::string& searcher, std::vector<std::string>& requests) {
+
+	std::ifstream in(path.c_str());
+	if (!in) {
+		throw "Unable to read capture file";
+	}
+	std::string line;
+	while (std::getline(in, line)) {
+		if (line.empty()) {
+			continue;
+		}
+		std::string request(searcher);
+		for (std::string::const_iterator it = line.begin();
+			it != line.end();
+			++it) {
+
+			request += (*it == '\t') ? '\n' : *it;
+		}
+		requests.push_back(request + "\nend\n");
+	}
+}
+
+int main(int argc, char *argv[]) {
+	Load_run_t run;
+	std::string host;
+	int port, connections;
+	double duration;
+	unsigned int seed, searcher_userid, searcher_school, searcher_location;
+	po::options_description desc("Options");
+	desc.add_options()
+		("help", "Display this information")
+		("host", po::value<std::string>(&host)->default_value("127.0.0.1"),
+		 "Server to test")
+		("port", po::value<int>(&port)->default_value(6974),
+		 "Port it listens on")
+		("connections", po::value<int>(&connections)->default_value(8),
+		 "Requests in flight at once, at most")
+		("rate", po::value<double>(&run.rate)->default_value(0),
+		 "Requests a second to send, on schedule (0 to send each as soon"
+		 " as a connection is free)")
+		("duration", po::value<double>(&duration)->default_value(10),
+		 "Seconds to run for")
+		("requests",
+		 po::value<unsigned long>(&run.max_requests)->default_value(0),
+		 "Stop after this many requests (0 for no limit)")
+		("seed", po::value<unsigned int>(&seed)->default_value(1),
+		 "Seed for choosing requests from the mix")
+		("searcher_userid",
+		 po::value<unsigned int>(&searcher_userid)->default_value(0),
+		 "Who is searching")
+		("searcher_school",
+		 po::value<unsigned int>(&searcher_school)->default_value(0),
+		 "The searcher's school")
+		("searcher_location",
+		 po::value<unsigned int>(&searcher_location)->default_value(0),
+		 "The searcher's location")
+		("capture_file",
+		 po::value<std::vector<std::string> >()->composing(),
+		 "Query capture file, each line a request (may be given more than"
+		 " once)")
+		("query_file",
+		 po::value<std::vector<std::string> >()->composing(),
+		 "Query file, such as test/test_school.txt (may be given more than"
+		 " once, or without --query_file)")
+	;
+	po::positional_options_description positional;
+	positional.add("query_file", -1);
+	po::variables_map vm;
+	try {
+		po::store(po::command_line_parser(argc, argv).
+			options(desc).positional(positional).run(), vm);
+		po::notify(vm);
+	} catch (...) {
+		std::cerr << "Unable to parse options" << std::endl;
+		std::cerr << desc << std::endl;
+		return 1;
+	}
+	if (vm.count("help") ||
+		(!vm.count("query_file") && !vm.count("capture_file"))) {
+
+		std::cout << "Usage: " << argv[0] <<
+			" [options] query_file... [--capture_file file]" << std::endl <<
+			desc << std::endl;
+		return vm.count("help") ? 0 : 1;
+	}
+
+	std::string searcher = searcher_lines(searcher_userid, searcher_school,
+		searcher_location);
+	try {
+		if (vm.count("query_file")) {
+			std::vector<std::string> files =
+				vm["query_file"].as<std::vector<std::string> >();
+			for (std::vector<std::string>::const_iterator it = files.begin();
+				it != files.end();
+				++it) {
+
+				run.requests.push_back(read_query_file(*it, searcher));
+			}
+		}
+		if (vm.count("capture_file")) {
+			std::vector<std::string> files =
+				vm["capture_file"].as<std::vector<std::string> >();
+			for (std::vector<std::string>::const_iterator it = files.begin();
+				it != files.end();
+				++it) {
+
+				read_capture_file(*it, searcher, run.requests);
+			}
+		}
+	} catch (const char *error) {
+		std::cerr << error << std::endl;
+		return 1;
+	}
+	if (run.requests.empty()) {
+		std::cerr << "No requests to send" << std::endl;
+		return 1;
+	}
+
+	struct hostent *found = gethostbyname(host.c_str());
+	if (found == NULL) {
+		std::cerr << "Unable to find " << host << std::endl;
+		return 1;
+	}
+	memset(&run.address, 0, sizeof(run.address));
+	run.address.sin_family = AF_INET;
+	memcpy(&run.address.sin_addr, found->h_addr, found->h_length);
+	run.address.sin_port = htons(port);
+
+	// The server hanging up on us must not stop the test.
+	signal(SIGPIPE, SIG_IGN);
+
+	gettimeofday(&run.started, NULL);
+	run.deadline = add_micros(run.started,
+		static_cast<unsigned long>(duration * 1e6));
+	std::vector<Connection_args_t> args(connections);
+	std::vector<pthread_t> threads;
+	for (int i = 0; i < connections; ++i) {
+		args[i].run = &run;
+		args[i].seed = seed + i;
+		threads.push_back(Thread::create(connection,
+			static_cast<void *>(&args[i])));
+	}
+	for (std::vector<pthread_t>::const_iterator itJoin = threads.begin();
+		itJoin != threads.end();
+		++itJoin) {
+
+		pthread_join(*itJoin, NULL);
+	}
+	struct timeval finished;
+	gettimeofday(&finished, NULL);
+	double seconds = micros_between(run.started, finished) / 1e6;
+
+	printf("%lu requests (%lu distinct), %lu errors, %lu results\n",
+		run.completed, static_cast<unsigned long>(run.requests.size()),
+		run.errors, run.result_lines);
+	printf("%.2fs, %.1f requests/s", seconds, run.completed / seconds);
+	if (run.rate > 0) {
+		printf(" of %.1f asked for, %lu sent late", run.rate, run.late);
+	}
+	printf("\n");
+	printf("latency_us mean %lu p50 %lu p90 %lu p99 %lu p999 %lu max %lu\n",
+		run.completed == 0 ? 0 : run.total_micros / run.completed,
+		run.latencies.percentile(0.5), run.latencies.percentile(0.9),
+		run.latencies.percentile(0.99), run.latencies.percentile(0.999),
+		run.latencies.percentile(1.0));
+	if (run.late != 0) {
+		printf("Requests were sent late because every connection was busy;"
+			" their latency counts from when they were due.  Use more"
+			" --connections to keep to the rate.\n");
+	}
+	return 0;
+}
@@ -0,0 +1,307 @@
+#include "synthetic_data.h"
+
+#include <algorithm>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_01.hpp>
+#include <cctype>
+#include <cmath>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "load.h"
+#include "lock.h"
+#include "program_options.h"
+#include "utility.h"
+
+// Common names, most popular first, which the pools of names start with.
+static const char *COMMON_FIRSTNAMES[] = {
+	"jennifer", "jessica", "ashley", "sarah", "michael", "matthew", "emily",
+	"chris", "amanda", "tyler", "megan", "ryan", "jane", "josh", "kayla",
+	"justin", "nicole", "kyle", "stephanie", "brandon", "brittany",
+	"andrew", "samantha", "jordan", "rachel", "david", "janet", "daniel",
+	"janice", "james", "kevin", "adam", "eric", "mark", "alex", "jan"
+};
+static const char *COMMON_LASTNAMES[] = {
+	"smith", "brown", "tremblay", "martin", "roy", "wilson", "macdonald",
+	"gagnon", "johnson", "taylor", "campbell", "anderson", "jones", "lee",
+	"white", "thompson", "williams", "clark", "scott", "young", "stewart",
+	"walker", "wright", "robinson", "thomas", "mitchell"
+};
+
+// Syllables for making up names beyond the common ones.
+static const char *SYLLABLES[] = {
+	"an", "ar", "ba", "be", "ca", "da", "de", "el", "er", "fa", "ga", "ha",
+	"in", "ja", "ka", "ke", "la", "le", "li", "ma", "me", "mi", "na", "ne",
+	"ni", "on", "or", "pa", "ra", "re", "ri", "ro", "sa", "se", "ta", "te",
+	"to", "va", "vi", "ya", "za", "zo"
+};
+
+// Relative number of users of each age, 0 (unknown) to 80.
+static double age_weight(unsigned int age) {
+	static const double TEENS[] = {
+		6, 9, 11, 12, 11, 9, 7, 6, 5, 4, 3, 3
+	};
+	if (age == 0) {
+		return 2;
+	} else if (age < 13) {
+		return 0;
+	} else if (age < 25) {
+		return TEENS[age - 13];
+	} else if (age <= 30) {
+		return 2;
+	} else if (age <= 40) {
+		return 1;
+	}
+	return 0.1;
+}
+
+// Random numbers, from a seed.
+class Random_t {
+public:
+	Random_t(unsigned int seed) : generator(seed) { }
+
+	// Uniform in [0, 1).
+	double uniform() {
+		return this->uniform_01(this->generator);
+	}
+
+	// Uniform in [0, n).
+	unsigned int below(unsigned int n) {
+		return std::min(static_cast<unsigned int>(uniform() * n), n - 1);
+	}
+
+	// True with probability fraction.
+	bool chance(double fraction) {
+		return uniform() < fraction;
+	}
+
+	// An index into cumulative, a running total of weights, chosen in
+	// proportion to the weights.
+	size_t pick(const std::vector<double>& cumulative) {
+		double at = uniform() * cumulative.back();
+		return std::upper_bound(cumulative.begin(), cumulative.end(), at) -
+			cumulative.begin();
+	}
+
+private:
+	boost::mt19937 generator;
+	boost::uniform_01<double> uniform_01;
+};
+
+// Running totals of 1 / rank ^ skew for ranks 1 to n.
+static std::vector<double> zipf(unsigned int n, double skew) {
+	std::vector<double> cumulative;
+	double total = 0;
+	for (unsigned int rank = 1; rank <= n; ++rank) {
+		total += 1 / std::pow(static_cast<double>(rank), skew);
+		cumulative.push_back(total);
+	}
+	return cumulative;
+}
+
+// A made-up word of two to four syllables.
+static std::string made_up_word(Random_t& random) {
+	const unsigned int syllables = sizeof(SYLLABLES) / sizeof(SYLLABLES[0]);
+	std::string word;
+	for (unsigned int i = 2 + random.below(3); i > 0; --i) {
+		word += SYLLABLES[random.below(syllables)];
+	}
+	return word;
+}
+
+// size names, starting with the common ones, without repeats.
+static std::vector<std::string> name_pool(const char **common,
+	size_t common_size, unsigned int size, Random_t& random) {
+
+	std::vector<std::string> pool;
+	std::set<std::string> seen;
+	for (size_t i = 0; (i < common_size) && (pool.size() < size); ++i) {
+		pool.push_back(common[i]);
+		seen.insert(common[i]);
+	}
+	while (pool.size() < size) {
+		std::string name = made_up_word(random);
+		if (seen.insert(name).second) {
+			pool.push_back(name);
+		}
+	}
+	return pool;
+}
+
+// A username made from a user's real name, the way people make them up.
+static std::string make_username(const std::string& firstname,
+	const std::string& lastname, Random_t& random) {
+
+	std::stringstream username;
+	double style = random.uniform();
+	if (style < 0.35) {
+		username << firstname << 1 + random.below(99);
+	} else if (style < 0.6) {
+		username << firstname << "_" << lastname;
+	} else if (style < 0.8) {
+		username << made_up_word(random) << 1 + random.below(999);
+	} else if (style < 0.9) {
+		username << "x" << firstname << "x";
+	} else {
+		std::string capitalised(firstname);
+		capitalised[0] = toupper(capitalised[0]);
+		username << capitalised << static_cast<char>(toupper(lastname[0]));
+	}
+	return username.str();
+}
+
+Synthetic_spec_t::Synthetic_spec_t() :
+	users(100000), seed(1), firstnames(3000), lastnames(10000),
+	name_skew(1.0), friends_mean(20), friends_max(1000), interests(200),
+	interests_mean(5), interest_skew(0.8), schools(10000), with_school(0.7),
+	location_depth(3), location_fanout(8), with_picture(0.6), single(0.4),
+	online(0.03), new_users(0.01), active_recently(0.2),
+	birthday(1.0 / 365)
+{ }
+
+// Make up the users, as generate() does, but without the indexes built
+// from them.
+static void make_users(const Synthetic_spec_t& spec, All_data_t& data) {
+	Random_t random(spec.seed);
+	bool with_trigrams = program_options->name_trigrams();
+
+	std::vector<std::string> firstnames = name_pool(COMMON_FIRSTNAMES,
+		sizeof(COMMON_FIRSTNAMES) / sizeof(COMMON_FIRSTNAMES[0]),
+		spec.firstnames, random);
+	std::vector<std::string> lastnames = name_pool(COMMON_LASTNAMES,
+		sizeof(COMMON_LASTNAMES) / sizeof(COMMON_LASTNAMES[0]),
+		spec.lastnames, random);
+	std::vector<double> firstname_weights = zipf(firstnames.size(),
+		spec.name_skew);
+	std::vector<double> lastname_weights = zipf(lastnames.size(),
+		spec.name_skew);
+	std::vector<double> interest_weights = zipf(spec.interests,
+		spec.interest_skew);
+	std::vector<double> age_weights;
+	double total = 0;
+	for (unsigned int age = 0; age <= 80; ++age) {
+		total += age_weight(age);
+		age_weights.push_back(total);
+	}
+
+	// The location tree, rooted at 1, which is its own parent, as the
+	// site sends it.
+	Id_to_id_set_t children;
+	std::vector<Id_t> level(1, 1);
+	Id_t next_location = 2;
+	children[1];
+	for (unsigned int depth = 0; depth < spec.location_depth; ++depth) {
+		std::vector<Id_t> next_level;
+		for (std::vector<Id_t>::const_iterator itParent = level.begin();
+			itParent != level.end();
+			++itParent) {
+
+			for (unsigned int i = 0; i < spec.location_fanout; ++i) {
+				children[*itParent].insert(next_location);
+				children[next_location];
+				next_level.push_back(next_location);
+				++next_location;
+			}
+		}
+		level.swap(next_level);
+	}
+	Id_t next_number = 1;
+	number_locations(1, children, data.location_hierarchy, next_number);
+
+	std::set<std::string> usernames_taken;
+	for (Id_t userid = 1; userid <= spec.users; ++userid) {
+		unsigned int age = random.pick(age_weights);
+		char sex = random.chance(0.5) ? 'f' : 'm';
+		Data_chunk_t& chunk(data.data_chunks[sex == 'f' ? 1 : 0][age]);
+		chunk.userids.insert(userid);
+
+		// Details
+		chunk.locations[1 + random.below(next_location - 1)].insert(userid);
+		if (random.chance(spec.with_school)) {
+			Id_t school = 1 + random.below(spec.schools);
+			chunk.schools[school].insert(userid);
+			chunk.school_filter.insert(school);
+		}
+		double sexuality = random.uniform();
+		if (sexuality < 0.8) {
+			chunk.heterosexual.insert(userid);
+		} else if (sexuality < 0.85) {
+			chunk.homosexual.insert(userid);
+		} else if (sexuality < 0.93) {
+			chunk.bisexual.insert(userid);
+		}
+		if (random.chance(spec.with_picture)) {
+			chunk.with_picture.insert(userid);
+		}
+		if (random.chance(spec.single)) {
+			chunk.single_users.insert(userid);
+		}
+
+		// Names
+		std::string firstname = firstnames[random.pick(firstname_weights)];
+		std::string lastname = lastnames[random.pick(lastname_weights)];
+		std::string username = make_username(firstname, lastname, random);
+		while (!usernames_taken.insert(
+			Utility::strip_whitespace(Utility::downcase(username))).second) {
+
+			username += static_cast<char>('0' + random.below(10));
+		}
+		data.usernames_unprocessed[
+			Utility::strip_whitespace(Utility::downcase(username))] = userid;
+		chunk.usernames.insert(userid, Utility::normalize_name(username),
+			with_trigrams);
+		chunk.firstnames.insert(userid, Utility::normalize_name(firstname),
+			with_trigrams);
+		chunk.lastnames.insert(userid, Utility::normalize_name(lastname),
+			with_trigrams);
+
+		// Interests, an exponentially distributed number of them
+		unsigned int interests = static_cast<unsigned int>(
+			-std::log(1 - random.uniform()) * spec.interests_mean);
+		interests = std::min(interests, spec.interests);
+		for (unsigned int i = 0; i < interests; ++i) {
+			Id_t interest = 1 + random.pick(interest_weights);
+			chunk.interests[interest].insert(userid);
+			chunk.interest_filter.insert(interest);
+		}
+
+		// Flags
+		if (random.chance(spec.online)) {
+			chunk.online.insert(userid);
+		}
+		if (random.chance(spec.new_users)) {
+			chunk.new_users.insert(userid);
+		}
+		if (random.chance(spec.active_recently)) {
+			chunk.active_recently.insert(userid);
+		}
+		if (random.chance(spec.birthday)) {
+			chunk.birthdays.insert(userid);
+		}
+
+		// Friends, following a Pareto distribution with shape 2, whose
+		// mean is twice its minimum.
+		unsigned int friends = static_cast<unsigned int>(
+			spec.friends_mean / 2.0 / std::sqrt(1 - random.uniform()));
+		friends = std::min(friends, spec.friends_max);
+		for (unsigned int i = 0; (i < friends) && (spec.users > 1); ++i) {
+			Id_t friendid = 1 + random.below(spec.users);
+			if (friendid != userid) {
+				data.friends[userid].insert(friendid);
+				data.friends[friendid].insert(userid);
+			}
+		}
+	}
+	data.last_loaded_userid = spec.users;
+}
+
+void
+Synthetic_data::generate(const Synthetic_spec_t& spec, All_data_t& data) {
+	{
+		WriteLock lock(data.lock);
+		make_users(spec, data);
+	}
+	Load::build_indexes(data);
+}
@@ -0,0 +1,59 @@
+#ifndef _SYNTHETIC_DATA_H_
+#define _SYNTHETIC_DATA_H_
+
+#include "data_structures.h"
+
+// The shape of a made-up population of users.  The defaults are meant to
+// look like the site: mostly teenagers, a few very popular names and many
+// rare ones, most users with a handful of friends and a few with
+// hundreds.
+class Synthetic_spec_t {
+public:
+	// Users to make, with userids from 1 up.
+	unsigned int users;
+	// Seed for the random numbers, so that runs can be compared.
+	unsigned int seed;
+	// Sizes of the pools of first and last names.  Each pool starts with
+	// common real names, so test searches such as "jane" find something.
+	unsigned int firstnames;
+	unsigned int lastnames;
+	// How much more popular popular names are: a name's popularity goes
+	// as 1 / rank ^ name_skew (a Zipf distribution).
+	double name_skew;
+	// Friends each user makes, on average and at most.  The number
+	// follows a power law, and friendship goes both ways, so each user
+	// ends up with about twice this.
+	unsigned int friends_mean;
+	unsigned int friends_max;
+	// Interests there are, how many each user has on average, and how
+	// skewed their popularity is, as for names.
+	unsigned int interests;
+	unsigned int interests_mean;
+	double interest_skew;
+	// Schools there are.  Users without one are not in any.
+	unsigned int schools;
+	double with_school;
+	// The location tree: a single root with location_fanout children,
+	// each with as many again, location_depth levels down.
+	unsigned int location_depth;
+	unsigned int location_fanout;
+	// The fraction of users with each flag.
+	double with_picture;
+	double single;
+	double online;
+	double new_users;
+	double active_recently;
+	double birthday;
+
+	Synthetic_spec_t();
+};
+
+class Synthetic_data {
+public:
+	// Fill data, which should be empty, with users made up as spec says,
+	// and build the indexes as a load would (see Load::build_indexes).
+	// program_options must be set, for name_trigrams and composite_index.
+	static void generate(const Synthetic_spec_t& spec, All_data_t& data);
+};
+
+#endif
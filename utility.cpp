@@ -30,6 +30,190 @@ Utility::strip_string(const std::string& in, bool keep_space) {
 	return downcase(out);
 }
 
+namespace {
+
+// Plain ASCII spellings for accented Latin letters, by range of code
+// points.  An empty spelling means the character is dropped.
+struct Transliteration_t {
+	unsigned int first;
+	unsigned int last;
+	const char *ascii;
+};
+
+const Transliteration_t transliterations[] = {
+	// Latin-1 Supplement
+	{ 0xAA, 0xAA, "a" }, { 0xBA, 0xBA, "o" },
+	{ 0xC0, 0xC5, "a" }, { 0xC6, 0xC6, "ae" }, { 0xC7, 0xC7, "c" },
+	{ 0xC8, 0xCB, "e" }, { 0xCC, 0xCF, "i" }, { 0xD0, 0xD0, "d" },
+	{ 0xD1, 0xD1, "n" }, { 0xD2, 0xD6, "o" }, { 0xD7, 0xD7, "" },
+	{ 0xD8, 0xD8, "o" }, { 0xD9, 0xDC, "u" }, { 0xDD, 0xDD, "y" },
+	{ 0xDE, 0xDE, "th" }, { 0xDF, 0xDF, "ss" },
+	{ 0xE0, 0xE5, "a" }, { 0xE6, 0xE6, "ae" }, { 0xE7, 0xE7, "c" },
+	{ 0xE8, 0xEB, "e" }, { 0xEC, 0xEF, "i" }, { 0xF0, 0xF0, "d" },
+	{ 0xF1, 0xF1, "n" }, { 0xF2, 0xF6, "o" }, { 0xF7, 0xF7, "" },
+	{ 0xF8, 0xF8, "o" }, { 0xF9, 0xFC, "u" }, { 0xFD, 0xFD, "y" },
+	{ 0xFE, 0xFE, "th" }, { 0xFF, 0xFF, "y" },
+	// Latin Extended-A
+	{ 0x100, 0x105, "a" }, { 0x106, 0x10D, "c" }, { 0x10E, 0x111, "d" },
+	{ 0x112, 0x11B, "e" }, { 0x11C, 0x123, "g" }, { 0x124, 0x127, "h" },
+	{ 0x128, 0x131, "i" }, { 0x132, 0x133, "ij" }, { 0x134, 0x135, "j" },
+	{ 0x136, 0x138, "k" }, { 0x139, 0x142, "l" }, { 0x143, 0x14B, "n" },
+	{ 0x14C, 0x151, "o" }, { 0x152, 0x153, "oe" }, { 0x154, 0x159, "r" },
+	{ 0x15A, 0x161, "s" }, { 0x162, 0x167, "t" }, { 0x168, 0x173, "u" },
+	{ 0x174, 0x175, "w" }, { 0x176, 0x178, "y" }, { 0x179, 0x17E, "z" },
+	{ 0x17F, 0x17F, "s" }
+};
+
+const size_t num_transliterations =
+	sizeof(transliterations) / sizeof(transliterations[0]);
+
+// Is this code point punctuation, a symbol, or otherwise not part of a
+// name?
+bool ignorable(unsigned int cp) {
+	return (cp < 0x20) ||
+		((cp >= 0x7F) && (cp < 0xC0)) ||    // Latin-1 controls, symbols
+		((cp >= 0x2B0) && (cp < 0x370)) ||  // Modifiers, combining accents
+		((cp >= 0x2000) && (cp < 0x2C00)) ||  // Punctuation, symbols
+		((cp >= 0x3000) && (cp < 0x3040)) ||  // CJK punctuation
+		((cp >= 0xD800) && (cp < 0xE000)) ||  // Surrogates
+		((cp >= 0xFE00) && (cp < 0xFE10)) ||  // Variation selectors
+		(cp >= 0x1F000);                      // Emoji and the like
+}
+
+// Lower-case a code point outside of Latin-1 and Latin Extended-A.
+unsigned int fold_case(unsigned int cp) {
+	if ((cp >= 0x391) && (cp <= 0x3AB) && (cp != 0x3A2)) {
+		return cp + 0x20;  // Greek
+	}
+	if (cp == 0x3C2) {
+		return 0x3C3;      // Final sigma
+	}
+	if ((cp >= 0x410) && (cp <= 0x42F)) {
+		return cp + 0x20;  // Cyrillic
+	}
+	if ((cp >= 0x400) && (cp <= 0x40F)) {
+		return cp + 0x50;  // Cyrillic with diacritics
+	}
+	if ((cp >= 0xFF01) && (cp <= 0xFF5E)) {
+		return cp - 0xFEE0;  // Fullwidth ASCII
+	}
+	return cp;
+}
+
+}
+
+std::string
+Utility::normalize_name(const std::string& in, bool keep_space) {
+	std::string out;
+	out.reserve(in.length());
+	size_t pos = 0;
+	while (pos < in.length()) {
+		unsigned int cp = fold_case(next_code_point(in, pos));
+		if (cp < 0x80) {
+			if (::isalnum(cp)) {
+				out += static_cast<char>(::tolower(cp));
+			} else if (keep_space && (cp == ' ')) {
+				out += ' ';
+			}
+			continue;
+		}
+		if (cp < 0x180) {
+			for (size_t i = 0; i < num_transliterations; ++i) {
+				if ((cp >= transliterations[i].first) &&
+					(cp <= transliterations[i].last)) {
+
+					out += transliterations[i].ascii;
+					break;
+				}
+			}
+			continue;
+		}
+		if (!ignorable(cp)) {
+			append_utf8(cp, out);
+		}
+	}
+	return out;
+}
+
+unsigned int
+Utility::next_code_point(const std::string& in, size_t& pos) {
+	return next_code_point(in.data(), in.length(), pos);
+}
+
+unsigned int
+Utility::next_code_point(const char *in, size_t length, size_t& pos) {
+	unsigned char lead = in[pos];
+	size_t bytes;
+	unsigned int cp;
+	if (lead < 0x80) {
+		++pos;
+		return lead;
+	} else if ((lead >= 0xC2) && (lead < 0xE0)) {
+		bytes = 2;
+		cp = lead & 0x1F;
+	} else if ((lead >= 0xE0) && (lead < 0xF0)) {
+		bytes = 3;
+		cp = lead & 0x0F;
+	} else if ((lead >= 0xF0) && (lead < 0xF5)) {
+		bytes = 4;
+		cp = lead & 0x07;
+	} else {
+		++pos;
+		return lead;
+	}
+	if (pos + bytes > length) {
+		++pos;
+		return lead;
+	}
+	for (size_t i = 1; i < bytes; ++i) {
+		unsigned char next = in[pos + i];
+		if ((next & 0xC0) != 0x80) {
+			++pos;
+			return lead;
+		}
+		cp = (cp << 6) | (next & 0x3F);
+	}
+	// Reject overlong encodings and values past the end of Unicode.
+	if (((bytes == 3) && (cp < 0x800)) ||
+		((bytes == 4) && ((cp < 0x10000) || (cp > 0x10FFFF)))) {
+
+		++pos;
+		return lead;
+	}
+	pos += bytes;
+	return cp;
+}
+
+Code_points_t
+Utility::code_points(const std::string& in) {
+	Code_points_t out;
+	out.reserve(in.length());
+	size_t pos = 0;
+	while (pos < in.length()) {
+		out.push_back(next_code_point(in, pos));
+	}
+	return out;
+}
+
+void
+Utility::append_utf8(unsigned int cp, std::string& out) {
+	if (cp < 0x80) {
+		out += static_cast<char>(cp);
+	} else if (cp < 0x800) {
+		out += static_cast<char>(0xC0 | (cp >> 6));
+		out += static_cast<char>(0x80 | (cp & 0x3F));
+	} else if (cp < 0x10000) {
+		out += static_cast<char>(0xE0 | (cp >> 12));
+		out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+		out += static_cast<char>(0x80 | (cp & 0x3F));
+	} else {
+		out += static_cast<char>(0xF0 | (cp >> 18));
+		out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+		out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+		out += static_cast<char>(0x80 | (cp & 0x3F));
+	}
+}
+
 std::string
 Utility::downcase(const std::string& in) {
 	std::string out(in);
@@ -50,3 +234,20 @@ Utility::strip_whitespace(const std::string& in) {
 	return out;	
 }
 
+size_t
+Utility::heap_bytes(size_t bytes) {
+	if (bytes == 0) {
+		return 0;
+	}
+	size_t block = (bytes + sizeof(size_t) + 15) & ~static_cast<size_t>(15);
+	return std::max(block, static_cast<size_t>(32));
+}
+
+size_t
+Utility::heap_bytes(const std::string& text) {
+	// Short strings are kept inside the std::string.
+	if (text.capacity() <= 15) {
+		return 0;
+	}
+	return heap_bytes(text.capacity() + 1);
+}
@@ -2,6 +2,10 @@
 #define _UTILITY_H_
 
 #include <string>
+#include <vector>
+
+// Unicode code points
+typedef std::vector<unsigned int> Code_points_t;
 
 class Utility {
 public:
@@ -14,11 +18,55 @@ public:
 	// Strip all non-alphabetic characters and convert to lower-case.
 	static std::string strip_string(const std::string& in, bool keep_space = false);
 
+	// Normalize a UTF-8 name for indexing and searching: letters are
+	// lower-cased and Latin letters lose their accents (so an e with an
+	// acute accent becomes a plain "e", and a sharp s becomes "ss"), digits
+	// and letters from other scripts are kept, and everything else
+	// (punctuation, symbols, and spaces unless keep_space) is dropped.
+	// Bytes which are not valid UTF-8 are taken to be Latin-1.
+	static std::string normalize_name(const std::string& in,
+		bool keep_space = false);
+
+	// Decode the code point starting at in[pos], advancing pos past it.
+	// Bytes which are not valid UTF-8 are taken to be Latin-1.
+	static unsigned int next_code_point(const std::string& in, size_t& pos);
+	static unsigned int next_code_point(const char *in, size_t length,
+		size_t& pos);
+
+	// Decode all the code points in in.
+	static Code_points_t code_points(const std::string& in);
+
+	// Append code point cp to out, encoded as UTF-8.
+	static void append_utf8(unsigned int cp, std::string& out);
+
 	// Convert to lower-case
 	static std::string downcase(const std::string& in);
 	
 	// Remove all whitespace
 	static std::string strip_whitespace(const std::string& in);
+
+	// Bytes malloc really takes to hand out a block of bytes, as glibc
+	// does it: a size_t of header, rounded up to 16 bytes, 32 at least.
+	static size_t heap_bytes(size_t bytes);
+
+	// Bytes on the heap behind a string, if it is too long to be kept in
+	// the string itself.
+	static size_t heap_bytes(const std::string& text);
+
+	// Bytes on the heap behind a std::set or std::map: one block per
+	// entry, each with the tree's colour and three pointers.
+	template <typename Tree>
+	static size_t tree_heap_bytes(const Tree& tree) {
+		return tree.size() * heap_bytes(4 * sizeof(void *) +
+			sizeof(typename Tree::value_type));
+	}
+
+	// Bytes on the heap behind a vector.
+	template <typename Vector>
+	static size_t vector_heap_bytes(const Vector& vector) {
+		return heap_bytes(vector.capacity() *
+			sizeof(typename Vector::value_type));
+	}
 };
 
 #endif
@@ -10,6 +10,7 @@
 #include "data_structures.h"
 #include "load.h"
 #include "program_options.h"
+#include "query_capture.h"
 #include "server.h"
 #include "stats.h"
 
@@ -35,6 +36,10 @@ void parent();
 // Handle data loading and searching.
 void child();
 
+// Replay the most frequent recorded queries against freshly loaded data,
+// before we take over from the old child.
+void warm_up();
+
 char *program_name;
 pid_t parent_pid;
 
@@ -117,6 +122,8 @@ void child() {
 	tout_val.it_value.tv_usec = 0;
 	setitimer(ITIMER_REAL, &tout_val, 0);
 	signal(SIGALRM, reload_data_fast);
+
+	warm_up();
 	
 	// Start up our own server
 	try {
@@ -136,6 +143,42 @@ void child() {
 	curl_global_cleanup();
 }
 
+void warm_up() {
+	std::string path = program_options->query_capture_file();
+	int count = program_options->warmup_queries();
+	if (path.empty() || (count <= 0)) {
+		return;
+	}
+
+	struct timeval tv_start, tv_end;
+	gettimeofday(&tv_start, NULL);
+	std::vector<Request_t> requests;
+	requests = Query_capture_t::top_requests(path, count);
+	Search search(data);
+	for (std::vector<Request_t>::const_iterator it = requests.begin();
+		it != requests.end();
+		++it) {
+
+		try {
+			it->run(search);
+		} catch (char const *e) {
+			if (program_options->verbose() >= 1) {
+				std::cout << "Warmup query failed: " << e << std::endl;
+			}
+		}
+	}
+	gettimeofday(&tv_end, NULL);
+
+	if (program_options->verbose() >= 1) {
+		// In milliseconds
+		unsigned long time_spent;
+		time_spent = (tv_end.tv_sec - tv_start.tv_sec) * 1000;
+		time_spent += (tv_end.tv_usec - tv_start.tv_usec) / 1000;
+		std::cout << "Warmed up with " << requests.size() << " queries in " <<
+			time_spent << "ms" << std::endl;
+	}
+}
+
 void reload_data_fast(int) {
 	// Mask the SIGALRM signal
 	sigset_t new_set;